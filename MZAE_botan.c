@@ -24,27 +24,75 @@
 
 #include <botan/ffi.h>
 
-#ifdef BYTE_ORDER_1234
-void betole64(uint64_t *x) {
-*x = (*x & 0x00000000FFFFFFFF) << 32 | (*x & 0xFFFFFFFF00000000) >> 32;
-*x = (*x & 0x0000FFFF0000FFFF) << 16 | (*x & 0xFFFF0000FFFF0000) >> 16;
-*x = (*x & 0x00FF00FF00FF00FF) << 8  | (*x & 0xFF00FF00FF00FF00) >> 8;
-}
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MZAE_SSE2
+	#include <emmintrin.h>
 #endif
 
+#define MZAE_CTR_BATCH		256	// counter blocks encrypted by each library call
 
+typedef struct {
+	botan_block_cipher_t cipher;
+	unsigned long long counter;
+	unsigned int used;
+	unsigned int avail;
+	unsigned char counters[16*MZAE_CTR_BATCH];
+	unsigned char keystream[16*MZAE_CTR_BATCH];
+} MZAE_CTR_CTX;
 
-int MZAE_gen_salt(char* salt, int saltlen)
+
+
+// The engine is the system random generator
+int MZAE_engine_init(void** engine)
 {
 	botan_rng_t rng;
 
+	if (botan_rng_init(&rng, "system"))
+		return 1;
+
+	*engine = rng;
+
+	return 0;
+}
+
+
+
+void MZAE_engine_end(void* engine)
+{
+	if (engine)
+		botan_rng_destroy((botan_rng_t) engine);
+}
+
+
+
+int MZAE_gen_salt(char* salt, int saltlen)
+{
+	return MZAE_gen_salt_ex(0, salt, saltlen);
+}
+
+
+
+int MZAE_gen_salt_ex(void* engine, char* salt, int saltlen)
+{
+	botan_rng_t rng = (botan_rng_t) engine;
+	int r = 0;
+
 	if (saltlen != 8 && saltlen != 12 && saltlen != 16)
 		return 1;
 	
-	if (botan_rng_init(&rng, "system") ||	botan_rng_get(rng, salt, saltlen))
+	if (!engine && botan_rng_init(&rng, "system"))
 		return 2;
+
+	if (botan_rng_get(rng, salt, saltlen))
+		r = 2;
+
+	if (!engine)
+		botan_rng_destroy(rng);
 	
-	return 0;
+	return r;
 }
 
 
@@ -67,8 +115,11 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 	if (! kdfbuf)
 		return 2;
 	
-	if (botan_pwdhash("PBKDF2(SHA-1)", 1000, 0, 0, kdfbuf, 2*keylen+2, password, 0, salt, saltlen))
+	if (MZAE_pbkdf2_sha1(password, strlen(password), salt, saltlen, 1000, kdfbuf, 2*keylen+2))
+	{
+		free(kdfbuf);
 		return 3;
+	}
 	
 	*aes_key = kdfbuf;
 	*hmac_key = kdfbuf+keylen;
@@ -79,63 +130,153 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 
 
 
-int MZAE_ctr_crypt(char* key, uint32_t keylen, char* src, uint32_t srclen, char** dst)
+static int ctr_setup(MZAE_CTR_CTX *c, char* key, unsigned int keylen)
 {
-	botan_block_cipher_t cipher;
-	char ctr_counter_le[16];
-	char ctr_encrypted_counter[16];
-#ifdef BYTE_ORDER_1234
-	char ctr_counter_be[16];
-#endif
-	const char* p = ctr_encrypted_counter;
-	const char* q = p+8;
-	char *pbuf;
-	uint32_t i, ilen, olen;
+	char *algo;
 
-	if (!keylen || !srclen)
-		return -1;
+	if (keylen == 16)
+		algo = "AES-128";
+	else if (keylen == 24)
+		algo = "AES-192";
+	else if (keylen == 32)
+		algo = "AES-256";
+	else
+		return 1;
+
+	if (botan_block_cipher_init(&c->cipher, algo))
+		return 1;
 
-	if (botan_block_cipher_init(&cipher, "AES-256") || botan_block_cipher_set_key(cipher, key, keylen))
+	if (botan_block_cipher_set_key(c->cipher, key, keylen))
+	{
+		botan_block_cipher_destroy(c->cipher);
 		return 1;
+	}
+
+	c->counter = 0;
+	c->used = c->avail = 0;
+	memset(c->counters, 0, sizeof(c->counters));
+
+	return 0;
+}
 
+
+
+static void ctr_cleanup(MZAE_CTR_CTX *c)
+{
+	botan_block_cipher_destroy(c->cipher);
+	memset(c, 0, sizeof(MZAE_CTR_CTX));
+}
+
+
+
+// Encrypts a batch of little endian counter blocks into the keystream buffer
+static int ctr_refill(MZAE_CTR_CTX *c, unsigned int len)
+{
+	unsigned char *p = c->counters;
+	unsigned int i, blocks = (len + 15) / 16;
+
+	if (blocks > MZAE_CTR_BATCH)
+		blocks = MZAE_CTR_BATCH;
+
+	for (i=0; i < blocks; i++, p+=16) {
+		c->counter++;
 #ifdef BYTE_ORDER_1234
-	memset(ctr_counter_be, 0, 16);
+		p[0] = (unsigned char) c->counter;
+		p[1] = (unsigned char) (c->counter >> 8);
+		p[2] = (unsigned char) (c->counter >> 16);
+		p[3] = (unsigned char) (c->counter >> 24);
+		p[4] = (unsigned char) (c->counter >> 32);
+		p[5] = (unsigned char) (c->counter >> 40);
+		p[6] = (unsigned char) (c->counter >> 48);
+		p[7] = (unsigned char) (c->counter >> 56);
 #else
-	memset(ctr_counter_le, 0, 16);
+		memcpy(p, &c->counter, 8);
 #endif
-	
-	*dst = pbuf = (char*) malloc(srclen);
-	if (!pbuf)
-		return 2;
+	}
+
+	if (botan_block_cipher_encrypt_blocks(c->cipher, c->counters, c->keystream, blocks))
+		return 1;
 
-	for (i=0; i < srclen/16; i++) {
-#ifndef BYTE_ORDER_1234
-		(*((uint64_t*) ctr_counter_le))++;
-#else	
-		(*((uint64_t*) ctr_counter_be))++;
-		*((uint64_t*) ctr_counter_le) = *((uint64_t*) ctr_counter_be);
-		betole64((uint64_t*)ctr_counter_le);
+	c->used = 0;
+	c->avail = blocks*16;
+
+	return 0;
+}
+
+
+
+// XORs data with the keystream, 16 or 8 bytes at a time
+static void ctr_xor(char* dst, char* src, unsigned char* ks, unsigned int len)
+{
+#ifdef MZAE_SSE2
+	for (; len >= 16; len-=16, dst+=16, src+=16, ks+=16)
+		_mm_storeu_si128((__m128i*) dst, _mm_xor_si128(_mm_loadu_si128((__m128i*) src), _mm_loadu_si128((__m128i*) ks)));
+#else
+	unsigned long long a, b;
+
+	for (; len >= 8; len-=8, dst+=8, src+=8, ks+=8) {
+		memcpy(&a, src, 8);
+		memcpy(&b, ks, 8);
+		a ^= b;
+		memcpy(dst, &a, 8);
+	}
 #endif
-		botan_block_cipher_encrypt_blocks(cipher, ctr_counter_le, ctr_encrypted_counter, 1);
-		*((uint64_t*) pbuf) = *((uint64_t*) src) ^ *((uint64_t*) p);
-		pbuf+=sizeof(uint64_t);
-		src+=sizeof(uint64_t);
-		*((uint64_t*) pbuf) = *((uint64_t*) src) ^ *((uint64_t*) q);
-		pbuf+=sizeof(uint64_t);
-		src+=sizeof(uint64_t);
+	while (len--)
+		*dst++ = *src++ ^ *ks++;
+}
+
+
+
+int MZAE_ctr_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_ctr_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_ctr_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	MZAE_CTR_CTX *c;
+
+	(void) engine;
+	if (!keylen)
+		return -1;
+
+	c = (MZAE_CTR_CTX*) malloc(sizeof(MZAE_CTR_CTX));
+	if (!c)
+		return 2;
+
+	if (ctr_setup(c, key, keylen))
+	{
+		free(c);
+		return 1;
 	}
 
-	if ((i = srclen%16)) {
-#ifndef BYTE_ORDER_1234
-		(*((uint64_t*) ctr_counter_le))++;
-#else	
-		(*((uint64_t*) ctr_counter_be))++;
-		*((uint64_t*) ctr_counter_le) = *((uint64_t*) ctr_counter_be);
-		betole64((uint64_t*)ctr_counter_le);
-#endif
-		botan_block_cipher_encrypt_blocks(cipher, ctr_counter_le, ctr_encrypted_counter, 1);
-		while (i--)
-			*pbuf++ = *src++ ^ *p++;
+	*ctx = c;
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_update(void* ctx, char* src, unsigned int srclen, char* dst)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+	unsigned int n;
+
+	while (srclen) {
+		if (c->used == c->avail && ctr_refill(c, srclen))
+			return 1;
+
+		n = c->avail - c->used;
+		if (n > srclen)
+			n = srclen;
+
+		ctr_xor(dst, src, c->keystream + c->used, n);
+		c->used += n;
+		src += n;
+		dst += n;
+		srclen -= n;
 	}
 
 	return 0;
@@ -143,22 +284,153 @@ int MZAE_ctr_crypt(char* key, uint32_t keylen, char* src, uint32_t srclen, char*
 
 
 
-int MZAE_hmac_sha1_80(char* key, uint32_t keylen, char* src, uint32_t srclen, char** hmac)
+int MZAE_ctr_seek(void* ctx, unsigned long long offset)
 {
-	botan_mac_t mac;
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+
+	// The block at offset is encrypted with counter offset/16 + 1
+	c->counter = offset / 16;
+	c->used = c->avail = 0;
+
+	if (offset % 16)
+	{
+		if (ctr_refill(c, 16))
+			return 1;
+		c->used = (unsigned int) (offset % 16);
+	}
+
+	return 0;
+}
+
+
+
+void MZAE_ctr_end(void* ctx)
+{
+	if (!ctx)
+		return;
+	ctr_cleanup((MZAE_CTR_CTX*) ctx);
+	free(ctx);
+}
+
+
+
+int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+{
+	void *ctx;
 
 	if (!keylen || !srclen)
 		return -1;
 
-	if (botan_mac_init(&mac, "HMAC(SHA-1)", 0) ||	botan_mac_set_key(mac, key, keylen))
+	*dst = (char*) malloc(srclen);
+	if (! *dst)
+		return 2;
+
+	if (MZAE_ctr_init(key, keylen, &ctx))
+	{
+		free(*dst);
 		return 1;
-	
-	botan_mac_update(mac, src, srclen);
+	}
+
+	MZAE_ctr_update(ctx, src, srclen, *dst);
+	MZAE_ctr_end(ctx);
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_crypt_inplace(char* key, unsigned int keylen, char* buf, unsigned int len)
+{
+	MZAE_CTR_CTX c;
+	int r;
+
+	if (!keylen || !len)
+		return -1;
+
+	if (ctr_setup(&c, key, keylen))
+		return 1;
+
+	r = MZAE_ctr_update(&c, buf, len, buf);
+	ctr_cleanup(&c);
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_hmac_sha1_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_hmac_sha1_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	botan_mac_t mac;
+
+	(void) engine;
+	if (!keylen)
+		return -1;
+
+	if (botan_mac_init(&mac, "HMAC(SHA-1)", 0))
+		return 1;
+
+	if (botan_mac_set_key(mac, key, keylen))
+	{
+		botan_mac_destroy(mac);
+		return 1;
+	}
+
+	*ctx = mac;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_update(void* ctx, char* src, unsigned int srclen)
+{
+	if (srclen && botan_mac_update((botan_mac_t) ctx, src, srclen))
+		return 1;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_final(void* ctx, char* hmac)
+{
+	int r = 0;
+
+	if (botan_mac_final((botan_mac_t) ctx, hmac))
+		r = 1;
+
+	botan_mac_destroy((botan_mac_t) ctx);
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
+{
+	void *ctx;
+
+	if (!keylen || !srclen)
+		return -1;
 
 	*hmac = (char*) malloc(20);
 	if (! *hmac)
 		return 2;
-	botan_mac_final(mac, *hmac);
 
-	return 0;
+	if (MZAE_hmac_sha1_init(key, keylen, &ctx))
+	{
+		free(*hmac);
+		return 1;
+	}
+
+	MZAE_hmac_sha1_update(ctx, src, srclen);
+
+	return MZAE_hmac_sha1_final(ctx, *hmac);
 }
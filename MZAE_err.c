@@ -53,5 +53,17 @@ char* MZAE_errmsg(int code)
 		return "Wrong password";
 	if (code == MZAE_ERR_NOPW)
 		return "Empty password";
+	if (code == MZAE_ERR_SINK)
+		return "Can't write the output";
+	if (code == MZAE_ERR_NOENTRY)
+		return "Entry not found in the archive";
+	if (code == MZAE_ERR_SOURCE)
+		return "Can't read the archive";
+	if (code == MZAE_ERR_COMPRESSED)
+		return "The entry is compressed";
+	if (code == MZAE_ERR_TOOBIG)
+		return "Entry over 4 GiB without ZIP64 header";
+	if (code == MZAE_ERR_NOSTATS)
+		return "Statistics not built in the library";
 	return "Unknown error";
 }
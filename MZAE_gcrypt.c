@@ -25,22 +25,67 @@
 #include <gcrypt.h>
 
 
-#ifdef BYTE_ORDER_1234
-void betole64(unsigned long long *x) {
-*x = (*x & 0x00000000FFFFFFFF) << 32 | (*x & 0xFFFFFFFF00000000) >> 32;
-*x = (*x & 0x0000FFFF0000FFFF) << 16 | (*x & 0xFFFF0000FFFF0000) >> 16;
-*x = (*x & 0x00FF00FF00FF00FF) << 8  | (*x & 0xFF00FF00FF00FF00) >> 8;
-}
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MZAE_SSE2
+	#include <emmintrin.h>
 #endif
 
+#define MZAE_CTR_BATCH		256	// counter blocks encrypted by each library call
+
+typedef struct {
+	gcry_cipher_hd_t cipher;
+	unsigned long long counter;
+	unsigned int used;
+	unsigned int avail;
+	unsigned char counters[16*MZAE_CTR_BATCH];
+	unsigned char keystream[16*MZAE_CTR_BATCH];
+} MZAE_CTR_CTX;
+
+static char engine_tag;	// the engine holds no state
+
+
+
+// Completes the library initialization once, as an application should do
+int MZAE_engine_init(void** engine)
+{
+	if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P))
+	{
+		if (!gcry_check_version(GCRYPT_VERSION))
+			return 1;
+		gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+	}
+
+	*engine = &engine_tag;
+
+	return 0;
+}
+
+
+
+void MZAE_engine_end(void* engine)
+{
+	(void) engine;
+}
+
 
 
 int MZAE_gen_salt(char* salt, int saltlen)
 {
+	return MZAE_gen_salt_ex(0, salt, saltlen);
+}
+
+
+
+int MZAE_gen_salt_ex(void* engine, char* salt, int saltlen)
+{
+	(void) engine;
 	if (saltlen != 8 && saltlen != 12 && saltlen != 16)
 		return 1;
 	
-	memcpy(salt, gcry_random_bytes(saltlen, 1), saltlen);
+	gcry_randomize(salt, saltlen, GCRY_STRONG_RANDOM);
 
 	return 0;
 }
@@ -65,8 +110,11 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 	if (! kdfbuf)
 		return 2;
 	
-	if (gcry_kdf_derive(password, strlen(password), GCRY_KDF_PBKDF2, GCRY_MD_SHA1, salt, saltlen, 1000, 2*keylen+2, kdfbuf))
+	if (MZAE_pbkdf2_sha1(password, strlen(password), salt, saltlen, 1000, kdfbuf, 2*keylen+2))
+	{
+		free(kdfbuf);
 		return 3;
+	}
 	
 	*aes_key = kdfbuf;
 	*hmac_key = kdfbuf+keylen;
@@ -77,91 +125,308 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 
 
 
-int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+static int ctr_setup(MZAE_CTR_CTX *c, char* key, unsigned int keylen)
 {
-	gcry_cipher_hd_t cipher;
-	char ctr_counter_le[16];
-	char ctr_encrypted_counter[16];
-#ifdef BYTE_ORDER_1234
-	char ctr_counter_be[16];
-#endif
-	const char* p = ctr_encrypted_counter;
-	const char* q = p+8;
-	char *pbuf;
-	unsigned int i, ilen, olen;
+	int algo;
 
-	if (!keylen || !srclen)
-		return -1;
+	if (keylen == 16)
+		algo = GCRY_CIPHER_AES128;
+	else if (keylen == 24)
+		algo = GCRY_CIPHER_AES192;
+	else if (keylen == 32)
+		algo = GCRY_CIPHER_AES256;
+	else
+		return 1;
 
-	if (gcry_cipher_open(&cipher, GCRY_CIPHER_AES256, 1, 0) || gcry_cipher_setkey(cipher, key, keylen))
+	if (gcry_cipher_open(&c->cipher, algo, GCRY_CIPHER_MODE_ECB, 0))
 		return 1;
 
+	if (gcry_cipher_setkey(c->cipher, key, keylen))
+	{
+		gcry_cipher_close(c->cipher);
+		return 1;
+	}
+
+	c->counter = 0;
+	c->used = c->avail = 0;
+	memset(c->counters, 0, sizeof(c->counters));
+
+	return 0;
+}
+
+
+
+static void ctr_cleanup(MZAE_CTR_CTX *c)
+{
+	gcry_cipher_close(c->cipher);
+	memset(c, 0, sizeof(MZAE_CTR_CTX));
+}
+
+
+
+// Encrypts a batch of little endian counter blocks into the keystream buffer
+static int ctr_refill(MZAE_CTR_CTX *c, unsigned int len)
+{
+	unsigned char *p = c->counters;
+	unsigned int i, blocks = (len + 15) / 16;
+
+	if (blocks > MZAE_CTR_BATCH)
+		blocks = MZAE_CTR_BATCH;
+
+	for (i=0; i < blocks; i++, p+=16) {
+		c->counter++;
 #ifdef BYTE_ORDER_1234
-	memset(ctr_counter_be, 0, 16);
+		p[0] = (unsigned char) c->counter;
+		p[1] = (unsigned char) (c->counter >> 8);
+		p[2] = (unsigned char) (c->counter >> 16);
+		p[3] = (unsigned char) (c->counter >> 24);
+		p[4] = (unsigned char) (c->counter >> 32);
+		p[5] = (unsigned char) (c->counter >> 40);
+		p[6] = (unsigned char) (c->counter >> 48);
+		p[7] = (unsigned char) (c->counter >> 56);
 #else
-	memset(ctr_counter_le, 0, 16);
+		memcpy(p, &c->counter, 8);
 #endif
-	
-	*dst = pbuf = (char*) malloc(srclen);
-	if (!pbuf)
-		return 2;
+	}
+
+	if (gcry_cipher_encrypt(c->cipher, c->keystream, blocks*16, c->counters, blocks*16))
+		return 1;
+
+	c->used = 0;
+	c->avail = blocks*16;
 
-	for (i=0; i < srclen/16; i++) {
-#ifndef BYTE_ORDER_1234
-		(*((unsigned long long*) ctr_counter_le))++;
-#else	
-		(*((unsigned long long*) ctr_counter_be))++;
-		*((unsigned long long*) ctr_counter_le) = *((unsigned long long*) ctr_counter_be);
-		betole64((unsigned long long*)ctr_counter_le);
+	return 0;
+}
+
+
+
+// XORs data with the keystream, 16 or 8 bytes at a time
+static void ctr_xor(char* dst, char* src, unsigned char* ks, unsigned int len)
+{
+#ifdef MZAE_SSE2
+	for (; len >= 16; len-=16, dst+=16, src+=16, ks+=16)
+		_mm_storeu_si128((__m128i*) dst, _mm_xor_si128(_mm_loadu_si128((__m128i*) src), _mm_loadu_si128((__m128i*) ks)));
+#else
+	unsigned long long a, b;
+
+	for (; len >= 8; len-=8, dst+=8, src+=8, ks+=8) {
+		memcpy(&a, src, 8);
+		memcpy(&b, ks, 8);
+		a ^= b;
+		memcpy(dst, &a, 8);
+	}
 #endif
-		gcry_cipher_encrypt(cipher, ctr_encrypted_counter, 16, ctr_counter_le, 16);
-		*((unsigned long long*) pbuf) = *((unsigned long long*) src) ^ *((unsigned long long*) p);
-		pbuf+=sizeof(long long);
-		src+=sizeof(long long);
-		*((unsigned long long*) pbuf) = *((unsigned long long*) src) ^ *((unsigned long long*) q);
-		pbuf+=sizeof(long long);
-		src+=sizeof(long long);
+	while (len--)
+		*dst++ = *src++ ^ *ks++;
+}
+
+
+
+int MZAE_ctr_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_ctr_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_ctr_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	MZAE_CTR_CTX *c;
+
+	(void) engine;
+	if (!keylen)
+		return -1;
+
+	c = (MZAE_CTR_CTX*) malloc(sizeof(MZAE_CTR_CTX));
+	if (!c)
+		return 2;
+
+	if (ctr_setup(c, key, keylen))
+	{
+		free(c);
+		return 1;
 	}
 
-	if ((i = srclen%16)) {
-#ifndef BYTE_ORDER_1234
-		(*((unsigned long long*) ctr_counter_le))++;
-#else	
-		(*((unsigned long long*) ctr_counter_be))++;
-		*((unsigned long long*) ctr_counter_le) = *((unsigned long long*) ctr_counter_be);
-		betole64((unsigned long long*)ctr_counter_le);
-#endif
-		gcry_cipher_encrypt(cipher, ctr_encrypted_counter, 16, ctr_counter_le, 16);
-		while (i--)
-			*pbuf++ = *src++ ^ *p++;
+	*ctx = c;
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_update(void* ctx, char* src, unsigned int srclen, char* dst)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+	unsigned int n;
+
+	while (srclen) {
+		if (c->used == c->avail && ctr_refill(c, srclen))
+			return 1;
+
+		n = c->avail - c->used;
+		if (n > srclen)
+			n = srclen;
+
+		ctr_xor(dst, src, c->keystream + c->used, n);
+		c->used += n;
+		src += n;
+		dst += n;
+		srclen -= n;
 	}
 
-	gcry_cipher_close(cipher);
+	return 0;
+}
+
+
+
+int MZAE_ctr_seek(void* ctx, unsigned long long offset)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+
+	// The block at offset is encrypted with counter offset/16 + 1
+	c->counter = offset / 16;
+	c->used = c->avail = 0;
+
+	if (offset % 16)
+	{
+		if (ctr_refill(c, 16))
+			return 1;
+		c->used = (unsigned int) (offset % 16);
+	}
 
 	return 0;
 }
 
 
 
-int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
+void MZAE_ctr_end(void* ctx)
 {
-	gcry_mac_hd_t mac;
-	int olen;
+	if (!ctx)
+		return;
+	ctr_cleanup((MZAE_CTR_CTX*) ctx);
+	free(ctx);
+}
+
+
+
+int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+{
+	void *ctx;
 
 	if (!keylen || !srclen)
 		return -1;
 
-	if (gcry_mac_open(&mac, GCRY_MAC_HMAC_SHA1, 0, 0) || gcry_mac_setkey(mac, key, keylen))
+	*dst = (char*) malloc(srclen);
+	if (! *dst)
+		return 2;
+
+	if (MZAE_ctr_init(key, keylen, &ctx))
+	{
+		free(*dst);
 		return 1;
-	
-	gcry_mac_write(mac, src, srclen);
-	
+	}
+
+	MZAE_ctr_update(ctx, src, srclen, *dst);
+	MZAE_ctr_end(ctx);
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_crypt_inplace(char* key, unsigned int keylen, char* buf, unsigned int len)
+{
+	MZAE_CTR_CTX c;
+	int r;
+
+	if (!keylen || !len)
+		return -1;
+
+	if (ctr_setup(&c, key, keylen))
+		return 1;
+
+	r = MZAE_ctr_update(&c, buf, len, buf);
+	ctr_cleanup(&c);
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_hmac_sha1_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_hmac_sha1_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	gcry_mac_hd_t mac;
+
+	(void) engine;
+	if (!keylen)
+		return -1;
+
+	if (gcry_mac_open(&mac, GCRY_MAC_HMAC_SHA1, 0, 0))
+		return 1;
+
+	if (gcry_mac_setkey(mac, key, keylen))
+	{
+		gcry_mac_close(mac);
+		return 1;
+	}
+
+	*ctx = mac;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_update(void* ctx, char* src, unsigned int srclen)
+{
+	if (srclen && gcry_mac_write((gcry_mac_hd_t) ctx, src, srclen))
+		return 1;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_final(void* ctx, char* hmac)
+{
+	size_t olen = 20;
+	int r = 0;
+
+	if (gcry_mac_read((gcry_mac_hd_t) ctx, hmac, &olen))
+		r = 1;
+
+	gcry_mac_close((gcry_mac_hd_t) ctx);
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
+{
+	void *ctx;
+
+	if (!keylen || !srclen)
+		return -1;
+
 	*hmac = (char*) malloc(20);
 	if (! *hmac)
 		return 2;
-	gcry_mac_read(mac, *hmac, &olen);
-	
-	gcry_mac_close(mac);
 
-	return 0;
+	if (MZAE_hmac_sha1_init(key, keylen, &ctx))
+	{
+		free(*hmac);
+		return 1;
+	}
+
+	MZAE_hmac_sha1_update(ctx, src, srclen);
+
+	return MZAE_hmac_sha1_final(ctx, *hmac);
 }
@@ -0,0 +1,392 @@
+/*
+ *  Copyright (C) 2016, 2020  <maxpat78> <https://github.com/maxpat78>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+Provides the same functions of MZAE_zlib.c on top of libdeflate, which
+compresses and decompresses whole buffers much faster than Zlib.
+
+The incremental functions gather the whole input and process it at the end
+(finish flag, or a zero length chunk when inflating): memory grows with the
+document, in exchange for speed.
+
+Requires libdeflate.
+*/
+#include <mZipAES.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdeflate.h>
+
+typedef struct {
+	struct libdeflate_compressor *c;
+	struct libdeflate_decompressor *d;
+	char *in;
+	size_t inlen;
+	size_t insize;
+	int done;
+} MZAE_LIBDEFLATE_CTX;
+
+
+
+unsigned long MZAE_crc(unsigned long crc, char* src, unsigned int srclen)
+{
+	return libdeflate_crc32(crc, src, srclen);
+}
+
+
+
+// Multiplies a 32x32 bit matrix over GF(2) by a vector
+static unsigned long gf2_times(unsigned long* mat, unsigned long vec)
+{
+	unsigned long sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+
+	return sum;
+}
+
+
+
+static void gf2_square(unsigned long* square, unsigned long* mat)
+{
+	int n;
+
+	for (n=0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+
+
+// Same as Zlib crc32_combine: crc1 is shifted by len2 zero bytes
+unsigned long MZAE_crc_combine(unsigned long crc1, unsigned long crc2, unsigned long len2)
+{
+	unsigned long even[32], odd[32], row = 1;
+	int n;
+
+	// the operator for one zero bit, then for two and four bits
+	odd[0] = 0xEDB88320UL;
+	for (n=1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+
+	// applies len2 zero bytes, squaring the operator for each bit of len2
+	do {
+		gf2_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_times(even, crc1);
+		len2 >>= 1;
+		if (!len2)
+			break;
+		gf2_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+
+
+unsigned long MZAE_deflate_bound(unsigned long srclen)
+{
+	// Stored blocks at worst: 5 bytes every 64K, plus final bits and padding
+	return srclen + 5 * (srclen / 65535 + 1) + 16;
+}
+
+
+
+int MZAE_deflate(char* src, unsigned int srclen, char** dst, unsigned int* dstlen)
+{
+	struct libdeflate_compressor *c;
+	size_t n, bound;
+
+	c = libdeflate_alloc_compressor(MZAE_LEVEL);
+	if (!c)
+		return 2;
+
+	bound = libdeflate_deflate_compress_bound(c, srclen);
+	*dst = (char*) malloc(bound);
+	if (! *dst)
+	{
+		libdeflate_free_compressor(c);
+		return 1;
+	}
+
+	n = libdeflate_deflate_compress(c, src, srclen, *dst, bound);
+	libdeflate_free_compressor(c);
+	if (!n)
+	{
+		free(*dst);
+		*dst = 0;
+		return 3;
+	}
+
+	*dstlen = (unsigned int) n;
+
+	return 0;
+}
+
+
+
+int MZAE_inflate(char* src, unsigned int srclen, char* dst, unsigned int dstlen)
+{
+	struct libdeflate_decompressor *d;
+	enum libdeflate_result r;
+
+	d = libdeflate_alloc_decompressor();
+	if (!d)
+		return 1;
+
+	// the output must fill dst exactly
+	r = libdeflate_deflate_decompress(d, src, srclen, dst, dstlen, NULL);
+	libdeflate_free_decompressor(d);
+
+	return r == LIBDEFLATE_SUCCESS? 0 : 2;
+}
+
+
+
+// A libdeflate stream always ends with its last block, so blocks can't be joined
+int MZAE_deflate_block(int level, char* dict, unsigned int dictlen, char* src, unsigned int srclen, int last, char* dst, unsigned int* dstlen)
+{
+	(void) level;
+	(void) dict;
+	(void) dictlen;
+	(void) src;
+	(void) srclen;
+	(void) last;
+	(void) dst;
+	(void) dstlen;
+
+	// the failure makes the streams deflate on the caller thread
+	return 1;
+}
+
+
+
+// Appends a chunk to the gathered input
+static int gather(MZAE_LIBDEFLATE_CTX* z, char* src, unsigned int srclen)
+{
+	char *p;
+	size_t size;
+
+	if (z->inlen + srclen > z->insize)
+	{
+		size = z->insize? z->insize : MZAE_CHUNK;
+		while (size < z->inlen + srclen)
+			size *= 2;
+		p = (char*) realloc(z->in, size);
+		if (!p)
+			return 1;
+		z->in = p;
+		z->insize = size;
+	}
+	memcpy(z->in + z->inlen, src, srclen);
+	z->inlen += srclen;
+
+	return 0;
+}
+
+
+
+// Emits a buffer in chunks of MZAE_CHUNK bytes
+static int emit(char* buf, size_t len, MZAE_OUTFN out, void* opaque)
+{
+	unsigned int n;
+
+	for (; len; buf += n, len -= n)
+	{
+		n = len < MZAE_CHUNK? (unsigned int) len : MZAE_CHUNK;
+		if (out(opaque, buf, n))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+static void ctx_free(MZAE_LIBDEFLATE_CTX* z)
+{
+	if (z->c)
+		libdeflate_free_compressor(z->c);
+	if (z->d)
+		libdeflate_free_decompressor(z->d);
+	free(z->in);
+	free(z);
+}
+
+
+
+int MZAE_deflate_init(void** ctx, int level)
+{
+	MZAE_LIBDEFLATE_CTX *z = (MZAE_LIBDEFLATE_CTX*) calloc(1, sizeof(MZAE_LIBDEFLATE_CTX));
+
+	if (!z)
+		return 1;
+
+	z->c = libdeflate_alloc_compressor(level);
+	if (!z->c)
+	{
+		free(z);
+		return 2;
+	}
+
+	*ctx = z;
+
+	return 0;
+}
+
+
+
+int MZAE_deflate_update(void* ctx, char* src, unsigned int srclen, int finish, MZAE_OUTFN out, void* opaque)
+{
+	MZAE_LIBDEFLATE_CTX *z = (MZAE_LIBDEFLATE_CTX*) ctx;
+	char *dst;
+	size_t n, bound;
+	int r = 0;
+
+	if (z->done)
+		return 3;
+
+	if (srclen && gather(z, src, srclen))
+		return 1;
+
+	if (!finish)
+		return 0;
+
+	z->done = 1;
+	bound = libdeflate_deflate_compress_bound(z->c, z->inlen);
+	dst = (char*) malloc(bound);
+	if (!dst)
+		return 1;
+
+	n = libdeflate_deflate_compress(z->c, z->in, z->inlen, dst, bound);
+	if (!n)
+		r = 3;
+	else if (emit(dst, n, out, opaque))
+		r = 4;
+
+	free(dst);
+
+	return r;
+}
+
+
+
+void MZAE_deflate_end(void* ctx)
+{
+	if (!ctx)
+		return;
+	ctx_free((MZAE_LIBDEFLATE_CTX*) ctx);
+}
+
+
+
+int MZAE_inflate_init(void** ctx)
+{
+	MZAE_LIBDEFLATE_CTX *z = (MZAE_LIBDEFLATE_CTX*) calloc(1, sizeof(MZAE_LIBDEFLATE_CTX));
+
+	if (!z)
+		return 1;
+
+	z->d = libdeflate_alloc_decompressor();
+	if (!z->d)
+	{
+		free(z);
+		return 2;
+	}
+
+	*ctx = z;
+
+	return 0;
+}
+
+
+
+int MZAE_inflate_update(void* ctx, char* src, unsigned int srclen, MZAE_OUTFN out, void* opaque)
+{
+	MZAE_LIBDEFLATE_CTX *z = (MZAE_LIBDEFLATE_CTX*) ctx;
+	enum libdeflate_result r;
+	char *dst = 0, *p;
+	size_t size, inlen, outlen;
+	int err;
+
+	if (z->done)
+		return srclen? 3 : 0;
+
+	if (srclen)
+		return gather(z, src, srclen);
+
+	// End of input: the output size is unknown, so the buffer grows until it
+	// fits, up to the highest Deflate ratio (about 1032:1)
+	size = z->inlen * 4 > MZAE_CHUNK? z->inlen * 4 : MZAE_CHUNK;
+	do {
+		if (size / 2 > z->inlen * 1032 + MZAE_CHUNK)
+		{
+			free(dst);
+			return 2;
+		}
+		p = (char*) realloc(dst, size);
+		if (!p)
+		{
+			free(dst);
+			return 1;
+		}
+		dst = p;
+		r = libdeflate_deflate_decompress_ex(z->d, z->in, z->inlen, dst, size, &inlen, &outlen);
+		size *= 2;
+	} while (r == LIBDEFLATE_INSUFFICIENT_SPACE);
+
+	if (r != LIBDEFLATE_SUCCESS)
+	{
+		free(dst);
+		return 2;
+	}
+
+	z->done = 1;
+
+	// No data can follow the end of the Deflate stream
+	if (inlen != z->inlen)
+	{
+		free(dst);
+		return 3;
+	}
+
+	err = emit(dst, outlen, out, opaque)? 4 : 0;
+	free(dst);
+
+	return err;
+}
+
+
+
+int MZAE_inflate_end(void* ctx)
+{
+	int r;
+
+	if (!ctx)
+		return 1;
+	r = ((MZAE_LIBDEFLATE_CTX*) ctx)->done? 0 : 1;
+	ctx_free((MZAE_LIBDEFLATE_CTX*) ctx);
+
+	return r;
+}
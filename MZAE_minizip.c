@@ -32,6 +32,9 @@
   NOTES:
   - 6) and 7) apply to newer V2 format: files are always saved in V2 format
   but it can open old V1 format transparently.
+  - MZAE_zip_create/add/close write archives of many entries, with any name
+  and not reversed, and MZAE_zip_read extracts one of them through the
+  central directory.
 
   A summary of ZIP archive with strong encryption layout (according to WinZip
   specs: look at http://www.winzip.com/aes_info.htm) follows.
@@ -113,190 +116,236 @@
 #include <string.h>
 #include <time.h>
 
+#if defined(MZAE_PROFILE) && defined(_WIN32)
+	#include <windows.h>
+#endif
+
+#if !defined(MZAE_PORTABLE) && (defined(__SSSE3__) || defined(__AVX__))
+	#define MZAE_REV_SIMD
+	#define MZAE_REV_SSSE3
+	#include <tmmintrin.h>
+#elif !defined(MZAE_PORTABLE) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define MZAE_REV_SIMD
+	#include <emmintrin.h>
+#endif
+
 #ifdef BYTE_ORDER_1234
 	// In the ZIP format numbers are Little Endian
 	#define BS16(x) (x & 0xFF00) >> 8 | (x & 0xFF) << 8
 	#define BS32(x) (x & 0xFF000000) >> 24 | ((x & 0xFF0000) >> 16) << 8 | ((x & 0xFF00) >> 8) << 16 | (x & 0xFF) << 24 
 #endif
 
-#define memrev(m, l) { \
-char *t = m; \
-char *b = m+l-1; \
-while (b > t) { \
-	char c = *t; \
-	*t=*b; *b=c; \
-	t++; b--; \
-} \
-}
+#ifdef BYTE_ORDER_1234
+	#define PDW(a, b) *((int*)(p+a)) = BS32(b)
+	#define PW(a, b) *((short*)(p+a)) = BS16(b)
+#else
+	#define PDW(a, b) *((int*)(p+a)) = b
+	#define PW(a, b) *((short*)(p+a)) = b
+#endif
+// ZIP64 fields, as two double words
+#define PQW(a, b) PDW(a, (unsigned int) (b)); PDW(a+4, (unsigned int) ((b) >> 32))
 
-int MiniZipAEWrite(char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password)
+/*
+  The V2 text is reversed a chunk at a time, while it is hot in the cache:
+  16 bytes are reversed in a register with a single pshufb (SSSE3), or with
+  three shuffles and two shifts (SSE2).
+*/
+#ifdef MZAE_REV_SIMD
+static __m128i rev16(__m128i x)
 {
-	char *tmpbuf = NULL;
-	unsigned int buflen;
-	long crc = 0;
-	char salt[16];
-	char* aes_key;
-	char* hmac_key;
-	char* vv;
-	char *ppbuf;
-	char *digest, *p;
-	char* revSrc;
-	unsigned char ucLocalHeader[45] = {
-		0x50, 0x4B, 0x03, 0x04, 0x33, 0x00, 0x01, 0x00,
-		0x63, 0x00, 0x00, 0x00, 0x21, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x04, 0x00, 0x0B, 0x00, 0x64, 0x61,
-		0x74, 0x61, 0x01, 0x99, 0x07, 0x00, 0x01, 0x00,
-		0x41, 0x45, 0x03, 0x08, 0x00 
-	};
-	unsigned char ucCentralHeader[61] = {
-		0x50, 0x4B, 0x01, 0x02, 0x33, 0x00, 0x33, 0x00,
-		0x01, 0x00, 0x63, 0x00, 0x00, 0x00, 0x21, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x0B, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x64, 0x61,
-		0x74, 0x61, 0x01, 0x99, 0x07, 0x00, 0x01, 0x00,
-		0x41, 0x45, 0x03, 0x08, 0x00 
-	};
-	unsigned char ucEndHeader[23] = {
-		0x50, 0x4B, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00,
-		0x01, 0x00, 0x01, 0x00, 0x3D, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x52 
-	};
-#ifdef USE_TIME
-	time_t t;
-	struct tm *ptm;
+#ifdef MZAE_REV_SSSE3
+	return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+#else
+	// swaps the halves and reverses the words in each, then the bytes in each word
+	x = _mm_shuffle_epi32(x, 0x4E);
+	x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0x1B), 0x1B);
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+#endif
+}
 #endif
 
-	if (!srcLen)
-		return MZAE_ERR_PARAMS;
 
-	// Reverse source buffer copy
-	revSrc = (char*) malloc(srcLen);
-	memcpy(revSrc, src, srcLen);
-	memrev(revSrc, srcLen)
-	
-	if (MZAE_deflate(revSrc, srcLen, &tmpbuf, &buflen))
-		return MZAE_ERR_CODEC;
-	
-	if (! *dstLen)
-	{
-		*dstLen = buflen + 45 + 28 + 61 + 23; //(45+28)+61+23
-		free(tmpbuf);
-		return MZAE_ERR_SUCCESS;
-	}
 
-	if (!password || !password[0])
-	{
-		free(tmpbuf);
-		return MZAE_ERR_NOPW;
-	}
+// Copies len bytes from src to dst in reverse order
+static void revcpy(char* dst, char* src, unsigned int len)
+{
+	char *p = src + len;
 
-	if (! *dst || *dstLen < (buflen + 156))
+#ifdef MZAE_REV_SIMD
+	for (; len >= 16; len -= 16, dst += 16)
 	{
-		free(tmpbuf);
-		return MZAE_ERR_BUFFER;
+		p -= 16;
+		_mm_storeu_si128((__m128i*) dst, rev16(_mm_loadu_si128((__m128i*) p)));
 	}
+#endif
+	while (len--)
+		*dst++ = *--p;
+}
 
-	if (MZAE_gen_salt(salt, 16))
-	{
-		free(tmpbuf);
-		return MZAE_ERR_SALT;
-	}
 
-	// Encrypts with AES-256 always!
-	if (MZAE_derive_keys(password, salt, 16, &aes_key, &hmac_key, &vv))
+
+// Reverses len bytes in place
+static void memrev(char* m, unsigned int len)
+{
+	char *t = m, *b = m + len, c;
+
+#ifdef MZAE_REV_SIMD
+	__m128i x, y;
+
+	for (; b - t >= 32; t += 16)
 	{
-		free(tmpbuf);
-		return MZAE_ERR_KDF;
+		b -= 16;
+		x = _mm_loadu_si128((__m128i*) t);
+		y = _mm_loadu_si128((__m128i*) b);
+		_mm_storeu_si128((__m128i*) t, rev16(y));
+		_mm_storeu_si128((__m128i*) b, rev16(x));
 	}
-	
-	if (MZAE_ctr_crypt(aes_key, 32, tmpbuf, buflen, &ppbuf))
+#endif
+	while (--b > t)
 	{
-		free(tmpbuf);
-		return MZAE_ERR_AES;
+		c = *t;
+		*t++ = *b;
+		*b = c;
 	}
+}
+
+static const unsigned char ucLocalHeader[45] = {
+	0x50, 0x4B, 0x03, 0x04, 0x33, 0x00, 0x01, 0x00,
+	0x63, 0x00, 0x00, 0x00, 0x21, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x04, 0x00, 0x0B, 0x00, 0x64, 0x61,
+	0x74, 0x61, 0x01, 0x99, 0x07, 0x00, 0x01, 0x00,
+	0x41, 0x45, 0x03, 0x08, 0x00 
+};
+static const unsigned char ucCentralHeader[61] = {
+	0x50, 0x4B, 0x01, 0x02, 0x33, 0x00, 0x33, 0x00,
+	0x01, 0x00, 0x63, 0x00, 0x00, 0x00, 0x21, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x0B, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x64, 0x61,
+	0x74, 0x61, 0x01, 0x99, 0x07, 0x00, 0x01, 0x00,
+	0x41, 0x45, 0x03, 0x08, 0x00 
+};
+static const unsigned char ucEndHeader[23] = {
+	0x50, 0x4B, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x01, 0x00, 0x3D, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x52 
+};
+
+
+
+// Output sink writing into a caller buffer
+typedef struct {
+	char* p;
+	unsigned long size;
+} MZAE_MEMSINK;
+
+static int mem_write(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+	MZAE_MEMSINK* m = (MZAE_MEMSINK*) opaque;
+
+	if (offset > m->size || len > m->size - offset)
+		return 1;
+	memcpy(m->p + offset, buf, len);
+	return 0;
+}
+
+
+
+// Archive bytes besides the stored text: local header, salt, check word, HMAC, central header and end record
+#define MZAE_STORED_EXTRA (45 + 28 + sizeof(ucCentralHeader) + sizeof(ucEndHeader))
+
+// ZIP64 extra fields in local and central header, ZIP64 end record and locator
+#define MZAE_ZIP64_EXTRA (20 + 28 + 76)
+
+unsigned long MiniZipAEWriteBound(unsigned long srcLen)
+{
+	return MZAE_deflate_bound(srcLen) + MZAE_STORED_EXTRA + (srcLen >= MZAE_ZIP64_SIZE? MZAE_ZIP64_EXTRA : 0);
+}
 
-	if (MZAE_hmac_sha1_80(hmac_key, 32, ppbuf, buflen, &digest))
+
+
+static int write_init(MZAE_CTX* ctx, MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink, char* name, unsigned long long base);
+static int read_init(MZAE_CTX* ctx, MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink);
+
+
+
+int MiniZipAEWrite(char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password)
+{
+	return MiniZipAEWriteCtx(0, src, srcLen, dst, dstLen, password);
+}
+
+
+
+int MiniZipAEWriteCtx(MZAE_CTX* ctx, char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password)
+{
+	MZAE_STREAM *s;
+	MZAE_SINK sink;
+	MZAE_MEMSINK mem;
+	unsigned long long len;
+	int r, level;
+
+	if (!srcLen)
+		return MZAE_ERR_PARAMS;
+
+	// Answers the size query with an estimate, so data are compressed only once
+	if (! *dstLen)
 	{
-		free(tmpbuf);
-		return MZAE_ERR_HMAC;
+		*dstLen = MiniZipAEWriteBound(srcLen);
+		return MZAE_ERR_SUCCESS;
 	}
 
-	p = *dst;
-	memcpy(p, ucLocalHeader, sizeof(ucLocalHeader));
+	if (!password || !password[0])
+		return MZAE_ERR_NOPW;
 
-#ifdef BYTE_ORDER_1234
-	#define PDW(a, b) *((int*)(p+a)) = BS32(b)
-	#define PW(a, b) *((short*)(p+a)) = BS16(b)
-#else
-	#define PDW(a, b) *((int*)(p+a)) = b
-	#define PW(a, b) *((short*)(p+a)) = b
-#endif
+	if (! *dst)
+		return MZAE_ERR_BUFFER;
 
-	if (srcLen < 20)
+	mem.p = *dst;
+	mem.size = *dstLen;
+	sink.opaque = &mem;
+	sink.write = mem_write;
+
+	for (level = MZAE_LEVEL; ; level = 0)
 	{
-		PW(38, 2); // AE-2
-		crc = 0;
-	} 
-	else {
-		crc = MZAE_crc(0, revSrc, srcLen);
-	}
+		if ((r = write_init(ctx, &s, password, 0, &sink, "data", 0)))
+			return r == MZAE_ERR_SINK? MZAE_ERR_BUFFER : r;
 
-	// Builds the ZIP Local File Header
-#ifdef USE_TIME
-	time(&t);
-	ptm = localtime(&t);
-	PW(10, ptm->tm_hour << 11 | ptm->tm_min << 5 | (ptm->tm_sec / 2));
-	PW(12, (ptm->tm_year - 80) << 9 | (ptm->tm_mon+1) << 5 | ptm->tm_mday);
-#endif
-	PDW(14, crc);
-	PDW(18, buflen+28);
-	PDW(22, srcLen);
+		if (level != MZAE_LEVEL)
+			MZAE_stream_setopt(s, MZAE_OPT_LEVEL, level);
+		if (srcLen >= MZAE_ZIP64_SIZE)
+			MZAE_stream_setopt(s, MZAE_OPT_ZIP64, 1);
 
-	// Copies the raw contents: salt, check word, encrypted data and HMAC
-	memcpy(p + 45, salt, 16);
-	memcpy(p + 61, vv, 2);
-	memcpy(p + 63, ppbuf, buflen);
-	memcpy(p + 63 + buflen, digest, 10);
+		// The whole text goes in a single chunk, reversed on the fly (V2)
+		MZAE_write_update(s, src, srcLen);
 
-	p = *dst + 63 + buflen + 10;
-	memcpy(p, ucCentralHeader, sizeof(ucCentralHeader));
+		r = MZAE_write_final(s, &len);
+		*dstLen = (unsigned long) len;
 
-	// Builds the ZIP Central File Header
-#ifdef USE_TIME
-	PW(12, ptm->tm_hour << 11 | ptm->tm_min << 5 | (ptm->tm_sec / 2));
-	PW(14, (ptm->tm_year - 80) << 9 | (ptm->tm_mon+1) << 5 | ptm->tm_mday);
-#endif
-	PDW(16, crc);
-	PDW(20, buflen + 28);
-	PDW(24, srcLen);
-	if (srcLen < 20)
-		PW(54, 2); // AE-2
+		// Deflate did not shrink the text (and the probe let it pass): stores it
+		if (r || !level || *dstLen <= srcLen + MZAE_STORED_EXTRA)
+			break;
+		*dstLen = mem.size;
+	}
 
-	p += 61;
-	memcpy(p, ucEndHeader, sizeof(ucEndHeader));
-	
-	// Builds the End Of Central Dir Record
-	PDW(16, 63 + buflen + 10);
-
-	free(tmpbuf);
-	free(ppbuf);
-	free(revSrc);
-	
-	return MZAE_ERR_SUCCESS;
+	return r == MZAE_ERR_SINK? MZAE_ERR_BUFFER : r;
 }
 
 int MiniZipAERead(char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password)
 {
-	long crc = 0;
-	unsigned long compSize, uncompSize, keyLen;
-	char *salt, *compdata;
-	char* aes_key;
-	char* hmac_key;
-	char* vv;
-	char *digest, *pbuf;
+	return MiniZipAEReadCtx(0, src, srcLen, dst, dstLen, password);
+}
+
+
+
+int MiniZipAEReadCtx(MZAE_CTX* ctx, char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password)
+{
+	unsigned long uncompSize, keyLen;
+	MZAE_STREAM *s;
+	MZAE_SINK sink;
+	MZAE_MEMSINK mem;
+	int r;
 
 	if (!srcLen)
 		return MZAE_ERR_PARAMS;
@@ -308,6 +357,7 @@ int MiniZipAERead(char* src, unsigned long srcLen, char** dst, unsigned long *ds
 	#define GDW(a) *((unsigned int*)(src+a))
 	#define GW(a) *((unsigned short*)(src+a))
 #endif
+	#define GQW(a) ((unsigned long long) (GDW(a+4)) << 32 | (GDW(a)))
 
 	// Some sanity checks to ensure it is a compatible ZIP
 	if (srcLen < 151)
@@ -315,16 +365,19 @@ int MiniZipAERead(char* src, unsigned long srcLen, char** dst, unsigned long *ds
 
 	keyLen = *((char*)(src + 42));
 
-	if (! (0 < keyLen < 4))
+	if (keyLen < 1 || keyLen > 3)
 		return MZAE_ERR_BADZIP;
 
-	// Here a ZIP with item name >4 (field 26) is bad, too
+	// Here a ZIP with item name >4 (field 26) is bad, too; a ZIP64 extra
+	// field may follow the AES one
 	if (GDW(0) != 0x04034B50 || GW(8) != 99 ||
-		GW(28) != 11 || GW(34) != 0x9901 || GW(38) > 2 || GW(40) != 0x4541)
+		(GW(28) != 11 && (GW(28) != 31 || GW(45) != 1)) ||
+		GW(34) != 0x9901 || GW(38) > 2 || GW(40) != 0x4541)
 		return MZAE_ERR_BADZIP;
 
-	compSize = GDW(18)-(12+(4+keyLen*4)); // size & offset depend on salt size!
-	uncompSize = GDW(22);
+	if (GW(28) == 31 && GQW(49) > (unsigned long) -1)
+		return MZAE_ERR_NOMEM;
+	uncompSize = GW(28) == 31? (unsigned long) GQW(49) : GDW(22);
 
 	if (! *dstLen)
 	{
@@ -335,80 +388,2834 @@ int MiniZipAERead(char* src, unsigned long srcLen, char** dst, unsigned long *ds
 	if (! *dst || *dstLen < uncompSize)
 		return MZAE_ERR_BUFFER;
 
-	if (!password || !password[0])
-		return MZAE_ERR_NOPW;
+	mem.p = *dst;
+	mem.size = uncompSize;
+	sink.opaque = &mem;
+	sink.write = mem_write;
 
-	salt = src + 45;
-	compdata = src+(45+(4+keyLen*4)+2);
-	
-	// Here we regenerate the AES key, the HMAC key and the 16-bit verification value
-	if (MZAE_derive_keys(password, salt, 4+keyLen*4, &aes_key, &hmac_key, &vv))
-		return MZAE_ERR_KDF;
-	
-	// Compares the 16-bit verification values
-	if (GW(45+(4+keyLen*4)) != *((unsigned short*)vv))
-		return MZAE_ERR_BADVV;
-
-	// Compares the HMACs
-	if (MZAE_hmac_sha1_80(hmac_key, 8*(keyLen+1), compdata, compSize, &digest))
-		return MZAE_ERR_HMAC;
-	if (memcmp(digest, compdata+compSize, 10))
-		return MZAE_ERR_BADHMAC;
-
-	// Decrypts into a temporary buffer
-	if (MZAE_ctr_crypt(aes_key, 8*(keyLen+1), compdata, compSize, &pbuf))
-		return MZAE_ERR_AES;
-	
-	// Inflates if method <> zero
-	if (GW(43) != 0) {
-		if (MZAE_inflate(pbuf, compSize, *dst, uncompSize))
-			return MZAE_ERR_CODEC;
-	}
+	// HMAC, decryption, inflate and CRC run together, chunk by chunk
+	if ((r = read_init(ctx, &s, password, *(src+srcLen-1) == 0x52? 0 : MZAE_FLAG_V1, &sink)))
+		return r;
+
+	MZAE_read_update(s, src, srcLen);
+
+	// Never leaves unauthenticated data around
+	if ((r = MZAE_read_final(s, 0)))
+		memset(*dst, 0, uncompSize);
+
+	return r;
+}
+
+
+
+/*
+  Context: the keys derived from a (password, salt) pair are cached in a small
+  array, scanned linearly; each entry is stamped when used, and the oldest
+  is wiped and reused when the array is full. The engine of the crypto
+  library is shared by all the streams of the context.
+
+  The memory of the context and of its streams comes from its allocator.
+  Each block starts with its size: released blocks are kept in the arena of
+  the context (up to allocator.arena bytes) and given again to requests of
+  the same size, or up to twice smaller, so that a context processing many
+  documents stops allocating after the first ones.
+*/
+#define MZAE_ALLOC_HDR 16
+#define MZAE_ARENA_SLOTS 64
+#define BLOCK_SIZE(p) (*(size_t*) ((char*) (p) - MZAE_ALLOC_HDR))
+
+typedef struct {
+	char *password;
+	unsigned int pwlen;	// with its terminator
+	char salt[16];
+	int saltlen;
+	char keys[2*32+2];	// AES key, HMAC key and verification value
+	unsigned long stamp;
+} MZAE_KEYENTRY;
+
+struct MZAE_CTX {
+	int entries;
+	unsigned long stamp;
+	MZAE_KEYENTRY *cache;
+	void *engine;
+	MZAE_STATS *stats;
+	MZAE_ALLOCATOR allocator;
+	void *arena[MZAE_ARENA_SLOTS];	// released blocks
+	int arenablocks;
+	unsigned long long arenaheld;
+};
+
+#define CTX_ENGINE(ctx) ((ctx)? (ctx)->engine : 0)
+#define CTX_STATS(ctx) ((ctx)? (ctx)->stats : 0)
+
+// Blocks allocated without a context
+static MZAE_ALLOCATOR heap;
+
+
+
+static void* heap_alloc(MZAE_ALLOCATOR* a, size_t size)
+{
+	char *p;
+
+	p = (char*) (a->alloc? a->alloc(a->opaque, (unsigned long) (size + MZAE_ALLOC_HDR)) : malloc(size + MZAE_ALLOC_HDR));
+	if (!p)
+		return 0;
+	*(size_t*) p = size;
+
+	return p + MZAE_ALLOC_HDR;
+}
+
+
+
+static void heap_free(MZAE_ALLOCATOR* a, void* p)
+{
+	p = (char*) p - MZAE_ALLOC_HDR;
+	if (a->release)
+		a->release(a->opaque, p);
 	else
-		memcpy(*dst, pbuf, compSize);
+		free(p);
+}
+
+
+
+/*
+  Allocates a block for a stream of ctx (which may be NULL), from the arena
+  if possible. With MZAE_PROFILE, the block is accounted in st.
+*/
+static void* ctx_alloc(MZAE_CTX* ctx, MZAE_STATS* st, size_t size)
+{
+	void *p = 0;
+	int i, best = -1;
+
+	if (ctx)
+	{
+		for (i=0; i < ctx->arenablocks; i++)
+			if (BLOCK_SIZE(ctx->arena[i]) >= size && BLOCK_SIZE(ctx->arena[i]) / 2 <= size &&
+				(best < 0 || BLOCK_SIZE(ctx->arena[i]) < BLOCK_SIZE(ctx->arena[best])))
+				best = i;
+		if (best >= 0)
+		{
+			p = ctx->arena[best];
+			ctx->arenaheld -= BLOCK_SIZE(p);
+			ctx->arena[best] = ctx->arena[--ctx->arenablocks];
+		}
+	}
+
+	if (!p)
+	{
+		p = heap_alloc(ctx? &ctx->allocator : &heap, size);
+		if (!p)
+			return 0;
+#ifdef MZAE_PROFILE
+		if (st)
+			st->allocs++;
+#endif
+	}
+
+#ifdef MZAE_PROFILE
+	if (st)
+	{
+		st->held += BLOCK_SIZE(p);
+		if (st->held > st->peak)
+			st->peak = st->held;
+	}
+#else
+	(void) st;
+#endif
+
+	return p;
+}
+
+
+
+static void* ctx_calloc(MZAE_CTX* ctx, MZAE_STATS* st, size_t n, size_t size)
+{
+	void *p = ctx_alloc(ctx, st, n * size);
+
+	if (p)
+		memset(p, 0, n * size);
+	return p;
+}
+
+
+
+// Releases a block from ctx_alloc, keeping it in the arena if there is room
+static void ctx_free(MZAE_CTX* ctx, MZAE_STATS* st, void* p)
+{
+	if (!p)
+		return;
+
+#ifdef MZAE_PROFILE
+	if (st && st->held >= BLOCK_SIZE(p))
+		st->held -= BLOCK_SIZE(p);
+#else
+	(void) st;
+#endif
+
+	if (ctx && ctx->arenablocks < MZAE_ARENA_SLOTS && ctx->arenaheld + BLOCK_SIZE(p) <= ctx->allocator.arena)
+	{
+		ctx->arena[ctx->arenablocks++] = p;
+		ctx->arenaheld += BLOCK_SIZE(p);
+		return;
+	}
+
+	heap_free(ctx? &ctx->allocator : &heap, p);
+}
+
+
+
+int MZAE_ctx_init(MZAE_CTX** pctx, int entries)
+{
+	return MZAE_ctx_init_ex(pctx, entries, 0);
+}
+
 
-	// AE-1 encryption only
-	if (GW(38) == 1) {
-		crc = MZAE_crc(0, *dst, uncompSize);
 
-		// Compares the CRCs on uncompressed data
-		if (crc != GDW(14))
-			return MZAE_ERR_BADCRC;
+int MZAE_ctx_init_ex(MZAE_CTX** pctx, int entries, MZAE_ALLOCATOR* allocator)
+{
+	MZAE_ALLOCATOR a = {0, 0, 0, MZAE_ARENA};
+	MZAE_CTX* ctx;
+
+	if (!pctx || entries < 0 || (allocator && !allocator->alloc != !allocator->release))
+		return MZAE_ERR_PARAMS;
+
+	if (!entries)
+		entries = MZAE_KEYCACHE;
+	if (allocator)
+		a = *allocator;
+
+	ctx = (MZAE_CTX*) heap_alloc(&a, sizeof(MZAE_CTX));
+	if (!ctx)
+		return MZAE_ERR_NOMEM;
+	memset(ctx, 0, sizeof(MZAE_CTX));
+	ctx->allocator = a;
+	ctx->allocator.arena = 0;
+
+	ctx->cache = (MZAE_KEYENTRY*) ctx_calloc(ctx, 0, entries, sizeof(MZAE_KEYENTRY));
+	if (!ctx->cache)
+	{
+		heap_free(&a, ctx);
+		return MZAE_ERR_NOMEM;
+	}
+	ctx->entries = entries;
+
+	if (MZAE_engine_init(&ctx->engine))
+	{
+		ctx_free(ctx, 0, ctx->cache);
+		heap_free(&a, ctx);
+		return MZAE_ERR_AES;
 	}
+	ctx->allocator.arena = a.arena;
 
-	if (*(src+srcLen-1) == 0x52) // If V2 format
-		memrev(*dst, uncompSize)
-	
-	free(pbuf);
+	*pctx = ctx;
 
 	return MZAE_ERR_SUCCESS;
 }
 
 
 
-#ifdef MAIN
-#include <stdio.h>
-void main()
+static void ctx_wipe(MZAE_CTX* ctx, MZAE_KEYENTRY* e)
 {
-#ifdef MAIN_SAVES
-	FILE *f = fopen("test.zip", "wb");
+	if (e->password)
+	{
+		memset(e->password, 0, strlen(e->password));
+		ctx_free(ctx, 0, e->password);
+	}
+	memset(e, 0, sizeof(MZAE_KEYENTRY));
+}
+
+
+
+void MZAE_ctx_end(MZAE_CTX* ctx)
+{
+	MZAE_ALLOCATOR a;
+	int i;
+
+	if (!ctx)
+		return;
+
+	for (i=0; i < ctx->entries; i++)
+		ctx_wipe(ctx, &ctx->cache[i]);
+	MZAE_engine_end(ctx->engine);
+
+	// Nothing goes to the arena from now on
+	a = ctx->allocator;
+	ctx->allocator.arena = 0;
+	ctx_free(ctx, 0, ctx->cache);
+	for (i=0; i < ctx->arenablocks; i++)
+		heap_free(&a, ctx->arena[i]);
+	memset(ctx, 0, sizeof(MZAE_CTX));
+	heap_free(&a, ctx);
+}
+
+
+
+int MZAE_ctx_stats(MZAE_CTX* ctx, MZAE_STATS* stats)
+{
+	if (!ctx)
+		return MZAE_ERR_PARAMS;
+#ifdef MZAE_PROFILE
+	ctx->stats = stats;
+	return MZAE_ERR_SUCCESS;
+#else
+	(void) stats;
+	return MZAE_ERR_NOSTATS;
 #endif
-	char *s = "Questo testo  la sorgente da comprimere e cifrare con MiniZipAEWrite, per poi verificarne l'uguaglianza con il prodotto di MiniZipAERead!";
-	char *out1, *out2;
-	long len1=0, len2=0, r;
-	r = MiniZipAEWrite(s, strlen(s), &out1, &len1, "kazookazaa");
-	printf("MiniZipAEWrite returned %d: %s (requires %d bytes buffer)\n", r, MZAE_errmsg(r), len1);
-	out1 = (char*) malloc(len1);
-	r = MiniZipAEWrite(s, strlen(s), &out1, &len1, "kazookazaa");
-	printf("MiniZipAEWrite returned %d: %s\n", r, MZAE_errmsg(r));
+}
 
-	r = MiniZipAERead(out1, len1, &out2, &len2, "kazookazaa");
-	printf("MiniZipAERead returned %d: %s (requires %d bytes buffer)\n", r, MZAE_errmsg(r), len2);
-	out2 = (char*) malloc(len2);
-	r = MiniZipAERead(out1, len1, &out2, &len2, "kazookazaa");
-	printf("MiniZipAERead returned %d: %s\n", r, MZAE_errmsg(r));
 
-	if (len2 != strlen(s) || memcmp(s, out2, len2) != 0)
+
+/*
+  Fills keys with AES key, HMAC key and verification value for password and
+  salt, from the cache of ctx if possible (ctx may be NULL).
+*/
+static int ctx_keys(MZAE_CTX* ctx, char* password, char* salt, int saltlen, char* keys)
+{
+	MZAE_KEYENTRY *e = 0;
+	unsigned int pwlen = strlen(password) + 1, keyslen = 4*saltlen + 2;
+	int i;
+
+	if (ctx)
+	{
+		for (i=0; i < ctx->entries; i++)
+		{
+			e = &ctx->cache[i];
+			if (e->password && e->saltlen == saltlen && !memcmp(e->salt, salt, saltlen) &&
+				e->pwlen == pwlen && !memcmp(e->password, password, pwlen))
+			{
+				e->stamp = ++ctx->stamp;
+				memcpy(keys, e->keys, keyslen);
+				return MZAE_ERR_SUCCESS;
+			}
+		}
+	}
+
+	// Same as MZAE_derive_keys, straight into keys
+	if (MZAE_pbkdf2_sha1(password, pwlen - 1, salt, saltlen, 1000, keys, keyslen))
+		return MZAE_ERR_KDF;
+
+	if (ctx)
+	{
+		// Replaces a free entry or the least recently used one
+		e = &ctx->cache[0];
+		for (i=1; i < ctx->entries && e->password; i++)
+			if (!ctx->cache[i].password || ctx->cache[i].stamp < e->stamp)
+				e = &ctx->cache[i];
+		ctx_wipe(ctx, e);
+
+		e->password = (char*) ctx_alloc(ctx, 0, pwlen);
+		if (e->password)
+		{
+			memcpy(e->password, password, pwlen);
+			e->pwlen = pwlen;
+			memcpy(e->salt, salt, saltlen);
+			e->saltlen = saltlen;
+			memcpy(e->keys, keys, keyslen);
+			e->stamp = ++ctx->stamp;
+		}
+	}
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+/*
+  Streaming interface: the archive is produced or consumed in chunks, so that
+  neither the document nor the archive is ever held in memory as a whole.
+  
+  The writer emits a placeholder local header, then salt, verification value,
+  encrypted data and HMAC as they are generated; at the end it patches the
+  local header with CRC and sizes, and appends central header and end record.
+
+  The reader collects the local header and the salt, checks the password,
+  then authenticates, decrypts and inflates the data as they come. The HMAC
+  is compared at the end.
+
+  With MZAE_OPT_THREADS, the encrypted data are gathered in jobs of
+  MZAE_MT_JOB bytes: the workers split each job in slices, each one with its
+  own AES-CTR state set at the slice offset, and a further task adds the job
+  to the HMAC (after the slices when encrypting, since HMAC covers the
+  encrypted data, else together with them). Two jobs alternate, so that the
+  caller thread deflates the next job or inflates the previous one meanwhile.
+
+  When writing, the workers compress the text too, in blocks of MZAE_DZ_BLOCK
+  bytes (like pigz): each block has the 32K of text before it as dictionary
+  and ends with a sync flush, so the compressed blocks, emitted in order,
+  form a single Deflate stream; their CRCs are combined in the same order.
+*/
+#define MZAE_HDRMAX 512
+#define MZAE_MT_SLICE 16384	// smallest slice given to a worker
+#define MZAE_DZ_DICT 32768	// Deflate window
+#define MZAE_PROBE_MIN 4096	// smallest sample for the incompressibility probe
+#define MZAE_CD_WINDOW 262144	// holds a central directory record with the longest fields
+
+enum { RS_HEADER, RS_EXTRA, RS_SALT, RS_DATA, RS_MAC, RS_TRAILER };
+
+typedef struct MZAE_JOB MZAE_JOB;
+
+typedef struct {
+	MZAE_JOB *job;
+	void *ctr;
+	unsigned int off;
+	unsigned int len;
+	int err;
+#ifdef MZAE_PROFILE
+	unsigned long long ns;
+#endif
+} MZAE_SLICE;
+
+struct MZAE_JOB {
+	MZAE_STREAM *s;
+	char *in;
+	char *out;		// decrypted data, or in when encrypting
+	unsigned int len;
+	unsigned long long pos;	// offset of in inside the encrypted data
+	int ctrgroup;
+	int macgroup;
+	int macerr;
+#ifdef MZAE_PROFILE
+	unsigned long long macns;
+#endif
+	MZAE_SLICE slice[MZAE_MAXTHREADS];
+};
+
+// A block of text compressed by a worker
+typedef struct {
+	MZAE_STREAM *s;
+	char *in;		// dictionary followed by the block
+	char *out;
+	unsigned int dictlen;
+	unsigned int len;
+	unsigned int outlen;
+	unsigned long crc;
+	int last;
+	int group;
+	int err;
+#ifdef MZAE_PROFILE
+	unsigned long long crcns;
+	unsigned long long dzns;
+#endif
+} MZAE_DZJOB;
+
+struct MZAE_STREAM {
+	MZAE_SINK sink;
+	int flags;
+	int err;
+	int codec_err;
+	void *ctr;
+	void *hmac;
+	void *codec;
+	long crc;
+	unsigned long long compSize;
+	unsigned long long uncompSize;
+	unsigned long long offset;
+	int method;		// 8 (Deflate) or 0 (stored)
+	int level;
+	int zip64;		// the local header has a ZIP64 extra field
+	// worker threads
+	int threads;
+	MZAE_POOL *pool;
+	void *ctrs[MZAE_MAXTHREADS];
+	char aes_key[32];
+	unsigned int aes_keylen;
+	unsigned long long ctroff;
+	MZAE_JOB job[2];
+	MZAE_JOB *inflight;
+	int cur;
+	MZAE_DZJOB *dz;		// ring of blocks: dzbusy in flight from dzfirst, then the one being filled
+	int dzjobs;
+	int dzfirst;
+	int dzbusy;
+	MZAE_CTX *ctx;
+#ifdef MZAE_PROFILE
+	MZAE_STATS *stats;
+	unsigned long long inner;	// time of the stages, to exclude it from the outer ones
+#endif
+	MZAE_ZIP *zip;		// archive of the entry, if any
+	unsigned long long base;	// offset of the entry inside it
+	unsigned int namelen;
+	// reader only
+	int reader;
+	int checkonly;		// stops at the verification value
+	char *password;
+	int state;
+	int ae;
+	long hdrcrc;
+	unsigned int keyLen;
+	unsigned int hdrlen;
+	unsigned int need;
+	unsigned int maclen;
+	unsigned long long consumed;
+	char mac[10];
+	char header[MZAE_HDRMAX];
+	char buf[MZAE_CHUNK];
+};
+
+
+
+static void stream_seterr(MZAE_STREAM* s, int err)
+{
+	if (!s->err)
+		s->err = err;
+}
+
+
+
+#ifdef MZAE_PROFILE
+	#define STREAM_STATS(s) ((s)->stats)
+#else
+	#define STREAM_STATS(s) 0
+#endif
+
+/*
+  Statistics: a stage is timed between stats_start and stats_stop; the time
+  of the stages it calls meanwhile (accumulated in s->inner) is subtracted.
+  Without MZAE_PROFILE nothing is left.
+*/
+#ifdef MZAE_PROFILE
+static unsigned long long stats_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER f, c;
+
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (unsigned long long) (c.QuadPart / (double) f.QuadPart * 1e9);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+
+static unsigned long long stats_start(MZAE_STREAM* s)
+{
+	return s->stats? stats_clock() - s->inner : 0;
+}
+
+
+
+static void stats_stop(MZAE_STREAM* s, int stage, unsigned long long t0, unsigned long long len)
+{
+	unsigned long long ns;
+
+	if (!s->stats)
+		return;
+	ns = stats_clock() - s->inner - t0;
+	s->inner += ns;
+	s->stats->ns[stage] += ns;
+	s->stats->bytes[stage] += len;
+}
+
+
+
+// Adds the time spent by a worker thread
+static void stats_add(MZAE_STREAM* s, int stage, unsigned long long ns, unsigned long long len)
+{
+	if (!s->stats)
+		return;
+	s->stats->ns[stage] += ns;
+	s->stats->bytes[stage] += len;
+}
+#else
+#define stats_start(s) 0
+#define stats_stop(s, stage, t0, len) ((void) (t0))
+#endif
+
+
+
+static int stream_sink(MZAE_STREAM* s, unsigned long long offset, char* buf, unsigned int len)
+{
+	unsigned long long t0 = stats_start(s);
+	int r;
+
+	r = s->sink.write(s->sink.opaque, s->base + offset, buf, len);
+	stats_stop(s, MZAE_STAGE_SINK, t0, len);
+	if (r)
+	{
+		stream_seterr(s, MZAE_ERR_SINK);
+		return 1;
+	}
+	return 0;
+}
+
+
+
+/*
+  Encrypts then authenticates, or authenticates then decrypts, a chunk with
+  MZAE_ctr_hmac_update. With MZAE_PROFILE, the same blocks are processed here,
+  timing AES-CTR and HMAC apart.
+*/
+static int stream_crypt(MZAE_STREAM* s, char* src, unsigned int len, char* dst, int decrypt)
+{
+#ifdef MZAE_PROFILE
+	unsigned long long t0;
+	unsigned int n;
+
+	if (!s->stats)
+		return MZAE_ctr_hmac_update(s->ctr, s->hmac, src, len, dst, decrypt);
+
+	for (; len; len-=n, src+=n, dst+=n)
+	{
+		n = len < MZAE_FUSED_BLOCK? len : MZAE_FUSED_BLOCK;
+
+		t0 = stats_start(s);
+		if (decrypt && MZAE_hmac_sha1_update(s->hmac, src, n))
+			return MZAE_ERR_HMAC;
+		stats_stop(s, MZAE_STAGE_HMAC, t0, decrypt? n : 0);
+
+		t0 = stats_start(s);
+		if (MZAE_ctr_update(s->ctr, src, n, dst))
+			return MZAE_ERR_AES;
+		stats_stop(s, MZAE_STAGE_CTR, t0, n);
+
+		t0 = stats_start(s);
+		if (!decrypt && MZAE_hmac_sha1_update(s->hmac, dst, n))
+			return MZAE_ERR_HMAC;
+		stats_stop(s, MZAE_STAGE_HMAC, t0, decrypt? 0 : n);
+	}
+
+	return MZAE_ERR_SUCCESS;
+#else
+	return MZAE_ctr_hmac_update(s->ctr, s->hmac, src, len, dst, decrypt);
+#endif
+}
+
+
+
+/*
+  Derives the keys and prepares AES-CTR and HMAC-SHA1 states, then wipes the
+  keys. If check is set, vv is compared with the verification value,
+  else it receives it.
+*/
+static int stream_keys(MZAE_STREAM* s, char* password, char* salt, int saltlen, char* vv, int check)
+{
+	char keys[2*32+2], *aes_key, *hmac_key, *kvv;
+	int keylen = saltlen*2, r;
+	unsigned long long t0 = stats_start(s);
+
+	r = ctx_keys(s->ctx, password, salt, saltlen, keys);
+	stats_stop(s, MZAE_STAGE_KDF, t0, 0);
+	if (r)
+		return r;
+
+	aes_key = keys;
+	hmac_key = keys + keylen;
+	kvv = keys + 2*keylen;
+
+	if (check && memcmp(vv, kvv, 2))
+		r = MZAE_ERR_BADVV;
+	else if (!check)
+		memcpy(vv, kvv, 2);
+
+	// A password check needs no cipher states
+	if (s->checkonly)
+	{
+		memset(keys, 0, sizeof(keys));
+		return r;
+	}
+
+	if (!r && MZAE_ctr_init_ex(CTX_ENGINE(s->ctx), aes_key, keylen, &s->ctr))
+		r = MZAE_ERR_AES;
+	if (!r)
+	{
+		// kept for the workers' states, until the stream is freed
+		memcpy(s->aes_key, aes_key, keylen);
+		s->aes_keylen = keylen;
+	}
+	if (!r && MZAE_hmac_sha1_init_ex(CTX_ENGINE(s->ctx), hmac_key, keylen, &s->hmac))
+		r = MZAE_ERR_HMAC;
+
+	memset(keys, 0, sizeof(keys));
+
+	return r;
+}
+
+
+
+/*
+  Fills the end record at p, preceded by ZIP64 end record and locator if
+  the central directory has too many entries or lies too far. Returns the
+  length written.
+*/
+static unsigned int end_record(char* p, unsigned long long entries, unsigned long long cdlen, unsigned long long cdoff, int v2)
+{
+	unsigned int n, len = 0;
+
+	if (entries >= 0xFFFF || cdlen >= 0xFFFFFFFF || cdoff >= 0xFFFFFFFF)
+	{
+		memset(p, 0, 76);
+		PDW(0, 0x06064B50);
+		PQW(4, 44ULL); // record size, after this field
+		PW(12, 45); // version 4.5
+		PW(14, 45);
+		PQW(24, entries);
+		PQW(32, entries);
+		PQW(40, cdlen);
+		PQW(48, cdoff);
+		// the locator
+		PDW(56, 0x07064B50);
+		PQW(64, cdoff + cdlen);
+		PDW(72, 1);
+		p += 76;
+		len = 76;
+	}
+
+	memcpy(p, ucEndHeader, sizeof(ucEndHeader));
+	n = entries < 0xFFFF? (unsigned int) entries : 0xFFFF;
+	PW(8, n);
+	PW(10, n);
+	n = cdlen < 0xFFFFFFFF? (unsigned int) cdlen : 0xFFFFFFFF;
+	PDW(12, n);
+	n = cdoff < 0xFFFFFFFF? (unsigned int) cdoff : 0xFFFFFFFF;
+	PDW(16, n);
+	if (!v2)
+		PW(20, 0); // no "R" comment
+
+	return len + (v2? sizeof(ucEndHeader) : sizeof(ucEndHeader)-1);
+}
+
+
+
+/*
+  Completes the local header built by write_init and fills the central
+  header of the entry, whose length is returned. Sizes and offset past 4 GiB
+  go in ZIP64 extra fields.
+*/
+static unsigned int stream_headers(MZAE_STREAM* s, char* local, char* central)
+{
+	char *p;
+	unsigned int n = s->namelen, x, k = 4;
+	unsigned long long comp = s->compSize + 28;
+	int ae2 = s->uncompSize < 20;
+	long crc = ae2? 0 : s->crc;
+#ifdef USE_TIME
+	time_t t;
+	struct tm *ptm;
+
+	time(&t);
+	ptm = localtime(&t);
+#endif
+
+	p = local;
+#ifdef USE_TIME
+	PW(10, ptm->tm_hour << 11 | ptm->tm_min << 5 | (ptm->tm_sec / 2));
+	PW(12, (ptm->tm_year - 80) << 9 | (ptm->tm_mon+1) << 5 | ptm->tm_mday);
+#endif
+	PDW(14, crc);
+	if (s->zip64)
+	{
+		PDW(18, 0xFFFFFFFF);
+		PDW(22, 0xFFFFFFFF);
+		PQW(30+n+11+4, s->uncompSize);
+		PQW(30+n+11+12, comp);
+	}
+	else
+	{
+		PDW(18, comp);
+		PDW(22, s->uncompSize);
+	}
+	if (ae2)
+		PW(30+n+4, 2); // AE-2
+	PW(30+n+9, s->method);
+
+	p = central;
+	memcpy(p, ucCentralHeader, 46);
+	memcpy(p + 46, local + 30, n);
+	memcpy(p + 46 + n, ucCentralHeader + 50, 11);
+	PW(28, n);
+#ifdef USE_TIME
+	PW(12, ptm->tm_hour << 11 | ptm->tm_min << 5 | (ptm->tm_sec / 2));
+	PW(14, (ptm->tm_year - 80) << 9 | (ptm->tm_mon+1) << 5 | ptm->tm_mday);
+#endif
+	PDW(16, crc);
+	PDW(20, comp);
+	PDW(24, s->uncompSize);
+	PDW(42, s->base);
+	if (ae2)
+		PW(46+n+4, 2); // AE-2
+	PW(46+n+9, s->method);
+
+	// The ZIP64 extra field holds only the values that don't fit
+	x = 46 + n + 11;
+	if (s->uncompSize >= 0xFFFFFFFF)
+	{
+		PDW(24, 0xFFFFFFFF);
+		PQW(x+k, s->uncompSize);
+		k += 8;
+	}
+	if (comp >= 0xFFFFFFFF)
+	{
+		PDW(20, 0xFFFFFFFF);
+		PQW(x+k, comp);
+		k += 8;
+	}
+	if (s->base >= 0xFFFFFFFF)
+	{
+		PDW(42, 0xFFFFFFFF);
+		PQW(x+k, s->base);
+		k += 8;
+	}
+	if (k == 4)
+		return x;
+	PW(x, 1);
+	PW(x+2, k-4);
+	PW(30, 11+k);
+
+	return x + k;
+}
+
+
+
+static void mt_free(MZAE_STREAM* s)
+{
+	int i;
+
+	// Lets the jobs in flight end before releasing their buffers
+	MZAE_pool_destroy(s->pool);
+	s->pool = 0;
+
+	for (i=0; i < MZAE_MAXTHREADS; i++)
+		MZAE_ctr_end(s->ctrs[i]);
+
+	for (i=0; i < 2; i++)
+	{
+		if (s->job[i].out && s->job[i].out != s->job[i].in)
+		{
+			memset(s->job[i].out, 0, MZAE_MT_JOB);
+			ctx_free(s->ctx, STREAM_STATS(s), s->job[i].out);
+		}
+		if (s->job[i].in)
+		{
+			memset(s->job[i].in, 0, MZAE_MT_JOB);
+			ctx_free(s->ctx, STREAM_STATS(s), s->job[i].in);
+		}
+	}
+
+	for (i=0; s->dz && i < s->dzjobs; i++)
+	{
+		if (s->dz[i].in)
+		{
+			memset(s->dz[i].in, 0, MZAE_DZ_DICT + MZAE_DZ_BLOCK);
+			ctx_free(s->ctx, STREAM_STATS(s), s->dz[i].in);
+		}
+		ctx_free(s->ctx, STREAM_STATS(s), s->dz[i].out);
+	}
+	ctx_free(s->ctx, STREAM_STATS(s), s->dz);
+}
+
+
+
+static void stream_free(MZAE_STREAM* s)
+{
+	MZAE_STATS *st = STREAM_STATS(s);
+	MZAE_CTX *ctx = s->ctx;
+	char digest[20];
+
+	mt_free(s);
+	MZAE_ctr_end(s->ctr);
+	if (s->hmac)
+		MZAE_hmac_sha1_final(s->hmac, digest);
+	if (s->password)
+	{
+		memset(s->password, 0, strlen(s->password));
+		ctx_free(ctx, st, s->password);
+	}
+	memset(s, 0, sizeof(MZAE_STREAM));
+	ctx_free(ctx, st, s);
+}
+
+
+
+int MZAE_ctr_hmac_update(void* ctr, void* hmac, char* src, unsigned int srclen, char* dst, int decrypt)
+{
+	unsigned int n;
+
+	for (; srclen; srclen-=n, src+=n, dst+=n)
+	{
+		n = srclen < MZAE_FUSED_BLOCK? srclen : MZAE_FUSED_BLOCK;
+
+		if (decrypt && MZAE_hmac_sha1_update(hmac, src, n))
+			return MZAE_ERR_HMAC;
+		if (MZAE_ctr_update(ctr, src, n, dst))
+			return MZAE_ERR_AES;
+		if (!decrypt && MZAE_hmac_sha1_update(hmac, dst, n))
+			return MZAE_ERR_HMAC;
+	}
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+// Worker task: encrypts or decrypts a slice of a job
+static void mt_slice(void* arg)
+{
+	MZAE_SLICE* sl = (MZAE_SLICE*) arg;
+	MZAE_JOB* j = sl->job;
+#ifdef MZAE_PROFILE
+	unsigned long long t0 = stats_clock();
+#endif
+
+	if (MZAE_ctr_seek(sl->ctr, j->pos + sl->off) ||
+		MZAE_ctr_update(sl->ctr, j->in + sl->off, sl->len, j->out + sl->off))
+		sl->err = MZAE_ERR_AES;
+#ifdef MZAE_PROFILE
+	sl->ns = stats_clock() - t0;
+#endif
+}
+
+
+
+// Worker task: adds a job to the HMAC, once encrypted if needed
+static void mt_hmac(void* arg)
+{
+	MZAE_JOB* j = (MZAE_JOB*) arg;
+
+#ifdef MZAE_PROFILE
+	unsigned long long t0;
+#endif
+
+	if (!j->s->reader)
+		MZAE_pool_wait(j->s->pool, &j->ctrgroup);
+
+#ifdef MZAE_PROFILE
+	t0 = stats_clock();
+#endif
+	if (MZAE_hmac_sha1_update(j->s->hmac, j->s->reader? j->in : j->out, j->len))
+		j->macerr = MZAE_ERR_HMAC;
+#ifdef MZAE_PROFILE
+	j->macns = stats_clock() - t0;
+#endif
+}
+
+
+
+// Starts the workers, with their AES-CTR states, and allocates the jobs
+static int mt_start(MZAE_STREAM* s)
+{
+	int i;
+
+	if (MZAE_pool_create(&s->pool, s->threads))
+		return MZAE_ERR_NOMEM;
+
+	for (i=0; i < s->threads; i++)
+		if (MZAE_ctr_init_ex(CTX_ENGINE(s->ctx), s->aes_key, s->aes_keylen, &s->ctrs[i]))
+			return MZAE_ERR_AES;
+
+	for (i=0; i < 2; i++)
+	{
+		s->job[i].s = s;
+		s->job[i].in = (char*) ctx_alloc(s->ctx, STREAM_STATS(s), MZAE_MT_JOB);
+		s->job[i].out = s->reader? (char*) ctx_alloc(s->ctx, STREAM_STATS(s), MZAE_MT_JOB) : s->job[i].in;
+		if (!s->job[i].in || !s->job[i].out)
+			return MZAE_ERR_NOMEM;
+	}
+
+	// Data already processed by the caller thread
+	s->ctroff = s->reader? s->consumed : s->compSize;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+static void read_data(MZAE_STREAM* s, char* buf, unsigned int len);
+
+// Waits for the job in flight, then emits or inflates it
+static void mt_collect(MZAE_STREAM* s)
+{
+	MZAE_JOB* j = s->inflight;
+	int i;
+
+	if (!j)
+		return;
+
+	MZAE_pool_wait(s->pool, &j->ctrgroup);
+	MZAE_pool_wait(s->pool, &j->macgroup);
+	s->inflight = 0;
+
+	for (i=0; i < s->threads; i++)
+		if (j->slice[i].err)
+			stream_seterr(s, j->slice[i].err);
+	if (j->macerr)
+		stream_seterr(s, j->macerr);
+#ifdef MZAE_PROFILE
+	for (i=0; i < s->threads; i++)
+		stats_add(s, MZAE_STAGE_CTR, j->slice[i].ns, 0);
+	stats_add(s, MZAE_STAGE_CTR, 0, j->len);
+	stats_add(s, MZAE_STAGE_HMAC, j->macns, j->len);
+#endif
+	if (s->err)
+		return;
+
+	if (s->reader)
+		read_data(s, j->out, j->len);
+	else if (!stream_sink(s, s->offset, j->out, j->len))
+	{
+		s->offset += j->len;
+		s->compSize += j->len;
+	}
+}
+
+
+
+// Hands the current job to the workers, after collecting the previous one
+static void mt_submit(MZAE_STREAM* s)
+{
+	MZAE_JOB* j = &s->job[s->cur];
+	unsigned int i, n, off;
+
+	mt_collect(s);
+	if (s->err)
+		return;
+
+	j->pos = s->ctroff;
+	j->macerr = 0;
+	s->ctroff += j->len;
+
+	// One slice per worker, in whole AES blocks
+	n = ((j->len + s->threads - 1) / s->threads + 15) & ~15;
+	if (n < MZAE_MT_SLICE)
+		n = MZAE_MT_SLICE;
+
+	for (i=0; i < MZAE_MAXTHREADS; i++)
+	{
+		j->slice[i].err = 0;
+#ifdef MZAE_PROFILE
+		j->slice[i].ns = 0;
+#endif
+	}
+
+	for (i=0, off=0; off < j->len; i++, off+=n)
+	{
+		j->slice[i].job = j;
+		j->slice[i].ctr = s->ctrs[i];
+		j->slice[i].off = off;
+		j->slice[i].len = j->len - off < n? j->len - off : n;
+		if (MZAE_pool_submit(s->pool, mt_slice, &j->slice[i], &j->ctrgroup))
+			mt_slice(&j->slice[i]);
+	}
+
+	if (MZAE_pool_submit(s->pool, mt_hmac, j, &j->macgroup))
+		mt_hmac(j);
+
+	s->inflight = j;
+	s->cur ^= 1;
+	s->job[s->cur].len = 0;
+}
+
+
+
+// Gathers data for the workers, submitting each full job
+static int mt_queue(MZAE_STREAM* s, char* buf, unsigned int len)
+{
+	MZAE_JOB* j;
+	unsigned int n;
+	int r;
+
+	if (!s->pool && (r = mt_start(s)))
+	{
+		stream_seterr(s, r);
+		return 1;
+	}
+
+	while (!s->err && len)
+	{
+		j = &s->job[s->cur];
+		n = MZAE_MT_JOB - j->len;
+		if (n > len)
+			n = len;
+		memcpy(j->in + j->len, buf, n);
+		j->len += n;
+		buf += n;
+		len -= n;
+		if (j->len == MZAE_MT_JOB)
+			mt_submit(s);
+	}
+
+	return s->err != 0;
+}
+
+
+
+// Submits the last partial job and waits for the workers
+static void mt_flush(MZAE_STREAM* s)
+{
+	if (!s->pool)
+		return;
+	if (!s->err && s->job[s->cur].len)
+		mt_submit(s);
+	mt_collect(s);
+}
+
+
+
+// Inserts a ZIP64 extra field in the placeholder local header, before salt and check word
+static int stream_zip64(MZAE_STREAM* s)
+{
+	char *p = s->header;
+	unsigned int e = 30 + s->namelen + 11;
+
+	memmove(p + e + 20, p + e, 18);
+	memset(p + e, 0, 20);
+	PW(e, 1);
+	PW(e+2, 16);
+	PW(28, 31);
+
+	if (stream_sink(s, 0, s->header, e + 20 + 18))
+		return MZAE_ERR_SINK;
+	s->offset += 20;
+	s->zip64 = 1;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_stream_setopt(MZAE_STREAM* s, int option, long value)
+{
+	if (!s)
+		return MZAE_ERR_PARAMS;
+
+	switch (option)
+	{
+		case MZAE_OPT_THREADS:
+			// can't change once the workers are running
+			if (value < 0 || value > MZAE_MAXTHREADS || s->pool)
+				return MZAE_ERR_PARAMS;
+			s->threads = (int) value;
+			return MZAE_ERR_SUCCESS;
+
+		case MZAE_OPT_LEVEL:
+			if (value < 0 || value > 9 || s->reader || s->uncompSize)
+				return MZAE_ERR_PARAMS;
+			MZAE_deflate_end(s->codec);
+			s->codec = 0;
+			s->level = (int) value;
+			s->method = value? 8 : 0;
+			if (s->method && MZAE_deflate_init(&s->codec, s->level))
+			{
+				stream_seterr(s, MZAE_ERR_CODEC);
+				return MZAE_ERR_CODEC;
+			}
+			return MZAE_ERR_SUCCESS;
+
+		case MZAE_OPT_ZIP64:
+			if (s->reader || s->uncompSize || (s->zip64 && !value))
+				return MZAE_ERR_PARAMS;
+			if (value && !s->zip64)
+				return stream_zip64(s);
+			return MZAE_ERR_SUCCESS;
+	}
+
+	return MZAE_ERR_PARAMS;
+}
+
+
+
+// Encrypts, authenticates and emits a chunk of compressed data
+static int write_out(void* opaque, char* buf, unsigned int len)
+{
+	MZAE_STREAM* s = (MZAE_STREAM*) opaque;
+	int r;
+
+	if (s->threads)
+		return mt_queue(s, buf, len);
+
+	if ((r = stream_crypt(s, buf, len, buf, 0)))
+	{
+		stream_seterr(s, r);
+		return 1;
+	}
+	if (stream_sink(s, s->offset, buf, len))
+		return 1;
+
+	s->offset += len;
+	s->compSize += len;
+
+	return 0;
+}
+
+
+
+/*
+  Tells if a sample of text looks incompressible (already compressed or
+  encrypted), from the collision entropy of its bytes, -log2(sum of squared
+  byte frequencies): about 8 bits for random data, 4 or 5 for a text. Above
+  7.5 bits (sum < 1/181), Deflate can't gain anything worth its time.
+*/
+static int incompressible(char* p, unsigned int n)
+{
+	unsigned int count[256], i;
+	unsigned long long sum = 0;
+
+	if (n < MZAE_PROBE_MIN)
+		return 0;
+
+	memset(count, 0, sizeof(count));
+	for (i=0; i < n; i++)
+		count[(unsigned char) p[i]]++;
+	for (i=0; i < 256; i++)
+		sum += (unsigned long long) count[i] * count[i];
+
+	return sum * 181 < (unsigned long long) n * n;
+}
+
+
+
+// Worker task: checksums and compresses a block of text
+static void dz_block(void* arg)
+{
+	MZAE_DZJOB* j = (MZAE_DZJOB*) arg;
+#ifdef MZAE_PROFILE
+	unsigned long long t0 = stats_clock(), t1;
+#endif
+
+	j->crc = MZAE_crc(0, j->in + j->dictlen, j->len);
+#ifdef MZAE_PROFILE
+	t1 = stats_clock();
+	j->crcns = t1 - t0;
+#endif
+	j->outlen = MZAE_deflate_bound(MZAE_DZ_BLOCK) + 64;
+	if (MZAE_deflate_block(j->s->level, j->in, j->dictlen, j->in + j->dictlen, j->len, j->last, j->out, &j->outlen))
+		j->err = MZAE_ERR_CODEC;
+#ifdef MZAE_PROFILE
+	j->dzns = stats_clock() - t1;
+#endif
+}
+
+
+
+// Starts the workers, if needed, and allocates the blocks in place of the compressor
+static int dz_start(MZAE_STREAM* s)
+{
+	int i, r;
+
+	if (!s->pool && (r = mt_start(s)))
+		return r;
+
+	s->dz = (MZAE_DZJOB*) ctx_calloc(s->ctx, STREAM_STATS(s), 2 * s->threads, sizeof(MZAE_DZJOB));
+	if (!s->dz)
+		return MZAE_ERR_NOMEM;
+	s->dzjobs = 2 * s->threads;
+
+	for (i=0; i < s->dzjobs; i++)
+	{
+		s->dz[i].s = s;
+		s->dz[i].in = (char*) ctx_alloc(s->ctx, STREAM_STATS(s), MZAE_DZ_DICT + MZAE_DZ_BLOCK);
+		s->dz[i].out = (char*) ctx_alloc(s->ctx, STREAM_STATS(s), MZAE_deflate_bound(MZAE_DZ_BLOCK) + 64);
+		if (!s->dz[i].in || !s->dz[i].out)
+			return MZAE_ERR_NOMEM;
+	}
+
+	MZAE_deflate_end(s->codec);
+	s->codec = 0;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+// Waits for the oldest block in flight, then emits it
+static void dz_collect(MZAE_STREAM* s)
+{
+	MZAE_DZJOB* j = &s->dz[s->dzfirst];
+
+	MZAE_pool_wait(s->pool, &j->group);
+	s->dzfirst = (s->dzfirst + 1) % s->dzjobs;
+	s->dzbusy--;
+
+	if (j->err)
+		stream_seterr(s, j->err);
+	if (s->err)
+		return;
+
+#ifdef MZAE_PROFILE
+	stats_add(s, MZAE_STAGE_CRC, j->crcns, j->len);
+	stats_add(s, MZAE_STAGE_DEFLATE, j->dzns, j->len);
+#endif
+	s->crc = MZAE_crc_combine(s->crc, j->crc, j->len);
+	write_out(s, j->out, j->outlen);
+}
+
+
+
+// Hands the block being filled to the workers, and prepares the next one
+static void dz_submit(MZAE_STREAM* s, int last)
+{
+	MZAE_DZJOB *j = &s->dz[(s->dzfirst + s->dzbusy) % s->dzjobs], *next;
+	unsigned int n;
+
+	j->last = last;
+	j->err = 0;
+	s->dzbusy++;
+	if (MZAE_pool_submit(s->pool, dz_block, j, &j->group))
+		dz_block(j);
+
+	if (last)
+		return;
+
+	if (s->dzbusy == s->dzjobs)
+		dz_collect(s);
+
+	// The last 32K of text are the dictionary of the next block
+	next = &s->dz[(s->dzfirst + s->dzbusy) % s->dzjobs];
+	n = j->dictlen + j->len < MZAE_DZ_DICT? j->dictlen + j->len : MZAE_DZ_DICT;
+	memcpy(next->in, j->in + j->dictlen + j->len - n, n);
+	next->dictlen = n;
+	next->len = 0;
+}
+
+
+
+// Gathers text in blocks, submitting each full one
+static void dz_queue(MZAE_STREAM* s, char* buf, unsigned int len)
+{
+	MZAE_DZJOB* j;
+	unsigned int n;
+
+	while (!s->err && len)
+	{
+		j = &s->dz[(s->dzfirst + s->dzbusy) % s->dzjobs];
+		n = MZAE_DZ_BLOCK - j->len;
+		if (n > len)
+			n = len;
+		memcpy(j->in + j->dictlen + j->len, buf, n);
+		j->len += n;
+		buf += n;
+		len -= n;
+		if (j->len == MZAE_DZ_BLOCK)
+			dz_submit(s, 0);
+	}
+}
+
+
+
+// Submits the last block, even if empty, and emits the blocks in flight
+static void dz_flush(MZAE_STREAM* s)
+{
+	if (!s->err)
+		dz_submit(s, 1);
+	while (s->dzbusy)
+		dz_collect(s);
+}
+
+
+
+/*
+  Multi-entry archives: the entries are written one after the other by
+  ordinary writing streams, each one at its base offset; their central
+  headers are collected in memory and written, followed by the end record,
+  when the archive is closed.
+*/
+struct MZAE_ZIP {
+	MZAE_SINK sink;
+	MZAE_CTX *ctx;
+	unsigned long long offset;	// where the next entry begins
+	unsigned long long entries;
+	char *cd;		// central directory
+	unsigned long long cdlen;
+	unsigned long long cdsize;
+	int busy;		// an entry is being written
+	int err;
+};
+
+
+
+static void zip_append(MZAE_ZIP* z, char* central, unsigned int len)
+{
+	char *p;
+	unsigned long long size;
+
+	if (z->cdlen + len > z->cdsize)
+	{
+		size = z->cdsize? z->cdsize * 2 : 4096;
+		while (size < z->cdlen + len)
+			size *= 2;
+		p = size == (size_t) size? (char*) ctx_alloc(z->ctx, CTX_STATS(z->ctx), (size_t) size) : 0;
+		if (!p)
+		{
+			z->err = MZAE_ERR_NOMEM;
+			return;
+		}
+		if (z->cdlen)
+			memcpy(p, z->cd, (size_t) z->cdlen);
+		ctx_free(z->ctx, CTX_STATS(z->ctx), z->cd);
+		z->cd = p;
+		z->cdsize = size;
+	}
+	memcpy(z->cd + z->cdlen, central, len);
+	z->cdlen += len;
+	z->entries++;
+}
+
+
+
+// Writes the central directory, in pieces that fit the sink
+static int zip_sink(MZAE_ZIP* z, unsigned long long offset, char* buf, unsigned long long len)
+{
+	unsigned int n;
+
+	for (; len; offset += n, buf += n, len -= n)
+	{
+		n = len < MZAE_MT_JOB? (unsigned int) len : MZAE_MT_JOB;
+		if (z->sink.write(z->sink.opaque, offset, buf, n))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+// Accounts an entry written by a stream: a failed one spoils the archive
+static void zip_entry_end(MZAE_ZIP* z, int err, unsigned long long len)
+{
+	if (err && !z->err)
+		z->err = err;
+	z->offset += len;
+	z->busy = 0;
+}
+
+
+
+int MZAE_zip_create(MZAE_ZIP** pz, MZAE_CTX* ctx, MZAE_SINK* sink)
+{
+	MZAE_ZIP *z;
+
+	if (!pz || !sink || !sink->write)
+		return MZAE_ERR_PARAMS;
+
+	z = (MZAE_ZIP*) ctx_calloc(ctx, CTX_STATS(ctx), 1, sizeof(MZAE_ZIP));
+	if (!z)
+		return MZAE_ERR_NOMEM;
+
+	z->sink = *sink;
+	z->ctx = ctx;
+	*pz = z;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_zip_add(MZAE_ZIP* z, char* name, char* password, MZAE_STREAM** ps)
+{
+	int r;
+
+	if (!z || z->busy)
+		return MZAE_ERR_PARAMS;
+
+	if (z->err)
+		return z->err;
+
+	// Entries are ordinary files: the text is not reversed
+	if ((r = write_init(z->ctx, ps, password, MZAE_FLAG_V1, &z->sink, name, z->offset)))
+		return r;
+
+	(*ps)->zip = z;
+	z->busy = 1;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_zip_close(MZAE_ZIP* z, unsigned long long *dstLen)
+{
+	char end[76 + sizeof(ucEndHeader)];
+	unsigned int endlen = 0;
+	int r;
+
+	if (!z)
+		return MZAE_ERR_PARAMS;
+
+	r = z->busy? MZAE_ERR_PARAMS : z->err;
+
+	if (!r)
+	{
+		endlen = end_record(end, z->entries, z->cdlen, z->offset, 0);
+		if ((z->cdlen && zip_sink(z, z->offset, z->cd, z->cdlen)) ||
+			z->sink.write(z->sink.opaque, z->offset + z->cdlen, end, endlen))
+			r = MZAE_ERR_SINK;
+	}
+
+	if (dstLen)
+		*dstLen = r? 0 : z->offset + z->cdlen + endlen;
+
+	ctx_free(z->ctx, CTX_STATS(z->ctx), z->cd);
+	ctx_free(z->ctx, CTX_STATS(z->ctx), z);
+
+	return r;
+}
+
+
+
+int MZAE_write_init(MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink)
+{
+	return write_init(0, ps, password, flags, sink, "data", 0);
+}
+
+
+
+int MZAE_write_init_ex(MZAE_CTX* ctx, MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink)
+{
+	return write_init(ctx, ps, password, flags, sink, "data", 0);
+}
+
+
+
+// Starts an entry called name, at offset base of the sink
+static int write_init(MZAE_CTX* ctx, MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink, char* name, unsigned long long base)
+{
+	MZAE_STREAM* s;
+	unsigned int n, hdr;
+	char *p;
+	int r;
+
+	if (!ps || !sink || !sink->write || !name)
+		return MZAE_ERR_PARAMS;
+
+	// Local header, extra fields, salt and check word must fit the header buffer
+	n = strlen(name);
+	hdr = 30 + n + 11;
+	if (!n || hdr + 20 + 18 > MZAE_HDRMAX)
+		return MZAE_ERR_PARAMS;
+
+	if (!password || !password[0])
+		return MZAE_ERR_NOPW;
+
+	s = (MZAE_STREAM*) ctx_calloc(ctx, CTX_STATS(ctx), 1, sizeof(MZAE_STREAM));
+	if (!s)
+		return MZAE_ERR_NOMEM;
+
+	s->sink = *sink;
+	s->flags = flags;
+	s->ctx = ctx;
+#ifdef MZAE_PROFILE
+	s->stats = CTX_STATS(ctx);
+#endif
+	s->method = 8;
+	s->level = MZAE_LEVEL;
+	s->base = base;
+	s->namelen = n;
+
+	// Placeholder local header, salt and check word
+	memcpy(s->header, ucLocalHeader, 30);
+	memcpy(s->header + 30, name, n);
+	memcpy(s->header + 30 + n, ucLocalHeader + 34, 11);
+	p = s->header;
+	PW(26, n);
+
+	if (MZAE_gen_salt_ex(CTX_ENGINE(ctx), s->header + hdr, 16))
+	{
+		stream_free(s);
+		return MZAE_ERR_SALT;
+	}
+
+	// Encrypts with AES-256 always!
+	if ((r = stream_keys(s, password, s->header + hdr, 16, s->header + hdr + 16, 0)))
+	{
+		stream_free(s);
+		return r;
+	}
+
+	if (MZAE_deflate_init(&s->codec, s->level))
+	{
+		stream_free(s);
+		return MZAE_ERR_CODEC;
+	}
+
+	if (stream_sink(s, 0, s->header, hdr + 18))
+	{
+		MZAE_deflate_end(s->codec);
+		stream_free(s);
+		return MZAE_ERR_SINK;
+	}
+	s->offset = hdr + 18;
+
+	*ps = s;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_write_update(MZAE_STREAM* s, char* src, unsigned long srcLen)
+{
+	unsigned long long t0;
+	unsigned int n;
+	char *p;
+	int r;
+
+	if (!s)
+		return MZAE_ERR_PARAMS;
+
+	// Looks at the first chunk (the end of a V2 document): data like a ZIP or
+	// a JPEG are stored
+	if (!s->uncompSize && !s->err && s->method)
+	{
+		n = srcLen < MZAE_CHUNK? srcLen : MZAE_CHUNK;
+		if (incompressible((s->flags & MZAE_FLAG_V1)? src : src + srcLen - n, n))
+			MZAE_stream_setopt(s, MZAE_OPT_LEVEL, 0);
+	}
+
+	// The workers compress too, if the engine can join blocks
+	if (!s->uncompSize && !s->dz && !s->err && s->threads && s->method &&
+		!MZAE_deflate_block(s->level, 0, 0, 0, 0, 0, 0, 0) && (r = dz_start(s)))
+		stream_seterr(s, r);
+
+	while (!s->err && srcLen)
+	{
+		n = srcLen < MZAE_CHUNK? srcLen : MZAE_CHUNK;
+
+		if (s->flags & MZAE_FLAG_V1)
+		{
+			// stored data are encrypted in place: the source must not be
+			if (s->method)
+				p = src;
+			else
+				p = (char*) memcpy(s->buf, src, n);
+			src += n;
+		}
+		else
+		{
+			// V2: takes the chunk end first, reversing it
+			p = s->buf;
+			t0 = stats_start(s);
+			revcpy(p, src + srcLen - n, n);
+			stats_stop(s, MZAE_STAGE_REV, t0, n);
+		}
+		srcLen -= n;
+		s->uncompSize += n;
+
+		if (!s->zip64 && s->uncompSize >= 0xFFFFFFFF)
+		{
+			stream_seterr(s, MZAE_ERR_TOOBIG);
+			break;
+		}
+
+		if (s->dz)
+		{
+			// checksummed and compressed by the workers
+			dz_queue(s, p, n);
+			continue;
+		}
+
+		t0 = stats_start(s);
+		s->crc = MZAE_crc(s->crc, p, n);
+		stats_stop(s, MZAE_STAGE_CRC, t0, n);
+
+		if (!s->method)
+			write_out(s, p, n);
+		else
+		{
+			t0 = stats_start(s);
+			if (MZAE_deflate_update(s->codec, p, n, 0, write_out, s))
+				stream_seterr(s, MZAE_ERR_CODEC);
+			stats_stop(s, MZAE_STAGE_DEFLATE, t0, n);
+		}
+	}
+
+	return s->err;
+}
+
+
+
+int MZAE_write_final(MZAE_STREAM* s, unsigned long long *dstLen)
+{
+	char digest[20], central[MZAE_HDRMAX + 32];
+	unsigned int endlen, cenlen;
+	unsigned long long t0;
+	int r;
+
+	if (!s)
+		return MZAE_ERR_PARAMS;
+
+	// Only the entries of an archive may be empty
+	if (!s->err && !s->uncompSize && !s->zip)
+		stream_seterr(s, MZAE_ERR_PARAMS);
+
+	if (s->dz)
+		dz_flush(s);
+	t0 = stats_start(s);
+	if (!s->err && s->codec && MZAE_deflate_update(s->codec, 0, 0, 1, write_out, s))
+		stream_seterr(s, MZAE_ERR_CODEC);
+	stats_stop(s, MZAE_STAGE_DEFLATE, t0, 0);
+	MZAE_deflate_end(s->codec);
+	mt_flush(s);
+
+	if (!s->err && !s->zip64 && s->compSize + 28 >= 0xFFFFFFFF)
+		stream_seterr(s, MZAE_ERR_TOOBIG);
+
+	r = MZAE_hmac_sha1_final(s->hmac, digest);
+	s->hmac = 0;
+	if (r)
+		stream_seterr(s, MZAE_ERR_HMAC);
+
+	if (!s->err && !stream_sink(s, s->offset, digest, 10))
+	{
+		s->offset += 10;
+		cenlen = stream_headers(s, s->header, central);
+		endlen = end_record(s->buf, 1, cenlen, s->offset, !(s->flags & MZAE_FLAG_V1));
+		if (!stream_sink(s, 0, s->header, 30 + s->namelen + 11 + (s->zip64? 20 : 0)))
+		{
+			if (s->zip)
+				// the archive collects the central headers and writes them at the end
+				zip_append(s->zip, central, cenlen);
+			else if (!stream_sink(s, s->offset, central, cenlen) &&
+				!stream_sink(s, s->offset + cenlen, s->buf, endlen))
+				s->offset += cenlen + endlen;
+		}
+	}
+
+	if (dstLen)
+		*dstLen = s->offset;
+
+	r = s->err;
+	if (s->zip)
+		zip_entry_end(s->zip, r, s->offset);
+	stream_free(s);
+
+	return r;
+}
+
+
+
+// Checks, reverses if needed and emits a chunk of the extracted document
+static int read_out(void* opaque, char* buf, unsigned int len)
+{
+	MZAE_STREAM* s = (MZAE_STREAM*) opaque;
+	unsigned long long offset, t0;
+
+	if (len > s->uncompSize - s->offset)
+	{
+		s->codec_err = MZAE_ERR_CODEC;
+		return 1;
+	}
+
+	if (s->ae == 1)
+	{
+		t0 = stats_start(s);
+		s->crc = MZAE_crc(s->crc, buf, len);
+		stats_stop(s, MZAE_STAGE_CRC, t0, len);
+	}
+
+	if (s->flags & MZAE_FLAG_V1)
+		offset = s->offset;
+	else
+	{
+		t0 = stats_start(s);
+		memrev(buf, len);
+		stats_stop(s, MZAE_STAGE_REV, t0, len);
+		offset = s->uncompSize - s->offset - len;
+	}
+
+	if (stream_sink(s, offset, buf, len))
+		return 1;
+
+	s->offset += len;
+
+	return 0;
+}
+
+
+
+// Inflates (if needed) and emits a chunk of decrypted data
+static void read_data(MZAE_STREAM* s, char* buf, unsigned int len)
+{
+	unsigned long long t0;
+
+	// a decoding error is reported only if the HMAC is good
+	if (s->codec_err)
+		return;
+
+	if (s->method)
+	{
+		t0 = stats_start(s);
+		if (MZAE_inflate_update(s->codec, buf, len, read_out, s) && !s->codec_err)
+			s->codec_err = MZAE_ERR_CODEC;
+		stats_stop(s, MZAE_STAGE_INFLATE, t0, len);
+	}
+	else
+		read_out(s, buf, len);
+}
+
+
+
+// Looks for an extra field between offsets e and end of a header
+static unsigned int find_extra(char* src, unsigned int e, unsigned int end, int id)
+{
+	for (; e + 4 <= end; e += 4 + GW(e+2))
+		if (GW(e) == id)
+			return e + 4 + GW(e+2) <= end? e : end;
+	return end;
+}
+
+
+
+/*
+  Fills info from the local header at src, len bytes long with its name and
+  extra fields: AES extra field first, then the sizes past 4 GiB from the
+  ZIP64 one (uncompressed first).
+*/
+static int local_info(char* src, unsigned int len, MZAE_INFO* info)
+{
+	unsigned int e, z, saltlen;
+	unsigned long long comp;
+
+	e = find_extra(src, 30 + GW(26), len, 0x9901);
+	if (e + 11 > len || GW(e+2) != 7 || GW(e+4) < 1 || GW(e+4) > 2 || GW(e+6) != 0x4541)
+		return MZAE_ERR_BADZIP;
+
+	info->ae = GW(e+4);
+	info->keyBits = 64 + 64 * (unsigned char) src[e+8];
+	info->method = GW(e+9);
+	if (info->keyBits < 128 || info->keyBits > 256 || (info->method != 0 && info->method != 8))
+		return MZAE_ERR_BADZIP;
+
+	comp = GDW(18);
+	info->uncompSize = GDW(22);
+	z = find_extra(src, 30 + GW(26), len, 1) + 4;
+	if (info->uncompSize == 0xFFFFFFFF)
+	{
+		if (z + 8 > len)
+			return MZAE_ERR_BADZIP;
+		info->uncompSize = GQW(z);
+		z += 8;
+	}
+	if (comp == 0xFFFFFFFF)
+	{
+		if (z + 8 > len)
+			return MZAE_ERR_BADZIP;
+		comp = GQW(z);
+	}
+
+	saltlen = info->keyBits / 16;
+	if (comp < saltlen + 12)
+		return MZAE_ERR_BADZIP;
+	info->compSize = comp - (saltlen + 12); // size & offset depend on salt size!
+	info->crc = GDW(14);
+	info->dosTime = GDW(10);
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+// Parses the local header step by step, then checks the password
+static int read_header(MZAE_STREAM* s)
+{
+	char *src = s->header;
+	unsigned int e, saltlen;
+	MZAE_INFO info;
+	int r;
+
+	if (s->state == RS_HEADER)
+	{
+		if (GDW(0) != 0x04034B50 || GW(8) != 99)
+			return MZAE_ERR_BADZIP;
+		s->need = 30 + GW(26) + GW(28);
+		if (s->need + 18 > MZAE_HDRMAX)
+			return MZAE_ERR_BADZIP;
+		s->state = RS_EXTRA;
+		return MZAE_ERR_SUCCESS;
+	}
+
+	if (s->state == RS_EXTRA)
+	{
+		if ((r = local_info(src, s->need, &info)))
+			return r;
+
+		s->ae = info.ae;
+		s->keyLen = info.keyBits / 64 - 1;
+		s->method = info.method;
+		s->uncompSize = info.uncompSize;
+		s->compSize = info.compSize;
+		s->hdrcrc = info.crc;
+		s->need += info.keyBits / 16 + 2;
+		s->state = RS_SALT;
+		return MZAE_ERR_SUCCESS;
+	}
+
+	saltlen = 4 + s->keyLen*4;
+	e = s->need - saltlen - 2;
+
+	// Here we regenerate the AES key, the HMAC key and the 16-bit verification value
+	r = stream_keys(s, s->password, src + e, saltlen, src + e + saltlen, 1);
+
+	memset(s->password, 0, strlen(s->password));
+
+	if (!r && s->method && !s->checkonly && MZAE_inflate_init(&s->codec))
+		r = MZAE_ERR_CODEC;
+
+	s->state = s->checkonly? RS_TRAILER : s->compSize? RS_DATA : RS_MAC;
+
+	return r;
+}
+
+
+
+int MZAE_read_init(MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink)
+{
+	return read_init(0, ps, password, flags, sink);
+}
+
+
+
+int MZAE_read_init_ex(MZAE_CTX* ctx, MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink)
+{
+	return read_init(ctx, ps, password, flags, sink);
+}
+
+
+
+static int read_init(MZAE_CTX* ctx, MZAE_STREAM** ps, char* password, int flags, MZAE_SINK* sink)
+{
+	MZAE_STREAM* s;
+	unsigned int pwlen;
+
+	if (!ps || !sink || !sink->write)
+		return MZAE_ERR_PARAMS;
+
+	if (!password || !password[0])
+		return MZAE_ERR_NOPW;
+
+	s = (MZAE_STREAM*) ctx_calloc(ctx, CTX_STATS(ctx), 1, sizeof(MZAE_STREAM));
+	if (!s)
+		return MZAE_ERR_NOMEM;
+#ifdef MZAE_PROFILE
+	s->stats = CTX_STATS(ctx);
+#endif
+
+	// The password is kept until the salt is read
+	pwlen = strlen(password) + 1;
+	s->password = (char*) ctx_alloc(ctx, CTX_STATS(ctx), pwlen);
+	if (!s->password)
+	{
+		ctx_free(ctx, CTX_STATS(ctx), s);
+		return MZAE_ERR_NOMEM;
+	}
+	memcpy(s->password, password, pwlen);
+
+	s->sink = *sink;
+	s->flags = flags;
+	s->reader = 1;
+	s->ctx = ctx;
+	s->state = RS_HEADER;
+	s->need = 30;
+
+	*ps = s;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_read_update(MZAE_STREAM* s, char* src, unsigned long srcLen)
+{
+	unsigned long long n;
+	int r;
+
+	if (!s)
+		return MZAE_ERR_PARAMS;
+
+	while (!s->err && srcLen)
+	{
+		if (s->state <= RS_SALT)
+		{
+			n = s->need - s->hdrlen;
+			if (n > srcLen)
+				n = srcLen;
+			memcpy(s->header + s->hdrlen, src, n);
+			s->hdrlen += n;
+			src += n;
+			srcLen -= n;
+			if (s->hdrlen == s->need && (r = read_header(s)))
+				stream_seterr(s, r);
+		}
+		else if (s->state == RS_DATA)
+		{
+			n = s->compSize - s->consumed;
+			if (n > srcLen)
+				n = srcLen;
+			if (n > MZAE_CHUNK)
+				n = MZAE_CHUNK;
+
+			// Authenticates and decrypts the chunk in a single pass, then inflates
+			// it, or leaves the job to the workers
+			if (s->threads)
+				mt_queue(s, src, n);
+			else if ((r = stream_crypt(s, src, n, s->buf, 1)))
+				stream_seterr(s, r);
+			else
+				read_data(s, s->buf, n);
+
+			s->consumed += n;
+			src += n;
+			srcLen -= n;
+			if (s->consumed == s->compSize)
+			{
+				mt_flush(s);
+				// tells the codec that the compressed data are over
+				if (s->method && !s->err)
+					read_data(s, 0, 0);
+				s->state = RS_MAC;
+			}
+		}
+		else if (s->state == RS_MAC)
+		{
+			n = 10 - s->maclen;
+			if (n > srcLen)
+				n = srcLen;
+			memcpy(s->mac + s->maclen, src, n);
+			s->maclen += n;
+			src += n;
+			srcLen -= n;
+			if (s->maclen == 10)
+				s->state = RS_TRAILER;
+		}
+		else
+			// Central directory and end record are not needed
+			break;
+	}
+
+	return s->err;
+}
+
+
+
+int MZAE_read_final(MZAE_STREAM* s, unsigned long long *dstLen)
+{
+	char digest[20];
+	int r;
+
+	if (!s)
+		return MZAE_ERR_PARAMS;
+
+	if (!s->err && s->state != RS_TRAILER)
+		stream_seterr(s, MZAE_ERR_BADZIP);
+
+	// a truncated archive can leave a job in flight
+	mt_flush(s);
+
+	if (s->hmac)
+	{
+		r = MZAE_hmac_sha1_final(s->hmac, digest);
+		s->hmac = 0;
+		if (r)
+			stream_seterr(s, MZAE_ERR_HMAC);
+		// Compares the HMACs
+		if (memcmp(digest, s->mac, 10))
+			stream_seterr(s, MZAE_ERR_BADHMAC);
+	}
+
+	if (s->codec && MZAE_inflate_end(s->codec) && !s->codec_err)
+		s->codec_err = MZAE_ERR_CODEC;
+
+	if (s->codec_err || s->offset != s->uncompSize)
+		stream_seterr(s, MZAE_ERR_CODEC);
+
+	// AE-1 encryption only
+	if (s->ae == 1 && s->crc != s->hdrcrc)
+		stream_seterr(s, MZAE_ERR_BADCRC);
+
+	if (dstLen)
+		*dstLen = s->offset;
+
+	r = s->err;
+	stream_free(s);
+
+	return r;
+}
+
+
+
+/*
+  Finds the end record, the one whose comment reaches the end of the
+  archive, and reads entries, length and offset of the central directory,
+  from the ZIP64 end record if needed. The tail read first has room for the
+  ZIP64 records and a one byte comment (our documents have "R" or nothing);
+  the longest comment is looked for only if the record isn't there.
+*/
+static int end_find(MZAE_SOURCE* source, MZAE_CTX* ctx, unsigned long long* pentries, unsigned long long* pcdlen, unsigned long long* pcdoff, int* flags)
+{
+	char *buf = 0, *src;
+	unsigned long long entries, cdlen, cdoff;
+	unsigned int len = 0, max, pos;
+	int found = 0;
+
+	if (source->size < 22)
+		return MZAE_ERR_BADZIP;
+
+	for (max = 76 + 22 + 1; !found && len < source->size && len < max; max = 76 + 22 + 65535)
+	{
+		ctx_free(ctx, CTX_STATS(ctx), buf);
+		len = source->size < max? (unsigned int) source->size : max;
+		buf = (char*) ctx_alloc(ctx, CTX_STATS(ctx), len);
+		if (!buf)
+			return MZAE_ERR_NOMEM;
+		if (source->read(source->opaque, source->size - len, buf, len))
+		{
+			ctx_free(ctx, CTX_STATS(ctx), buf);
+			return MZAE_ERR_SOURCE;
+		}
+
+		for (pos = len - 22; ; pos--)
+		{
+			src = buf + pos;
+			if ((found = GDW(0) == 0x06054B50 && pos + 22 + GW(20) == len) || !pos)
+				break;
+		}
+	}
+
+	if (!found)
+	{
+		ctx_free(ctx, CTX_STATS(ctx), buf);
+		return MZAE_ERR_BADZIP;
+	}
+
+	entries = GW(10);
+	cdlen = GDW(12);
+	cdoff = GDW(16);
+	// The "R" comment marks reversed (V2) documents
+	*flags = (GW(20) == 1 && src[22] == 0x52)? 0 : MZAE_FLAG_V1;
+
+	// The ZIP64 end record, just before its locator, has the true values
+	if (pos >= 76 && (entries == 0xFFFF || cdlen == 0xFFFFFFFF || cdoff == 0xFFFFFFFF))
+	{
+		src = buf + pos - 20;
+		if (GDW(0) == 0x07064B50 && GQW(8) == source->size - len + pos - 76)
+		{
+			src = buf + pos - 76;
+			if (GDW(0) == 0x06064B50)
+			{
+				entries = GQW(32);
+				cdlen = GQW(40);
+				cdoff = GQW(48);
+			}
+		}
+	}
+	ctx_free(ctx, CTX_STATS(ctx), buf);
+
+	*pentries = entries;
+	*pcdlen = cdlen;
+	*pcdoff = cdoff;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+/*
+  The central directory is scanned through a window of MZAE_CD_WINDOW bytes,
+  which holds the longest record: it moves on when a record crosses its end.
+*/
+int MZAE_zip_find(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, MZAE_ENTRY* entry)
+{
+	char *buf, *src;
+	unsigned long long pos, cdlen, cdoff, entries, i, win = 0;
+	unsigned int n, namelen, x, z, winlen = 0;
+	int r = MZAE_ERR_NOENTRY;
+
+	if (!source || !source->read || !name || !entry)
+		return MZAE_ERR_PARAMS;
+
+	if ((r = end_find(source, ctx, &entries, &cdlen, &cdoff, &entry->flags)))
+		return r;
+
+	if (cdoff > source->size || cdlen > source->size - cdoff)
+		return MZAE_ERR_BADZIP;
+
+	buf = (char*) ctx_alloc(ctx, CTX_STATS(ctx), MZAE_CD_WINDOW);
+	if (!buf)
+		return MZAE_ERR_NOMEM;
+
+	r = MZAE_ERR_NOENTRY;
+	namelen = strlen(name);
+	for (i = 0, pos = 0; i < entries; i++, pos += n)
+	{
+		if (pos + 46 > cdlen)
+		{
+			r = MZAE_ERR_BADZIP;
+			break;
+		}
+		// The window moves to a record that crosses its end
+		src = buf + (pos - win);
+		if (pos + 46 > win + winlen || pos + 46 + GW(28) + GW(30) + GW(32) > win + winlen)
+		{
+			win = pos;
+			winlen = cdlen - pos < MZAE_CD_WINDOW? (unsigned int) (cdlen - pos) : MZAE_CD_WINDOW;
+			if (source->read(source->opaque, cdoff + win, buf, winlen))
+			{
+				r = MZAE_ERR_SOURCE;
+				break;
+			}
+			src = buf;
+		}
+		if (GDW(0) != 0x02014B50)
+		{
+			r = MZAE_ERR_BADZIP;
+			break;
+		}
+		n = 46 + GW(28) + GW(30) + GW(32);
+		if (pos + n > cdlen)
+		{
+			r = MZAE_ERR_BADZIP;
+			break;
+		}
+		if (GW(28) == namelen && !memcmp(src + 46, name, namelen))
+		{
+			entry->offset = GDW(42);
+			entry->compSize = GDW(20);
+			entry->uncompSize = GDW(24);
+			r = MZAE_ERR_SUCCESS;
+
+			// ZIP64 values come in this order, if their field is full
+			x = 46 + GW(28) + GW(30);
+			z = find_extra(src, 46 + GW(28), x, 1) + 4;
+			if (entry->uncompSize == 0xFFFFFFFF)
+			{
+				entry->uncompSize = z + 8 <= x? GQW(z) : 0;
+				z += 8;
+			}
+			if (entry->compSize == 0xFFFFFFFF)
+			{
+				entry->compSize = z + 8 <= x? GQW(z) : 0;
+				z += 8;
+			}
+			if (entry->offset == 0xFFFFFFFF)
+			{
+				if (z + 8 > x)
+					r = MZAE_ERR_BADZIP;
+				else
+					entry->offset = GQW(z);
+			}
+
+			if (entry->offset >= cdoff)
+				r = MZAE_ERR_BADZIP;
+			break;
+		}
+	}
+
+	ctx_free(ctx, CTX_STATS(ctx), buf);
+
+	return r;
+}
+
+
+
+int MZAE_zip_read(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, char* password, MZAE_SINK* sink, unsigned long long *dstLen)
+{
+	MZAE_ENTRY entry;
+	MZAE_STREAM *s;
+	unsigned long long pos, end;
+	unsigned int n;
+	char *buf, *src;
+	int r;
+
+	if ((r = MZAE_zip_find(source, ctx, name, &entry)))
+		return r;
+
+	if (!password || !password[0])
+		return MZAE_ERR_NOPW;
+
+	buf = (char*) ctx_alloc(ctx, CTX_STATS(ctx), MZAE_CHUNK);
+	if (!buf)
+		return MZAE_ERR_NOMEM;
+
+	// The local header tells where the entry data begin
+	src = buf;
+	if (entry.offset + 30 > source->size ||
+		source->read(source->opaque, entry.offset, buf, 30))
+	{
+		ctx_free(ctx, CTX_STATS(ctx), buf);
+		return entry.offset + 30 > source->size? MZAE_ERR_BADZIP : MZAE_ERR_SOURCE;
+	}
+	pos = entry.offset;
+	end = pos + 30 + GW(26) + GW(28) + entry.compSize;
+	if (end > source->size)
+	{
+		ctx_free(ctx, CTX_STATS(ctx), buf);
+		return MZAE_ERR_BADZIP;
+	}
+
+	if ((r = read_init(ctx, &s, password, entry.flags, sink)))
+	{
+		ctx_free(ctx, CTX_STATS(ctx), buf);
+		return r;
+	}
+
+	for (; !r && pos < end; pos += n)
+	{
+		n = end - pos < MZAE_CHUNK? end - pos : MZAE_CHUNK;
+		if (source->read(source->opaque, pos, buf, n))
+			r = MZAE_ERR_SOURCE;
+		else
+			r = MZAE_read_update(s, buf, n);
+	}
+
+	if (!r)
+		r = MZAE_read_final(s, dstLen);
+	else
+		MZAE_read_final(s, 0);
+
+	ctx_free(ctx, CTX_STATS(ctx), buf);
+
+	return r;
+}
+
+
+
+// Source reading from a caller buffer
+static int mem_read(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+	memcpy(buf, (char*) opaque + offset, len);
+	return 0;
+}
+
+
+
+int MiniZipAEReadEntry(char* src, unsigned long srcLen, char* name, char** dst, unsigned long *dstLen, char* password)
+{
+	MZAE_SOURCE source;
+	MZAE_ENTRY entry;
+	MZAE_SINK sink;
+	MZAE_MEMSINK mem;
+	unsigned long long len;
+	int r;
+
+	if (!srcLen)
+		return MZAE_ERR_PARAMS;
+
+	source.opaque = src;
+	source.read = mem_read;
+	source.size = srcLen;
+
+	if (! *dstLen)
+	{
+		if ((r = MZAE_zip_find(&source, 0, name, &entry)))
+			return r;
+		if (entry.uncompSize > (unsigned long) -1)
+			return MZAE_ERR_NOMEM;
+		*dstLen = (unsigned long) entry.uncompSize;
+		return MZAE_ERR_SUCCESS;
+	}
+
+	if (! *dst)
+		return MZAE_ERR_BUFFER;
+
+	mem.p = *dst;
+	mem.size = *dstLen;
+	sink.opaque = &mem;
+	sink.write = mem_write;
+
+	// Never leaves unauthenticated data around
+	if ((r = MZAE_zip_read(&source, 0, name, password, &sink, &len)))
+		memset(*dst, 0, mem.size);
+	else
+		*dstLen = (unsigned long) len;
+
+	return r == MZAE_ERR_SINK? MZAE_ERR_BUFFER : r;
+}
+
+
+
+/*
+  Ranged reading: a reader stream parses the local header and derives the
+  keys, then its AES-CTR state is moved to the block of each requested range.
+  The HMAC needs all the encrypted data, so it is verified on its own pass.
+*/
+struct MZAE_RANGE {
+	MZAE_STREAM *s;
+	MZAE_SOURCE source;
+	unsigned long long data;	// offset of the encrypted data in the archive
+	int flags;
+	int checked;		// the HMAC was verified, with result err
+	int err;
+	MZAE_POOL *pool;	// runs the background verification
+	int group;
+	char buf[MZAE_CHUNK];
+};
+
+
+
+// The reader stream of a range never emits data
+static int range_sink(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+	(void) opaque;
+	(void) offset;
+	(void) buf;
+	(void) len;
+	return 1;
+}
+
+
+
+// Feeds a reader stream with the headers of the entry at offset, up to the encrypted data
+static int feed_headers(MZAE_STREAM* s, MZAE_SOURCE* source, unsigned long long offset, char* buf)
+{
+	unsigned int n;
+	int err = 0;
+
+	while (!err && s->state <= RS_SALT)
+	{
+		n = s->need - s->hdrlen;
+		if (offset + s->hdrlen + n > source->size)
+			err = MZAE_ERR_BADZIP;
+		else if (source->read(source->opaque, offset + s->hdrlen, buf, n))
+			err = MZAE_ERR_SOURCE;
+		else
+			err = MZAE_read_update(s, buf, n);
+	}
+
+	return err;
+}
+
+
+
+// Authenticates all the encrypted data of the entry
+static void range_check(void* arg)
+{
+	MZAE_RANGE *r = (MZAE_RANGE*) arg;
+	MZAE_STREAM *s = r->s;
+	char digest[20], mac[10];
+	unsigned long long pos;
+	unsigned int n;
+	int err = 0;
+
+	for (pos = 0; !err && pos < s->compSize; pos += n)
+	{
+		n = s->compSize - pos < MZAE_CHUNK? s->compSize - pos : MZAE_CHUNK;
+		if (r->source.read(r->source.opaque, r->data + pos, r->buf, n))
+			err = MZAE_ERR_SOURCE;
+		else if (MZAE_hmac_sha1_update(s->hmac, r->buf, n))
+			err = MZAE_ERR_HMAC;
+	}
+
+	if (!err && r->source.read(r->source.opaque, r->data + s->compSize, mac, 10))
+		err = MZAE_ERR_SOURCE;
+
+	if (MZAE_hmac_sha1_final(s->hmac, digest) && !err)
+		err = MZAE_ERR_HMAC;
+	s->hmac = 0;
+
+	if (!err && memcmp(digest, mac, 10))
+		err = MZAE_ERR_BADHMAC;
+
+	r->err = err;
+	r->checked = 1;
+}
+
+
+
+int MZAE_range_open(MZAE_RANGE** pr, MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, char* password, int flags)
+{
+	MZAE_RANGE *r;
+	MZAE_ENTRY entry;
+	MZAE_STREAM *s;
+	MZAE_SINK sink;
+	int err;
+
+	if (!pr)
+		return MZAE_ERR_PARAMS;
+
+	if ((err = MZAE_zip_find(source, ctx, name, &entry)))
+		return err;
+
+	r = (MZAE_RANGE*) ctx_calloc(ctx, CTX_STATS(ctx), 1, sizeof(MZAE_RANGE));
+	if (!r)
+		return MZAE_ERR_NOMEM;
+
+	sink.opaque = 0;
+	sink.write = range_sink;
+	if ((err = read_init(ctx, &r->s, password, entry.flags, &sink)))
+	{
+		ctx_free(ctx, CTX_STATS(ctx), r);
+		return err;
+	}
+	s = r->s;
+	r->source = *source;
+	r->flags = flags;
+
+	err = feed_headers(s, source, entry.offset, r->buf);
+	r->data = entry.offset + s->hdrlen;
+
+	if (!err && s->method)
+		err = MZAE_ERR_COMPRESSED;
+	if (!err && (s->compSize != s->uncompSize || r->data + s->compSize + 10 > source->size))
+		err = MZAE_ERR_BADZIP;
+
+	if (!err)
+	{
+		if (flags & MZAE_RANGE_BACKGROUND)
+		{
+			if (MZAE_pool_create(&r->pool, 1) || MZAE_pool_submit(r->pool, range_check, r, &r->group))
+				err = MZAE_ERR_NOMEM;
+		}
+		else if (!(flags & MZAE_RANGE_DEFER))
+		{
+			range_check(r);
+			err = r->err;
+		}
+	}
+
+	if (err)
+	{
+		MZAE_range_close(r);
+		return err;
+	}
+
+	*pr = r;
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_range_read(MZAE_RANGE* r, unsigned long long offset, char* dst, unsigned int len)
+{
+	unsigned long long pos;
+
+	if (!r || !dst || offset > r->s->uncompSize || len > r->s->uncompSize - offset)
+		return MZAE_ERR_PARAMS;
+
+	// A range of a V2 document is stored reversed, at the mirrored offset
+	pos = (r->s->flags & MZAE_FLAG_V1)? offset : r->s->uncompSize - offset - len;
+
+	if (r->source.read(r->source.opaque, r->data + pos, dst, len))
+		return MZAE_ERR_SOURCE;
+
+	// The counter goes straight to block pos/16
+	if (MZAE_ctr_seek(r->s->ctr, pos) || MZAE_ctr_update(r->s->ctr, dst, len, dst))
+	{
+		memset(dst, 0, len);
+		return MZAE_ERR_AES;
+	}
+
+	if (!(r->s->flags & MZAE_FLAG_V1))
+		memrev(dst, len);
+
+	return MZAE_ERR_SUCCESS;
+}
+
+
+
+int MZAE_range_verify(MZAE_RANGE* r)
+{
+	if (!r)
+		return MZAE_ERR_PARAMS;
+
+	if (r->pool)
+		MZAE_pool_wait(r->pool, &r->group);
+	else if (!r->checked)
+		range_check(r);
+
+	return r->err;
+}
+
+
+
+unsigned long long MZAE_range_size(MZAE_RANGE* r)
+{
+	return r? r->s->uncompSize : 0;
+}
+
+
+
+void MZAE_range_close(MZAE_RANGE* r)
+{
+	MZAE_CTX *ctx;
+
+	if (!r)
+		return;
+
+	// Lets the background verification end
+	MZAE_pool_destroy(r->pool);
+	ctx = r->s->ctx;
+	stream_free(r->s);
+	memset(r, 0, sizeof(MZAE_RANGE));
+	ctx_free(ctx, CTX_STATS(ctx), r);
+}
+
+
+
+/*
+  Password check: a reader stream parses the local header and derives the
+  keys, then stops at the verification value, before any cipher state.
+*/
+int MZAE_check_password(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, char* password)
+{
+	MZAE_ENTRY entry;
+	MZAE_STREAM *s;
+	MZAE_SINK sink;
+	char buf[MZAE_HDRMAX];
+	int err;
+
+	if (!source || !source->read)
+		return MZAE_ERR_PARAMS;
+
+	entry.offset = 0;
+	if (name && (err = MZAE_zip_find(source, ctx, name, &entry)))
+		return err;
+
+	sink.opaque = 0;
+	sink.write = range_sink;
+	if ((err = read_init(ctx, &s, password, 0, &sink)))
+		return err;
+	s->checkonly = 1;
+
+	err = feed_headers(s, source, entry.offset, buf);
+	stream_free(s);
+	memset(buf, 0, sizeof(buf));
+
+	return err;
+}
+
+
+
+int MiniZipAECheck(char* src, unsigned long srcLen, char* password)
+{
+	MZAE_SOURCE source;
+
+	if (!src)
+		return MZAE_ERR_PARAMS;
+
+	source.opaque = src;
+	source.read = mem_read;
+	source.size = srcLen;
+
+	return MZAE_check_password(&source, 0, 0, password);
+}
+
+
+
+/*
+  Metadata probe: the end record at the tail of the archive tells the
+  entries and the V1/V2 flag, the local header the rest.
+*/
+int MZAE_probe(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, MZAE_INFO* info)
+{
+	MZAE_ENTRY entry;
+	unsigned long long cdlen, cdoff;
+	unsigned int len;
+	char src[MZAE_HDRMAX];
+	int r;
+
+	if (!source || !source->read || !info)
+		return MZAE_ERR_PARAMS;
+
+	memset(info, 0, sizeof(MZAE_INFO));
+	if ((r = end_find(source, ctx, &info->entries, &cdlen, &cdoff, &info->flags)))
+		return r;
+
+	entry.offset = 0;
+	if (name && (r = MZAE_zip_find(source, ctx, name, &entry)))
+		return r;
+
+	if (entry.offset + 30 > source->size)
+		return MZAE_ERR_BADZIP;
+	if (source->read(source->opaque, entry.offset, src, 30))
+		return MZAE_ERR_SOURCE;
+	if (GDW(0) != 0x04034B50 || GW(8) != 99)
+		return MZAE_ERR_BADZIP;
+
+	len = 30 + GW(26) + GW(28);
+	if (len > MZAE_HDRMAX || entry.offset + len > source->size)
+		return MZAE_ERR_BADZIP;
+	if (source->read(source->opaque, entry.offset + 30, src + 30, len - 30))
+		return MZAE_ERR_SOURCE;
+
+	return local_info(src, len, info);
+}
+
+
+
+#ifdef MAIN
+#include <stdio.h>
+static int main_write(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+	memcpy((char*) opaque + offset, buf, len);
+	return 0;
+}
+
+// Counts the blocks taken from the heap
+static void* main_alloc(void* opaque, unsigned long size)
+{
+	++*(long*) opaque;
+	return malloc(size);
+}
+
+static void main_release(void* opaque, void* p)
+{
+	free(p);
+}
+
+void main()
+{
+#ifdef MAIN_SAVES
+	FILE *f = fopen("test.zip", "wb");
+#endif
+	char *s = "Questo testo  la sorgente da comprimere e cifrare con MiniZipAEWrite, per poi verificarne l'uguaglianza con il prodotto di MiniZipAERead!";
+	char *out1, *out2, *out3, *out4, *out5, *names[3] = {"a.txt", "dir/b.txt", "c.txt"};
+	long len1=0, len2=0, r, i, j;
+	unsigned long long len3, len4, len5;
+	MZAE_STREAM *st;
+	MZAE_SINK sink;
+	MZAE_CTX *ctx;
+	MZAE_ZIP *zip;
+	MZAE_SOURCE source;
+	MZAE_RANGE *range;
+	MZAE_STATS stats;
+	MZAE_ALLOCATOR allocator;
+	MZAE_INFO info;
+	MZAE_ENTRY entry;
+	long blocks = 0, reused = 0, checked;
+	char part[32];
+	r = MiniZipAEWrite(s, strlen(s), &out1, &len1, "kazookazaa");
+	printf("MiniZipAEWrite returned %d: %s (requires %d bytes buffer)\n", r, MZAE_errmsg(r), len1);
+	out1 = (char*) malloc(len1);
+	r = MiniZipAEWrite(s, strlen(s), &out1, &len1, "kazookazaa");
+	printf("MiniZipAEWrite returned %d: %s\n", r, MZAE_errmsg(r));
+
+	// Passwords are checked on the first 63 bytes alone (a wrong one passes
+	// with one salt in 65536)
+	r = MiniZipAECheck(out1, 63, "kazookazaA");
+	printf("MiniZipAECheck returned %d: %s\n", r, MZAE_errmsg(r));
+	checked = MiniZipAECheck(out1, 63, "kazookazaa");
+	printf("MiniZipAECheck returned %d: %s\n", checked, MZAE_errmsg(checked));
+
+	// Metadata from the head and tail of the archive
+	source.opaque = out1;
+	source.read = mem_read;
+	source.size = len1;
+	r = MZAE_probe(&source, 0, 0, &info);
+	printf("MZAE_probe returned %d: %s (AE-%d, AES-%d, %llu bytes, %s)\n", r, MZAE_errmsg(r),
+		info.ae, info.keyBits, info.uncompSize, info.flags? "V1" : "V2");
+	if (r || (info.keyBits != 256 || info.flags || info.uncompSize != strlen(s) || info.entries != 1))
+		checked = MZAE_ERR_BADZIP;
+
+	r = MiniZipAERead(out1, len1, &out2, &len2, "kazookazaa");
+	printf("MiniZipAERead returned %d: %s (requires %d bytes buffer)\n", r, MZAE_errmsg(r), len2);
+	out2 = (char*) malloc(len2);
+	r = MiniZipAERead(out1, len1, &out2, &len2, "kazookazaa");
+	printf("MiniZipAERead returned %d: %s\n", r, MZAE_errmsg(r));
+
+	// The second read takes the keys from the context cache, and its memory
+	// from the arena
+	allocator.opaque = &blocks;
+	allocator.alloc = main_alloc;
+	allocator.release = main_release;
+	allocator.arena = MZAE_ARENA;
+	r = MZAE_ctx_init_ex(&ctx, 0, &allocator);
+	printf("MZAE_ctx_init_ex returned %d: %s\n", r, MZAE_errmsg(r));
+	for (i=0; i < 2; i++)
+	{
+		reused = blocks;
+		r = MiniZipAEReadCtx(ctx, out1, len1, &out2, &len2, "kazookazaa");
+		printf("MiniZipAEReadCtx returned %d: %s (%ld blocks allocated)\n", r, MZAE_errmsg(r), blocks - reused);
+	}
+	reused = blocks == reused;
+
+	// Streams the archive in 7-byte chunks, with 3 worker threads and the
+	// engine of the context, collecting statistics if built in
+	memset(&stats, 0, sizeof(stats));
+	j = MZAE_ctx_stats(ctx, &stats);
+	printf("MZAE_ctx_stats returned %d: %s\n", j, MZAE_errmsg(j));
+	out3 = (char*) malloc(len2);
+	sink.opaque = out3;
+	sink.write = main_write;
+	r = MZAE_read_init_ex(ctx, &st, "kazookazaa", 0, &sink);
+	if (!r)
+		r = MZAE_stream_setopt(st, MZAE_OPT_THREADS, 3);
+	for (i=0; !r && i < len1; i+=7)
+		r = MZAE_read_update(st, out1+i, len1-i < 7? len1-i : 7);
+	r = MZAE_read_final(st, &len3);
+	printf("MZAE_read_final returned %d: %s\n", r, MZAE_errmsg(r));
+	if (!j)
+		printf("%llu bytes decrypted in %llu ns, %lu allocations (%llu bytes at most, %llu left)\n",
+			stats.bytes[MZAE_STAGE_CTR], stats.ns[MZAE_STAGE_CTR], stats.allocs, stats.peak, stats.held);
+	MZAE_ctx_end(ctx);
+
+	// Streams two new archives, feeding the V2 document from its end, with 2
+	// worker threads: deflated by the workers, then stored
+	out4 = (char*) malloc(MiniZipAEWriteBound(strlen(s)));
+	sink.opaque = out4;
+	for (j=0; j < 2; j++)
+	{
+		r = MZAE_write_init(&st, "kazookazaa", 0, &sink);
+		if (!r)
+			r = MZAE_stream_setopt(st, MZAE_OPT_THREADS, 2);
+		if (!r && j)
+			r = MZAE_stream_setopt(st, MZAE_OPT_LEVEL, 0);
+		for (i=strlen(s); !r && i > 0; i-=7)
+			r = MZAE_write_update(st, s + (i < 7? 0 : i-7), i < 7? i : 7);
+		r = MZAE_write_final(st, &len4);
+		printf("MZAE_write_final returned %d: %s\n", r, MZAE_errmsg(r));
+		r = MiniZipAERead(out4, len4, &out2, &len2, "kazookazaa");
+		printf("MiniZipAERead returned %d: %s\n", r, MZAE_errmsg(r));
+		if (r)
+			break;
+	}
+
+	// Decrypts 32 bytes from the middle of the last (stored) archive alone
+	source.opaque = out4;
+	source.read = mem_read;
+	source.size = len4;
+	if (!r)
+		r = MZAE_range_open(&range, &source, 0, "data", "kazookazaa", MZAE_RANGE_DEFER);
+	if (!r)
+	{
+		r = MZAE_range_read(range, 50, part, 32);
+		if (!r && memcmp(part, s + 50, 32))
+			r = MZAE_ERR_AES;
+		if (!r)
+			r = MZAE_range_verify(range);
+		MZAE_range_close(range);
+		printf("MZAE_range_read returned %d: %s\n", r, MZAE_errmsg(r));
+	}
+
+	// Archives the text in three entries (the whole of it in the second one
+	// only), then extracts the second one alone
+	out5 = (char*) malloc(3 * MiniZipAEWriteBound(strlen(s)) + 512);
+	sink.opaque = out5;
+	if (!r)
+		r = MZAE_zip_create(&zip, 0, &sink);
+	for (j=0; !r && j < 3; j++)
+	{
+		r = MZAE_zip_add(zip, names[j], "kazookazaa", &st);
+		if (!r)
+		{
+			MZAE_write_update(st, s, j == 1? strlen(s) : strlen(s) / 2);
+			r = MZAE_write_final(st, 0);
+		}
+	}
+	if (!r)
+	{
+		r = MZAE_zip_close(zip, &len5);
+		printf("MZAE_zip_close returned %d: %s\n", r, MZAE_errmsg(r));
+		len2 = strlen(s);
+		memset(out2, 0, len2);
+		r = MiniZipAEReadEntry(out5, len5, names[1], &out2, &len2, "kazookazaa");
+		printf("MiniZipAEReadEntry returned %d: %s\n", r, MZAE_errmsg(r));
+	}
+	if (!r)
+	{
+		source.opaque = out5;
+		source.size = len5;
+		j = MZAE_zip_find(&source, 0, "d.txt", &entry);
+		printf("MZAE_zip_find returned %d: %s\n", j, MZAE_errmsg(j));
+		if (j != MZAE_ERR_NOENTRY)
+			r = MZAE_ERR_BADZIP;
+	}
+
+	if (r || checked || !reused || len2 != strlen(s) || memcmp(s, out2, len2) != 0 ||
+		len3 != strlen(s) || memcmp(s, out3, len3) != 0)
 		printf("SELF TEST FAILED!");
 	else
 		printf("SELF TEST PASSED!");
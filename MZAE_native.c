@@ -0,0 +1,822 @@
+/*
+ *  Copyright (C) 2016-2023  maxpat78 <https://github.com/maxpat78>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+	Cryptographic functions with no third-party dependency.
+
+	AES uses the AES-NI instructions (8 counter blocks in flight) and SHA-1
+	the SHA extensions, when the CPU reports them at run time; portable C code
+	is used otherwise, or everywhere if MZAE_PORTABLE is defined.
+*/
+
+#include <mZipAES.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(MZAE_PORTABLE) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+	#define MZAE_X86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define MZAE_TARGET(x)
+	#else
+		#include <cpuid.h>
+		#define MZAE_TARGET(x) __attribute__((target(x)))
+	#endif
+#endif
+
+#ifdef _WIN32
+	#include <windows.h>
+	#include <bcrypt.h>
+#endif
+
+#define CPU_AESNI	1
+#define CPU_SHANI	2
+
+typedef struct {
+	unsigned char rk[240];
+	int rounds;
+	unsigned long long counter;
+	unsigned char keystream[16];
+	unsigned int used;
+} MZAE_CTR_CTX;
+
+typedef struct {
+	unsigned int h[5];
+	unsigned long long len;
+	unsigned char buf[64];
+	unsigned int buflen;
+} MZAE_SHA1_CTX;
+
+typedef struct {
+	MZAE_SHA1_CTX inner;
+	MZAE_SHA1_CTX outer;
+} MZAE_HMAC_CTX;
+
+static const unsigned char sbox[256] = {
+	0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+	0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+	0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+	0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+	0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+	0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+	0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+	0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+	0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+	0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+	0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+	0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+	0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+	0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+	0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+	0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+
+
+// Detects AES-NI and SHA extensions once
+static int cpu_features(void)
+{
+	static int features = -1;
+#ifdef MZAE_X86
+	int f = 0;
+	unsigned int r[4];
+
+	if (features != -1)
+		return features;
+
+#ifdef _MSC_VER
+	__cpuid((int*) r, 0);
+#else
+	__cpuid(0, r[0], r[1], r[2], r[3]);
+#endif
+	if (r[0] < 7) {
+		features = 0;
+		return features;
+	}
+
+#ifdef _MSC_VER
+	__cpuid((int*) r, 1);
+#else
+	__cpuid(1, r[0], r[1], r[2], r[3]);
+#endif
+	// AES-NI and SSE4.1 (ECX bits 25 and 19)
+	if ((r[2] & (1 << 25)) && (r[2] & (1 << 19)))
+		f |= CPU_AESNI;
+
+#ifdef _MSC_VER
+	__cpuidex((int*) r, 7, 0);
+#else
+	__cpuid_count(7, 0, r[0], r[1], r[2], r[3]);
+#endif
+	// SHA extensions (EBX bit 29), used together with SSSE3 and SSE4.1
+	if ((r[1] & (1 << 29)) && (f & CPU_AESNI))
+		f |= CPU_SHANI;
+
+	features = f;
+#else
+	features = 0;
+#endif
+	return features;
+}
+
+
+
+#ifdef _WIN32
+static char engine_tag;	// the engine holds no state
+#endif
+
+
+
+// Detects the CPU features and, outside Windows, keeps the random device open
+int MZAE_engine_init(void** engine)
+{
+#ifndef _WIN32
+	FILE *f;
+#endif
+
+	cpu_features();
+
+#ifdef _WIN32
+	*engine = &engine_tag;
+#else
+	f = fopen("/dev/urandom", "rb");
+	if (!f)
+		return 2;
+	// unbuffered, so that no random bytes are kept (and shared with a fork)
+	setvbuf(f, 0, _IONBF, 0);
+	*engine = f;
+#endif
+
+	return 0;
+}
+
+
+
+void MZAE_engine_end(void* engine)
+{
+#ifndef _WIN32
+	if (engine)
+		fclose((FILE*) engine);
+#else
+	(void) engine;
+#endif
+}
+
+
+
+int MZAE_gen_salt(char* salt, int saltlen)
+{
+	return MZAE_gen_salt_ex(0, salt, saltlen);
+}
+
+
+
+int MZAE_gen_salt_ex(void* engine, char* salt, int saltlen)
+{
+#ifndef _WIN32
+	FILE *f = (FILE*) engine;
+#else
+	(void) engine;
+#endif
+
+	if (saltlen != 8 && saltlen != 12 && saltlen != 16)
+		return 1;
+
+#ifdef _WIN32
+	if (BCryptGenRandom(NULL, salt, saltlen, BCRYPT_USE_SYSTEM_PREFERRED_RNG))
+		return 2;
+#else
+	if (!engine)
+		f = fopen("/dev/urandom", "rb");
+	if (!f)
+		return 2;
+	if (fread(salt, 1, saltlen, f) != (size_t) saltlen)
+	{
+		if (!engine)
+			fclose(f);
+		return 2;
+	}
+	if (!engine)
+		fclose(f);
+#endif
+
+	return 0;
+}
+
+
+
+/*
+	AES (encryption only)
+*/
+#define XTIME(x) ((unsigned char) (((x) << 1) ^ (((x) >> 7) * 0x1B)))
+
+static void aes_expand_key(MZAE_CTR_CTX *c, unsigned char* key, unsigned int keylen)
+{
+	unsigned int i, nk = keylen / 4, words;
+	unsigned char t[4], u, rcon = 1;
+
+	c->rounds = nk + 6;
+	words = 4 * (c->rounds + 1);
+	memcpy(c->rk, key, keylen);
+
+	for (i = nk; i < words; i++) {
+		memcpy(t, c->rk + 4*(i-1), 4);
+		if (i % nk == 0) {
+			u = t[0];
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[u];
+			rcon = XTIME(rcon);
+		}
+		else if (nk > 6 && i % nk == 4) {
+			t[0] = sbox[t[0]];
+			t[1] = sbox[t[1]];
+			t[2] = sbox[t[2]];
+			t[3] = sbox[t[3]];
+		}
+		c->rk[4*i] = c->rk[4*(i-nk)] ^ t[0];
+		c->rk[4*i+1] = c->rk[4*(i-nk)+1] ^ t[1];
+		c->rk[4*i+2] = c->rk[4*(i-nk)+2] ^ t[2];
+		c->rk[4*i+3] = c->rk[4*(i-nk)+3] ^ t[3];
+	}
+}
+
+
+
+static void aes_encrypt_block(MZAE_CTR_CTX *c, unsigned char* in, unsigned char* out)
+{
+	unsigned char s[16], t[16], a0, a1, a2, a3, all;
+	const unsigned char *rk = c->rk;
+	int i, r;
+
+	for (i=0; i < 16; i++)
+		s[i] = in[i] ^ rk[i];
+
+	for (r=1; r <= c->rounds; r++) {
+		rk += 16;
+		// SubBytes and ShiftRows
+		for (i=0; i < 16; i++)
+			t[i] = sbox[s[(i + 4*(i%4)) % 16]];
+		if (r == c->rounds) {
+			for (i=0; i < 16; i++)
+				s[i] = t[i] ^ rk[i];
+			break;
+		}
+		// MixColumns and AddRoundKey
+		for (i=0; i < 16; i+=4) {
+			a0 = t[i]; a1 = t[i+1]; a2 = t[i+2]; a3 = t[i+3];
+			all = a0 ^ a1 ^ a2 ^ a3;
+			s[i] = a0 ^ all ^ XTIME(a0 ^ a1) ^ rk[i];
+			s[i+1] = a1 ^ all ^ XTIME(a1 ^ a2) ^ rk[i+1];
+			s[i+2] = a2 ^ all ^ XTIME(a2 ^ a3) ^ rk[i+2];
+			s[i+3] = a3 ^ all ^ XTIME(a3 ^ a0) ^ rk[i+3];
+		}
+	}
+
+	memcpy(out, s, 16);
+}
+
+
+
+// Encrypts the next little endian counter block into the keystream buffer
+static void ctr_next_block(MZAE_CTR_CTX *c)
+{
+	unsigned char ctr_counter_le[16];
+	int i;
+
+	c->counter++;
+	for (i=0; i < 8; i++)
+		ctr_counter_le[i] = (unsigned char) (c->counter >> 8*i);
+	memset(ctr_counter_le+8, 0, 8);
+
+	aes_encrypt_block(c, ctr_counter_le, c->keystream);
+	c->used = 0;
+}
+
+
+
+#ifdef MZAE_X86
+#define AESNI_ROUND(f, k) \
+	b0 = f(b0, k); b1 = f(b1, k); b2 = f(b2, k); b3 = f(b3, k); \
+	b4 = f(b4, k); b5 = f(b5, k); b6 = f(b6, k); b7 = f(b7, k);
+
+#define AESNI_XOR(i, b) \
+	_mm_storeu_si128((__m128i*) dst + i, _mm_xor_si128(b, _mm_loadu_si128((__m128i*) src + i)));
+
+// Encrypts whole blocks with AES-NI, 8 counter blocks at a time
+MZAE_TARGET("aes,sse4.1")
+static void aesni_ctr_blocks(MZAE_CTR_CTX *c, char* src, char* dst, unsigned int blocks)
+{
+	__m128i k[15], b0, b1, b2, b3, b4, b5, b6, b7;
+	unsigned long long n = c->counter;
+	int i, rounds = c->rounds;
+
+	for (i=0; i <= rounds; i++)
+		k[i] = _mm_loadu_si128((__m128i*) (c->rk + 16*i));
+
+	for (; blocks >= 8; blocks-=8, src+=128, dst+=128) {
+		// the counter takes the low 64 bits, little endian
+		b0 = _mm_xor_si128(_mm_set_epi64x(0, n+1), k[0]);
+		b1 = _mm_xor_si128(_mm_set_epi64x(0, n+2), k[0]);
+		b2 = _mm_xor_si128(_mm_set_epi64x(0, n+3), k[0]);
+		b3 = _mm_xor_si128(_mm_set_epi64x(0, n+4), k[0]);
+		b4 = _mm_xor_si128(_mm_set_epi64x(0, n+5), k[0]);
+		b5 = _mm_xor_si128(_mm_set_epi64x(0, n+6), k[0]);
+		b6 = _mm_xor_si128(_mm_set_epi64x(0, n+7), k[0]);
+		b7 = _mm_xor_si128(_mm_set_epi64x(0, n+8), k[0]);
+		n += 8;
+		for (i=1; i < rounds; i++) {
+			AESNI_ROUND(_mm_aesenc_si128, k[i])
+		}
+		AESNI_ROUND(_mm_aesenclast_si128, k[rounds])
+		AESNI_XOR(0, b0) AESNI_XOR(1, b1) AESNI_XOR(2, b2) AESNI_XOR(3, b3)
+		AESNI_XOR(4, b4) AESNI_XOR(5, b5) AESNI_XOR(6, b6) AESNI_XOR(7, b7)
+	}
+
+	for (; blocks; blocks--, src+=16, dst+=16) {
+		b0 = _mm_xor_si128(_mm_set_epi64x(0, ++n), k[0]);
+		for (i=1; i < rounds; i++)
+			b0 = _mm_aesenc_si128(b0, k[i]);
+		b0 = _mm_aesenclast_si128(b0, k[rounds]);
+		AESNI_XOR(0, b0)
+	}
+
+	c->counter = n;
+}
+#endif
+
+
+
+int MZAE_ctr_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_ctr_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_ctr_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	MZAE_CTR_CTX *c;
+
+	(void) engine;
+	if (keylen != 16 && keylen != 24 && keylen != 32)
+		return -1;
+
+	c = (MZAE_CTR_CTX*) malloc(sizeof(MZAE_CTR_CTX));
+	if (!c)
+		return 2;
+
+	aes_expand_key(c, key, keylen);
+	c->counter = 0;
+	c->used = 16;
+	*ctx = c;
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_update(void* ctx, char* src, unsigned int srclen, char* dst)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+	unsigned int i;
+
+	// Consumes the keystream left over by a previous call
+	while (srclen && c->used < 16) {
+		*dst++ = *src++ ^ c->keystream[c->used++];
+		srclen--;
+	}
+
+#ifdef MZAE_X86
+	if (srclen >= 16 && (cpu_features() & CPU_AESNI)) {
+		aesni_ctr_blocks(c, src, dst, srclen / 16);
+		src += srclen & ~15;
+		dst += srclen & ~15;
+		srclen &= 15;
+	}
+#endif
+
+	for (; srclen >= 16; srclen-=16) {
+		ctr_next_block(c);
+		for (i=0; i < 16; i++)
+			*dst++ = *src++ ^ c->keystream[i];
+		c->used = 16;
+	}
+
+	if (srclen) {
+		ctr_next_block(c);
+		while (srclen--)
+			*dst++ = *src++ ^ c->keystream[c->used++];
+	}
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_seek(void* ctx, unsigned long long offset)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+
+	// The block at offset is encrypted with counter offset/16 + 1
+	c->counter = offset / 16;
+	c->used = 16;
+
+	if (offset % 16)
+	{
+		ctr_next_block(c);
+		c->used = (unsigned int) (offset % 16);
+	}
+
+	return 0;
+}
+
+
+
+void MZAE_ctr_end(void* ctx)
+{
+	if (!ctx)
+		return;
+	memset(ctx, 0, sizeof(MZAE_CTR_CTX));
+	free(ctx);
+}
+
+
+
+int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+{
+	void *ctx;
+
+	if (!keylen || !srclen)
+		return -1;
+
+	*dst = (char*) malloc(srclen);
+	if (! *dst)
+		return 2;
+
+	if (MZAE_ctr_init(key, keylen, &ctx))
+	{
+		free(*dst);
+		return 1;
+	}
+
+	MZAE_ctr_update(ctx, src, srclen, *dst);
+	MZAE_ctr_end(ctx);
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_crypt_inplace(char* key, unsigned int keylen, char* buf, unsigned int len)
+{
+	MZAE_CTR_CTX c;
+
+	if (!len || (keylen != 16 && keylen != 24 && keylen != 32))
+		return -1;
+
+	aes_expand_key(&c, key, keylen);
+	c.counter = 0;
+	c.used = 16;
+
+	MZAE_ctr_update(&c, buf, len, buf);
+	memset(&c, 0, sizeof(c));
+
+	return 0;
+}
+
+
+
+/*
+	SHA-1
+*/
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32-(n))))
+
+static void sha1_blocks_c(unsigned int* h, const unsigned char* data, unsigned int blocks)
+{
+	unsigned int w[80], a, b, c, d, e, t;
+	int i;
+
+	for (; blocks; blocks--, data+=64) {
+		for (i=0; i < 16; i++)
+			w[i] = (unsigned int) data[4*i] << 24 | data[4*i+1] << 16 | data[4*i+2] << 8 | data[4*i+3];
+		for (; i < 80; i++)
+			w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+		for (i=0; i < 80; i++) {
+			if (i < 20)
+				t = ((b & c) | (~b & d)) + 0x5A827999;
+			else if (i < 40)
+				t = (b ^ c ^ d) + 0x6ED9EBA1;
+			else if (i < 60)
+				t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+			else
+				t = (b ^ c ^ d) + 0xCA62C1D6;
+			t += ROL(a, 5) + e + w[i];
+			e = d; d = c; c = ROL(b, 30); b = a; a = t;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+}
+
+
+
+#ifdef MZAE_X86
+/*
+  Four rounds with the SHA extensions: g is the group number (0-19), M[] the
+  rotating message schedule and E[] the alternating E values.
+*/
+#define SHANI_GROUP(g) \
+	if (g < 4) \
+		M[g%4] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16*(g%4))), mask); \
+	if (g == 0) \
+		E[0] = _mm_add_epi32(E[0], M[0]); \
+	else \
+		E[g%2] = _mm_sha1nexte_epu32(E[g%2], M[g%4]); \
+	E[(g+1)%2] = abcd; \
+	if (g >= 3 && g <= 18) \
+		M[(g+1)%4] = _mm_sha1msg2_epu32(M[(g+1)%4], M[g%4]); \
+	abcd = _mm_sha1rnds4_epu32(abcd, E[g%2], g/5); \
+	if (g >= 1 && g <= 16) \
+		M[(g+3)%4] = _mm_sha1msg1_epu32(M[(g+3)%4], M[g%4]); \
+	if (g >= 2 && g <= 17) \
+		M[(g+2)%4] = _mm_xor_si128(M[(g+2)%4], M[g%4]);
+
+MZAE_TARGET("sha,ssse3,sse4.1")
+static void sha1_blocks_shani(unsigned int* h, const unsigned char* data, unsigned int blocks)
+{
+	__m128i abcd, abcd_save, e_save, E[2], M[4];
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) h), 0x1B);
+	E[0] = _mm_set_epi32(h[4], 0, 0, 0);
+
+	for (; blocks; blocks--, data+=64) {
+		abcd_save = abcd;
+		e_save = E[0];
+
+		SHANI_GROUP(0) SHANI_GROUP(1) SHANI_GROUP(2) SHANI_GROUP(3)
+		SHANI_GROUP(4) SHANI_GROUP(5) SHANI_GROUP(6) SHANI_GROUP(7)
+		SHANI_GROUP(8) SHANI_GROUP(9) SHANI_GROUP(10) SHANI_GROUP(11)
+		SHANI_GROUP(12) SHANI_GROUP(13) SHANI_GROUP(14) SHANI_GROUP(15)
+		SHANI_GROUP(16) SHANI_GROUP(17) SHANI_GROUP(18) SHANI_GROUP(19)
+
+		E[0] = _mm_sha1nexte_epu32(E[0], e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i*) h, _mm_shuffle_epi32(abcd, 0x1B));
+	h[4] = _mm_extract_epi32(E[0], 3);
+}
+#endif
+
+
+
+static void sha1_blocks(unsigned int* h, const unsigned char* data, unsigned int blocks)
+{
+#ifdef MZAE_X86
+	if (cpu_features() & CPU_SHANI) {
+		sha1_blocks_shani(h, data, blocks);
+		return;
+	}
+#endif
+	sha1_blocks_c(h, data, blocks);
+}
+
+
+
+static void sha1_init(MZAE_SHA1_CTX* s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xEFCDAB89;
+	s->h[2] = 0x98BADCFE;
+	s->h[3] = 0x10325476;
+	s->h[4] = 0xC3D2E1F0;
+	s->len = 0;
+	s->buflen = 0;
+}
+
+
+
+static void sha1_update(MZAE_SHA1_CTX* s, const unsigned char* src, unsigned int srclen)
+{
+	unsigned int n;
+
+	s->len += srclen;
+
+	if (s->buflen) {
+		n = 64 - s->buflen;
+		if (n > srclen)
+			n = srclen;
+		memcpy(s->buf + s->buflen, src, n);
+		s->buflen += n;
+		src += n;
+		srclen -= n;
+		if (s->buflen < 64)
+			return;
+		sha1_blocks(s->h, s->buf, 1);
+		s->buflen = 0;
+	}
+
+	if (srclen >= 64) {
+		sha1_blocks(s->h, src, srclen / 64);
+		src += srclen & ~63;
+		srclen &= 63;
+	}
+
+	memcpy(s->buf, src, srclen);
+	s->buflen = srclen;
+}
+
+
+
+static void sha1_final(MZAE_SHA1_CTX* s, unsigned char* digest)
+{
+	unsigned long long bits = s->len * 8;
+	int i;
+
+	s->buf[s->buflen++] = 0x80;
+	if (s->buflen > 56) {
+		memset(s->buf + s->buflen, 0, 64 - s->buflen);
+		sha1_blocks(s->h, s->buf, 1);
+		s->buflen = 0;
+	}
+	memset(s->buf + s->buflen, 0, 56 - s->buflen);
+	for (i=0; i < 8; i++)
+		s->buf[56+i] = (unsigned char) (bits >> (56 - 8*i));
+	sha1_blocks(s->h, s->buf, 1);
+
+	for (i=0; i < 20; i++)
+		digest[i] = (unsigned char) (s->h[i/4] >> (24 - 8*(i%4)));
+}
+
+
+
+/*
+	HMAC-SHA1
+*/
+static void hmac_setup(MZAE_HMAC_CTX* h, const unsigned char* key, unsigned int keylen)
+{
+	unsigned char pad[64], digest[20];
+	unsigned int i;
+
+	if (keylen > 64) {
+		sha1_init(&h->inner);
+		sha1_update(&h->inner, key, keylen);
+		sha1_final(&h->inner, digest);
+		key = digest;
+		keylen = 20;
+	}
+
+	memset(pad, 0x36, 64);
+	for (i=0; i < keylen; i++)
+		pad[i] ^= key[i];
+	sha1_init(&h->inner);
+	sha1_update(&h->inner, pad, 64);
+
+	memset(pad, 0x5C, 64);
+	for (i=0; i < keylen; i++)
+		pad[i] ^= key[i];
+	sha1_init(&h->outer);
+	sha1_update(&h->outer, pad, 64);
+
+	memset(pad, 0, 64);
+}
+
+
+
+static void hmac_finish(MZAE_HMAC_CTX* h, unsigned char* mac)
+{
+	unsigned char digest[20];
+
+	sha1_final(&h->inner, digest);
+	sha1_update(&h->outer, digest, 20);
+	sha1_final(&h->outer, mac);
+}
+
+
+
+int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, char** hmac_key, char** vv)
+{
+	int keylen = 0;
+	char *kdfbuf;
+
+	if (saltlen == 8)
+		keylen = 16;
+	else if (saltlen == 12)
+		keylen = 24;
+	else if (saltlen == 16)
+		keylen = 32;
+	else
+		return 1;
+
+	kdfbuf = (char*) malloc(2*keylen+2);
+	if (! kdfbuf)
+		return 2;
+
+	// The shared PBKDF2 runs the output blocks in SIMD lanes
+	if (MZAE_pbkdf2_sha1(password, strlen(password), salt, saltlen, 1000, kdfbuf, 2*keylen+2))
+	{
+		free(kdfbuf);
+		return 3;
+	}
+
+	*aes_key = kdfbuf;
+	*hmac_key = kdfbuf+keylen;
+	*vv = kdfbuf+2*keylen;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_hmac_sha1_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_hmac_sha1_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	MZAE_HMAC_CTX *h;
+
+	(void) engine;
+	if (!keylen)
+		return -1;
+
+	h = (MZAE_HMAC_CTX*) malloc(sizeof(MZAE_HMAC_CTX));
+	if (!h)
+		return 2;
+
+	hmac_setup(h, key, keylen);
+	*ctx = h;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_update(void* ctx, char* src, unsigned int srclen)
+{
+	sha1_update(&((MZAE_HMAC_CTX*) ctx)->inner, src, srclen);
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_final(void* ctx, char* hmac)
+{
+	hmac_finish((MZAE_HMAC_CTX*) ctx, hmac);
+	memset(ctx, 0, sizeof(MZAE_HMAC_CTX));
+	free(ctx);
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
+{
+	void *ctx;
+
+	if (!keylen || !srclen)
+		return -1;
+
+	*hmac = (char*) malloc(20);
+	if (! *hmac)
+		return 2;
+
+	if (MZAE_hmac_sha1_init(key, keylen, &ctx))
+	{
+		free(*hmac);
+		return 1;
+	}
+
+	MZAE_hmac_sha1_update(ctx, src, srclen);
+
+	return MZAE_hmac_sha1_final(ctx, *hmac);
+}
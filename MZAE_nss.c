@@ -25,27 +25,110 @@
 #include <nss3/seccomon.h>
 #include <nss3/pk11pub.h>
 
-#ifdef BYTE_ORDER_1234
-void betole64(unsigned long long *x) {
-*x = (*x & 0x00000000FFFFFFFF) << 32 | (*x & 0xFFFFFFFF00000000) >> 32;
-*x = (*x & 0x0000FFFF0000FFFF) << 16 | (*x & 0xFFFF0000FFFF0000) >> 16;
-*x = (*x & 0x00FF00FF00FF00FF) << 8  | (*x & 0xFF00FF00FF00FF00) >> 8;
-}
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MZAE_SSE2
+	#include <emmintrin.h>
 #endif
 
+#define MZAE_CTR_BATCH		256	// counter blocks encrypted by each library call
+
+typedef struct {
+	PK11SlotInfo* slot;
+	PK11SymKey* sk;
+	PK11Context* ctxt;
+	unsigned long long counter;
+	unsigned int used;
+	unsigned int avail;
+	unsigned char counters[16*MZAE_CTR_BATCH];
+	unsigned char keystream[16*MZAE_CTR_BATCH];
+} MZAE_CTR_CTX;
+
+typedef struct {
+	PK11SlotInfo* slot;
+	PK11SymKey* sk;
+	PK11Context* ctxt;
+} MZAE_HMAC_CTX;
 
+typedef struct {
+	PK11SlotInfo* aes;
+	PK11SlotInfo* hmac;
+} MZAE_ENGINE;
 
-int MZAE_gen_salt(char* salt, int saltlen)
+
+
+static int nss_setup(void)
 {
-	if (saltlen != 8 && saltlen != 12 && saltlen != 16)
-		return 1;
-	
 	if (! NSS_IsInitialized()) {
 		NSS_NoDB_Init(".");
 		if (! NSS_IsInitialized())
-			return -1;
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+void MZAE_engine_end(void* engine)
+{
+	MZAE_ENGINE *e = (MZAE_ENGINE*) engine;
+
+	if (!e)
+		return;
+	if (e->aes)
+		PK11_FreeSlot(e->aes);
+	if (e->hmac)
+		PK11_FreeSlot(e->hmac);
+	free(e);
+}
+
+
+
+// Initializes NSS and looks up the best slots once
+int MZAE_engine_init(void** engine)
+{
+	MZAE_ENGINE *e;
+
+	if (nss_setup())
+		return 1;
+
+	e = (MZAE_ENGINE*) calloc(1, sizeof(MZAE_ENGINE));
+	if (!e)
+		return 2;
+
+	e->aes = PK11_GetBestSlot(CKM_AES_ECB, 0);
+	e->hmac = PK11_GetBestSlot(CKM_SHA_1_HMAC, 0);
+	if (!e->aes || !e->hmac)
+	{
+		MZAE_engine_end(e);
+		return 1;
 	}
 
+	*engine = e;
+
+	return 0;
+}
+
+
+
+int MZAE_gen_salt(char* salt, int saltlen)
+{
+	return MZAE_gen_salt_ex(0, salt, saltlen);
+}
+
+
+
+int MZAE_gen_salt_ex(void* engine, char* salt, int saltlen)
+{
+	if (saltlen != 8 && saltlen != 12 && saltlen != 16)
+		return 1;
+	
+	if (!engine && nss_setup())
+		return -1;
+
 	PK11_GenerateRandom(salt, saltlen);
 
 	return 0;
@@ -58,11 +141,6 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 	int keylen = 0;
 	char *kdfbuf;
 
-	SECItem si, pi, *pkd;
-	SECAlgorithmID *algid;
-	PK11SlotInfo *slot;
-	PK11SymKey *sk = NULL;
-
 	if (saltlen == 8)
 		keylen = 16;
 	else if (saltlen == 12)
@@ -75,175 +153,367 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 	kdfbuf = (char*) malloc(2*keylen+2);
 	if (! kdfbuf)
 		return 2;
-
-	if (! NSS_IsInitialized()) {
-		NSS_NoDB_Init(".");
-		if (! NSS_IsInitialized())
-			return -1;
+	
+	if (MZAE_pbkdf2_sha1(password, strlen(password), salt, saltlen, 1000, kdfbuf, 2*keylen+2))
+	{
+		free(kdfbuf);
+		return 3;
 	}
-
-	si.type = 0; // siBuffer
-	si.data = salt;
-	si.len = saltlen;
 	
-	algid = PK11_CreatePBEV2AlgorithmID(SEC_OID_PKCS5_PBKDF2, SEC_OID_PKCS5_PBKDF2, SEC_OID_HMAC_SHA1, 2*keylen+2, 1000, &si);
+	*aes_key = kdfbuf;
+	*hmac_key = kdfbuf+keylen;
+	*vv = kdfbuf+2*keylen;
 
-	slot = PK11_GetBestSlot(CKM_PKCS5_PBKD2, 0);
-	
-	if (!algid || !slot)
-		return 3;
+	return 0;
+}
 
-	pi.type = 0; // siBuffer
-	pi.data = password;
-	pi.len = strlen(password);
 
-	sk = PK11_PBEKeyGen(slot, algid, &pi, 0, 0);
-	PK11_ExtractKeyValue(sk);
-	pkd = PK11_GetKeyData(sk);
 
-	if (! pkd)
-		return 4;
+static void ctr_cleanup(MZAE_CTR_CTX *c);
 
-	memcpy(kdfbuf, pkd->data, 2*keylen+2);
-	*aes_key = kdfbuf;
-	*hmac_key = kdfbuf+keylen;
-	*vv = kdfbuf+2*keylen;
+static int ctr_setup(MZAE_CTR_CTX *c, MZAE_ENGINE* e, char* key, unsigned int keylen)
+{
+	SECItem ki;
+	SECItem* sp = NULL;
 
-	PK11_FreeSymKey(sk);
-	PK11_FreeSlot(slot);
+	if (!e && nss_setup())
+		return 1;
+
+	c->slot = e? PK11_ReferenceSlot(e->aes) : PK11_GetBestSlot(CKM_AES_ECB, 0);
+	c->sk = NULL;
+	c->ctxt = NULL;
+
+	ki.type = 0; // siBuffer
+	ki.data = key;
+	ki.len = keylen;
+
+	if (c->slot)
+		c->sk = PK11_ImportSymKey(c->slot, CKM_AES_ECB, PK11_OriginUnwrap, CKA_ENCRYPT, &ki, 0);
+	if (c->sk) {
+		sp = PK11_ParamFromIV(CKM_AES_ECB, 0);
+		c->ctxt = PK11_CreateContextBySymKey(CKM_AES_ECB, CKA_ENCRYPT, c->sk, sp);
+		if (sp)
+			SECITEM_FreeItem(sp, 1);
+	}
+
+	if (! c->ctxt) {
+		ctr_cleanup(c);
+		return 1;
+	}
+
+	c->counter = 0;
+	c->used = c->avail = 0;
+	memset(c->counters, 0, sizeof(c->counters));
 
 	return 0;
 }
 
 
 
-int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+static void ctr_cleanup(MZAE_CTR_CTX *c)
 {
-	SECItem ki;
-	PK11SlotInfo* slot;
-	PK11SymKey* sk = NULL;
-	SECItem* sp = NULL;
-	PK11Context* ctxt = NULL;
+	if (c->ctxt)
+		PK11_DestroyContext(c->ctxt, 1);
+	if (c->sk)
+		PK11_FreeSymKey(c->sk);
+	if (c->slot)
+		PK11_FreeSlot(c->slot);
+	memset(c, 0, sizeof(MZAE_CTR_CTX));
+}
+
+
+
+// Encrypts a batch of little endian counter blocks into the keystream buffer
+static int ctr_refill(MZAE_CTR_CTX *c, unsigned int len)
+{
+	unsigned char *p = c->counters;
+	unsigned int i, blocks = (len + 15) / 16;
 	int olen;
 
-	char ctr_counter_le[16];
-	char ctr_encrypted_counter[16];
+	if (blocks > MZAE_CTR_BATCH)
+		blocks = MZAE_CTR_BATCH;
+
+	for (i=0; i < blocks; i++, p+=16) {
+		c->counter++;
 #ifdef BYTE_ORDER_1234
-	char ctr_counter_be[16];
+		p[0] = (unsigned char) c->counter;
+		p[1] = (unsigned char) (c->counter >> 8);
+		p[2] = (unsigned char) (c->counter >> 16);
+		p[3] = (unsigned char) (c->counter >> 24);
+		p[4] = (unsigned char) (c->counter >> 32);
+		p[5] = (unsigned char) (c->counter >> 40);
+		p[6] = (unsigned char) (c->counter >> 48);
+		p[7] = (unsigned char) (c->counter >> 56);
+#else
+		memcpy(p, &c->counter, 8);
 #endif
-	const char* p = ctr_encrypted_counter;
-	const char* q = p+8;
-	char *pbuf;
-	unsigned int i;
+	}
 
-	if (!keylen || !srclen)
-		return -1;
+	if (PK11_CipherOp(c->ctxt, c->keystream, &olen, blocks*16, c->counters, blocks*16) != SECSuccess)
+		return 1;
 
-	if (! NSS_IsInitialized()) {
-		NSS_NoDB_Init(".");
-		if (! NSS_IsInitialized())
-			return -1;
-	}
+	c->used = 0;
+	c->avail = blocks*16;
 
-	slot = PK11_GetBestSlot(CKM_AES_ECB, 0);
+	return 0;
+}
 
-	ki.type = 0; // siBuffer
-	ki.data = key;
-	ki.len = keylen;
 
-	sk = PK11_ImportSymKey(slot, CKM_AES_ECB, PK11_OriginUnwrap, CKA_ENCRYPT, &ki, 0);
-	sp = PK11_ParamFromIV(CKM_AES_ECB, 0);
-	ctxt = PK11_CreateContextBySymKey(CKM_AES_ECB, CKA_ENCRYPT, sk, sp);
 
-	if (! ctxt)
-		return 1;
-#ifdef BYTE_ORDER_1234
-	memset(ctr_counter_be, 0, 16);
+// XORs data with the keystream, 16 or 8 bytes at a time
+static void ctr_xor(char* dst, char* src, unsigned char* ks, unsigned int len)
+{
+#ifdef MZAE_SSE2
+	for (; len >= 16; len-=16, dst+=16, src+=16, ks+=16)
+		_mm_storeu_si128((__m128i*) dst, _mm_xor_si128(_mm_loadu_si128((__m128i*) src), _mm_loadu_si128((__m128i*) ks)));
 #else
-	memset(ctr_counter_le, 0, 16);
+	unsigned long long a, b;
+
+	for (; len >= 8; len-=8, dst+=8, src+=8, ks+=8) {
+		memcpy(&a, src, 8);
+		memcpy(&b, ks, 8);
+		a ^= b;
+		memcpy(dst, &a, 8);
+	}
 #endif
-	
-	*dst = pbuf = (char*) malloc(srclen);
-	if (!pbuf)
+	while (len--)
+		*dst++ = *src++ ^ *ks++;
+}
+
+
+
+int MZAE_ctr_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_ctr_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_ctr_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	MZAE_CTR_CTX *c;
+
+	if (!keylen)
+		return -1;
+
+	c = (MZAE_CTR_CTX*) malloc(sizeof(MZAE_CTR_CTX));
+	if (!c)
 		return 2;
 
-	for (i=0; i < srclen/16; i++) {
-#ifndef BYTE_ORDER_1234
-		(*((unsigned long long*) ctr_counter_le))++;
-#else	
-		(*((unsigned long long*) ctr_counter_be))++;
-		*((unsigned long long*) ctr_counter_le) = *((unsigned long long*) ctr_counter_be);
-		betole64((unsigned long long*)ctr_counter_le);
-#endif
-		PK11_CipherOp(ctxt, ctr_encrypted_counter, &olen, 16, ctr_counter_le, 16);
-		*((unsigned long long*) pbuf) = *((unsigned long long*) src) ^ *((unsigned long long*) p);
-		pbuf+=sizeof(long long);
-		src+=sizeof(long long);
-		*((unsigned long long*) pbuf) = *((unsigned long long*) src) ^ *((unsigned long long*) q);
-		pbuf+=sizeof(long long);
-		src+=sizeof(long long);
+	if (ctr_setup(c, (MZAE_ENGINE*) engine, key, keylen))
+	{
+		free(c);
+		return 1;
 	}
 
-	if ((i = srclen%16)) {
-#ifndef BYTE_ORDER_1234
-		(*((unsigned long long*) ctr_counter_le))++;
-#else	
-		(*((unsigned long long*) ctr_counter_be))++;
-		*((unsigned long long*) ctr_counter_le) = *((unsigned long long*) ctr_counter_be);
-		betole64((unsigned long long*)ctr_counter_le);
-#endif
-		PK11_CipherOp(ctxt, ctr_encrypted_counter, &olen, 16, ctr_counter_le, 16);
-		while (i--)
-			*pbuf++ = *src++ ^ *p++;
+	*ctx = c;
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_update(void* ctx, char* src, unsigned int srclen, char* dst)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+	unsigned int n;
+
+	while (srclen) {
+		if (c->used == c->avail && ctr_refill(c, srclen))
+			return 1;
+
+		n = c->avail - c->used;
+		if (n > srclen)
+			n = srclen;
+
+		ctr_xor(dst, src, c->keystream + c->used, n);
+		c->used += n;
+		src += n;
+		dst += n;
+		srclen -= n;
 	}
 
-	PK11_DestroyContext(ctxt, 1);
-	PK11_FreeSymKey(sk);
-	PK11_FreeSlot(slot);
+	return 0;
+}
+
+
+
+int MZAE_ctr_seek(void* ctx, unsigned long long offset)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+
+	// The block at offset is encrypted with counter offset/16 + 1
+	c->counter = offset / 16;
+	c->used = c->avail = 0;
+
+	if (offset % 16)
+	{
+		if (ctr_refill(c, 16))
+			return 1;
+		c->used = (unsigned int) (offset % 16);
+	}
 
 	return 0;
 }
 
 
 
-int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
+void MZAE_ctr_end(void* ctx)
 {
-	SECItem ki, np;
-	PK11SlotInfo* slot;
-	PK11SymKey* sk = NULL;
-	PK11Context* ctxt = NULL;
-	int olen;
+	if (!ctx)
+		return;
+	ctr_cleanup((MZAE_CTR_CTX*) ctx);
+	free(ctx);
+}
+
+
+
+int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+{
+	void *ctx;
 
 	if (!keylen || !srclen)
 		return -1;
 
-	if (! NSS_IsInitialized()) {
-		NSS_NoDB_Init(".");
-		if (! NSS_IsInitialized())
-			return -1;
+	*dst = (char*) malloc(srclen);
+	if (! *dst)
+		return 2;
+
+	if (MZAE_ctr_init(key, keylen, &ctx))
+	{
+		free(*dst);
+		return 1;
 	}
 
+	MZAE_ctr_update(ctx, src, srclen, *dst);
+	MZAE_ctr_end(ctx);
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_crypt_inplace(char* key, unsigned int keylen, char* buf, unsigned int len)
+{
+	MZAE_CTR_CTX c;
+	int r;
+
+	if (!keylen || !len)
+		return -1;
+
+	if (ctr_setup(&c, 0, key, keylen))
+		return 1;
+
+	r = MZAE_ctr_update(&c, buf, len, buf);
+	ctr_cleanup(&c);
+
+	return r;
+}
+
+
+
+static void hmac_free(MZAE_HMAC_CTX *h)
+{
+	if (h->ctxt)
+		PK11_DestroyContext(h->ctxt, 1);
+	if (h->sk)
+		PK11_FreeSymKey(h->sk);
+	if (h->slot)
+		PK11_FreeSlot(h->slot);
+	free(h);
+}
+
+
+
+int MZAE_hmac_sha1_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_hmac_sha1_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_hmac_sha1_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	SECItem ki, np;
+	MZAE_HMAC_CTX *h;
+
+	if (!keylen)
+		return -1;
+
+	if (!engine && nss_setup())
+		return -1;
+
+	h = (MZAE_HMAC_CTX*) calloc(1, sizeof(MZAE_HMAC_CTX));
+	if (!h)
+		return 2;
+
 	ki.type = 0; // siBuffer
 	ki.data = key;
 	ki.len = keylen;
 
-	slot = PK11_GetBestSlot(CKM_SHA_1_HMAC, 0);
-	sk = PK11_ImportSymKey(slot, CKM_SHA_1_HMAC, PK11_OriginUnwrap, CKA_SIGN, &ki, 0);
+	h->slot = engine? PK11_ReferenceSlot(((MZAE_ENGINE*) engine)->hmac) : PK11_GetBestSlot(CKM_SHA_1_HMAC, 0);
+	if (h->slot)
+		h->sk = PK11_ImportSymKey(h->slot, CKM_SHA_1_HMAC, PK11_OriginUnwrap, CKA_SIGN, &ki, 0);
 
 	memset(&np, 0, sizeof(np));
-	ctxt = PK11_CreateContextBySymKey(CKM_SHA_1_HMAC, CKA_SIGN, sk, &np);
-	if (! ctxt)
+	if (h->sk)
+		h->ctxt = PK11_CreateContextBySymKey(CKM_SHA_1_HMAC, CKA_SIGN, h->sk, &np);
+
+	if (! h->ctxt || PK11_DigestBegin(h->ctxt) != SECSuccess) {
+		hmac_free(h);
 		return 1;
-	PK11_DigestBegin(ctxt);
-	PK11_DigestOp(ctxt, src, srclen);
+	}
+
+	*ctx = h;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_update(void* ctx, char* src, unsigned int srclen)
+{
+	if (srclen && PK11_DigestOp(((MZAE_HMAC_CTX*) ctx)->ctxt, src, srclen) != SECSuccess)
+		return 1;
+
+	return 0;
+}
+
+
+
+int MZAE_hmac_sha1_final(void* ctx, char* hmac)
+{
+	unsigned int olen;
+	int r = 0;
+
+	if (PK11_DigestFinal(((MZAE_HMAC_CTX*) ctx)->ctxt, hmac, &olen, 20) != SECSuccess)
+		r = 1;
+
+	hmac_free((MZAE_HMAC_CTX*) ctx);
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
+{
+	void *ctx;
+
+	if (!keylen || !srclen)
+		return -1;
+
 	*hmac = (char*) malloc(20);
 	if (! *hmac)
 		return 2;
-	PK11_DigestFinal(ctxt, *hmac, &olen, 20);
 
-	PK11_DestroyContext(ctxt, 1);
-	PK11_FreeSymKey(sk);
-	PK11_FreeSlot(slot);
+	if (MZAE_hmac_sha1_init(key, keylen, &ctx))
+	{
+		free(*hmac);
+		return 1;
+	}
 
-	return 0;
+	MZAE_hmac_sha1_update(ctx, src, srclen);
+
+	return MZAE_hmac_sha1_final(ctx, *hmac);
 }
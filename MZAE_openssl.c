@@ -22,23 +22,128 @@
 
 #include <mZipAES.h>
 
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
 
-#ifdef BYTE_ORDER_1234
-void betole64(uint64_t *x) {
-*x = (*x & 0x00000000FFFFFFFF) << 32 | (*x & 0xFFFFFFFF00000000) >> 32;
-*x = (*x & 0x0000FFFF0000FFFF) << 16 | (*x & 0xFFFF0000FFFF0000) >> 16;
-*x = (*x & 0x00FF00FF00FF00FF) << 8  | (*x & 0xFF00FF00FF00FF00) >> 8;
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MZAE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#define MZAE_CTR_BATCH		256	// counter blocks encrypted by each library call
+
+// OpenSSL 3 looks up the implementation of a cipher or digest on each
+// initialization, unless it was fetched in advance; it deprecates HMAC_CTX
+// in favour of EVP_MAC
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+	#define MZAE_FETCH
+	#include <openssl/core_names.h>
+	#include <openssl/params.h>
+#endif
+
+typedef struct {
+	EVP_CIPHER_CTX* cipher;
+	unsigned long long counter;
+	unsigned int used;
+	unsigned int avail;
+	unsigned char counters[16*MZAE_CTR_BATCH];
+	unsigned char keystream[16*MZAE_CTR_BATCH];
+} MZAE_CTR_CTX;
+
+typedef struct {
+	const EVP_CIPHER* aes[3];	// AES-128, 192 and 256 in ECB mode
+#ifdef MZAE_FETCH
+	EVP_MAC* hmac;
+	EVP_MAC_CTX* hmac_sha1;		// HMAC-SHA1 without a key, duplicated for each stream
+#else
+	const EVP_MD* sha1;
+#endif
+} MZAE_ENGINE;
+
+
+
+void MZAE_engine_end(void* engine)
+{
+	MZAE_ENGINE *e = (MZAE_ENGINE*) engine;
+#ifdef MZAE_FETCH
+	int i;
+#endif
+
+	if (!e)
+		return;
+#ifdef MZAE_FETCH
+	for (i=0; i < 3; i++)
+		EVP_CIPHER_free((EVP_CIPHER*) e->aes[i]);
+	EVP_MAC_CTX_free(e->hmac_sha1);
+	EVP_MAC_free(e->hmac);
+#endif
+	free(e);
 }
+
+
+
+int MZAE_engine_init(void** engine)
+{
+	MZAE_ENGINE *e;
+#ifdef MZAE_FETCH
+	OSSL_PARAM params[2];
+#endif
+
+	e = (MZAE_ENGINE*) calloc(1, sizeof(MZAE_ENGINE));
+	if (!e)
+		return 2;
+
+	// The generator is seeded once, not for each salt
+	RAND_poll();
+
+#ifdef MZAE_FETCH
+	e->aes[0] = EVP_CIPHER_fetch(0, "AES-128-ECB", 0);
+	e->aes[1] = EVP_CIPHER_fetch(0, "AES-192-ECB", 0);
+	e->aes[2] = EVP_CIPHER_fetch(0, "AES-256-ECB", 0);
+	e->hmac = EVP_MAC_fetch(0, "HMAC", 0);
+	e->hmac_sha1 = e->hmac? EVP_MAC_CTX_new(e->hmac) : 0;
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA1", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if (e->hmac_sha1 && !EVP_MAC_CTX_set_params(e->hmac_sha1, params))
+	{
+		EVP_MAC_CTX_free(e->hmac_sha1);
+		e->hmac_sha1 = 0;
+	}
+	if (!e->aes[0] || !e->aes[1] || !e->aes[2] || !e->hmac_sha1)
+#else
+	e->aes[0] = EVP_aes_128_ecb();
+	e->aes[1] = EVP_aes_192_ecb();
+	e->aes[2] = EVP_aes_256_ecb();
+	e->sha1 = EVP_sha1();
+	if (!e->aes[0] || !e->aes[1] || !e->aes[2] || !e->sha1)
 #endif
+	{
+		MZAE_engine_end(e);
+		return 1;
+	}
+
+	*engine = e;
+
+	return 0;
+}
 
 
 
 int MZAE_gen_salt(char* salt, int saltlen)
 {
-	RAND_poll();
+	return MZAE_gen_salt_ex(0, salt, saltlen);
+}
+
+
+
+int MZAE_gen_salt_ex(void* engine, char* salt, int saltlen)
+{
+	if (!engine)
+		RAND_poll();
 
 	if (saltlen != 8 && saltlen != 12 && saltlen != 16)
 		return 1;
@@ -69,8 +174,11 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 	if (! kdfbuf)
 		return 2;
 	
-	if (!PKCS5_PBKDF2_HMAC_SHA1(password, strlen(password), salt, saltlen, 1000, 2*keylen+2, kdfbuf))
+	if (MZAE_pbkdf2_sha1(password, strlen(password), salt, saltlen, 1000, kdfbuf, 2*keylen+2))
+	{
+		free(kdfbuf);
 		return 3;
+	}
 	
 	*aes_key = kdfbuf;
 	*hmac_key = kdfbuf+keylen;
@@ -81,76 +189,362 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 
 
 
-int MZAE_ctr_crypt(char* key, uint32_t keylen, char* src, uint32_t srclen, char** dst)
+static int ctr_setup(MZAE_CTR_CTX *c, MZAE_ENGINE* e, char* key, unsigned int keylen)
+{
+	const EVP_CIPHER *algo;
+
+	if (keylen != 16 && keylen != 24 && keylen != 32)
+		return 1;
+
+	if (e)
+		algo = e->aes[keylen/8 - 2];
+	else if (keylen == 16)
+		algo = EVP_aes_128_ecb();
+	else if (keylen == 24)
+		algo = EVP_aes_192_ecb();
+	else
+		algo = EVP_aes_256_ecb();
+
+	c->cipher = EVP_CIPHER_CTX_new();
+	if (!c->cipher)
+		return 1;
+
+	if (!EVP_EncryptInit_ex(c->cipher, algo, 0, key, 0) || !EVP_CIPHER_CTX_set_padding(c->cipher, 0))
+	{
+		EVP_CIPHER_CTX_free(c->cipher);
+		return 1;
+	}
+
+	c->counter = 0;
+	c->used = c->avail = 0;
+	memset(c->counters, 0, sizeof(c->counters));
+
+	return 0;
+}
+
+
+
+static void ctr_cleanup(MZAE_CTR_CTX *c)
 {
-	AES_KEY aes_key;
-	char ctr_counter_le[16];
-	char ctr_encrypted_counter[16];
+	EVP_CIPHER_CTX_free(c->cipher);
+	memset(c, 0, sizeof(MZAE_CTR_CTX));
+}
+
+
+
+// Encrypts a batch of little endian counter blocks into the keystream buffer
+static int ctr_refill(MZAE_CTR_CTX *c, unsigned int len)
+{
+	unsigned char *p = c->counters;
+	unsigned int i, blocks = (len + 15) / 16;
+	int olen;
+
+	if (blocks > MZAE_CTR_BATCH)
+		blocks = MZAE_CTR_BATCH;
+
+	for (i=0; i < blocks; i++, p+=16) {
+		c->counter++;
 #ifdef BYTE_ORDER_1234
-	char ctr_counter_be[16];
+		p[0] = (unsigned char) c->counter;
+		p[1] = (unsigned char) (c->counter >> 8);
+		p[2] = (unsigned char) (c->counter >> 16);
+		p[3] = (unsigned char) (c->counter >> 24);
+		p[4] = (unsigned char) (c->counter >> 32);
+		p[5] = (unsigned char) (c->counter >> 40);
+		p[6] = (unsigned char) (c->counter >> 48);
+		p[7] = (unsigned char) (c->counter >> 56);
+#else
+		memcpy(p, &c->counter, 8);
+#endif
+	}
+
+	if (!EVP_EncryptUpdate(c->cipher, c->keystream, &olen, c->counters, blocks*16))
+		return 1;
+
+	c->used = 0;
+	c->avail = blocks*16;
+
+	return 0;
+}
+
+
+
+// XORs data with the keystream, 16 or 8 bytes at a time
+static void ctr_xor(char* dst, char* src, unsigned char* ks, unsigned int len)
+{
+#ifdef MZAE_SSE2
+	for (; len >= 16; len-=16, dst+=16, src+=16, ks+=16)
+		_mm_storeu_si128((__m128i*) dst, _mm_xor_si128(_mm_loadu_si128((__m128i*) src), _mm_loadu_si128((__m128i*) ks)));
+#else
+	unsigned long long a, b;
+
+	for (; len >= 8; len-=8, dst+=8, src+=8, ks+=8) {
+		memcpy(&a, src, 8);
+		memcpy(&b, ks, 8);
+		a ^= b;
+		memcpy(dst, &a, 8);
+	}
 #endif
-	const char* p = ctr_encrypted_counter;
-	const char* q = p+8;
-	char *pbuf;
-	uint32_t i;
+	while (len--)
+		*dst++ = *src++ ^ *ks++;
+}
+
+
+
+int MZAE_ctr_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_ctr_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_ctr_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+	MZAE_CTR_CTX *c;
+
+	if (!keylen)
+		return -1;
+
+	c = (MZAE_CTR_CTX*) malloc(sizeof(MZAE_CTR_CTX));
+	if (!c)
+		return 2;
+
+	if (ctr_setup(c, (MZAE_ENGINE*) engine, key, keylen))
+	{
+		free(c);
+		return 1;
+	}
+
+	*ctx = c;
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_update(void* ctx, char* src, unsigned int srclen, char* dst)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+	unsigned int n;
+
+	while (srclen) {
+		if (c->used == c->avail && ctr_refill(c, srclen))
+			return 1;
+
+		n = c->avail - c->used;
+		if (n > srclen)
+			n = srclen;
+
+		ctr_xor(dst, src, c->keystream + c->used, n);
+		c->used += n;
+		src += n;
+		dst += n;
+		srclen -= n;
+	}
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_seek(void* ctx, unsigned long long offset)
+{
+	MZAE_CTR_CTX *c = (MZAE_CTR_CTX*) ctx;
+
+	// The block at offset is encrypted with counter offset/16 + 1
+	c->counter = offset / 16;
+	c->used = c->avail = 0;
+
+	if (offset % 16)
+	{
+		if (ctr_refill(c, 16))
+			return 1;
+		c->used = (unsigned int) (offset % 16);
+	}
+
+	return 0;
+}
+
+
+
+void MZAE_ctr_end(void* ctx)
+{
+	if (!ctx)
+		return;
+	ctr_cleanup((MZAE_CTR_CTX*) ctx);
+	free(ctx);
+}
+
+
+
+int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst)
+{
+	void *ctx;
 
 	if (!keylen || !srclen)
 		return -1;
 
-	if (AES_set_encrypt_key(key, keylen*8, &aes_key))
+	*dst = (char*) malloc(srclen);
+	if (! *dst)
+		return 2;
+
+	if (MZAE_ctr_init(key, keylen, &ctx))
+	{
+		free(*dst);
 		return 1;
+	}
 
-#ifdef BYTE_ORDER_1234
-	memset(ctr_counter_be, 0, 16);
+	MZAE_ctr_update(ctx, src, srclen, *dst);
+	MZAE_ctr_end(ctx);
+
+	return 0;
+}
+
+
+
+int MZAE_ctr_crypt_inplace(char* key, unsigned int keylen, char* buf, unsigned int len)
+{
+	MZAE_CTR_CTX c;
+	int r;
+
+	if (!keylen || !len)
+		return -1;
+
+	if (ctr_setup(&c, 0, key, keylen))
+		return 1;
+
+	r = MZAE_ctr_update(&c, buf, len, buf);
+	ctr_cleanup(&c);
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_init(char* key, unsigned int keylen, void** ctx)
+{
+	return MZAE_hmac_sha1_init_ex(0, key, keylen, ctx);
+}
+
+
+
+int MZAE_hmac_sha1_init_ex(void* engine, char* key, unsigned int keylen, void** ctx)
+{
+#ifdef MZAE_FETCH
+	OSSL_PARAM params[2];
+	EVP_MAC *mac;
+	EVP_MAC_CTX *mctx;
+
+	if (!keylen)
+		return -1;
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA1", 0);
+	params[1] = OSSL_PARAM_construct_end();
+
+	// the engine has HMAC-SHA1 set up already, else it is fetched now (the
+	// context keeps its own reference to the MAC)
+	if (engine)
+		mctx = EVP_MAC_CTX_dup(((MZAE_ENGINE*) engine)->hmac_sha1);
+	else
+	{
+		mac = EVP_MAC_fetch(0, "HMAC", 0);
+		if (!mac)
+			return 1;
+		mctx = EVP_MAC_CTX_new(mac);
+		EVP_MAC_free(mac);
+	}
+	if (!mctx)
+		return 2;
+
+	if (!EVP_MAC_init(mctx, (unsigned char*) key, keylen, engine? 0 : params))
+	{
+		EVP_MAC_CTX_free(mctx);
+		return 1;
+	}
+
+	*ctx = mctx;
+
+	return 0;
 #else
-	memset(ctr_counter_le, 0, 16);
-#endif
-	
-	*dst = pbuf = (char*) malloc(srclen);
-	if (!pbuf)
+	HMAC_CTX *hctx;
+
+	if (!keylen)
+		return -1;
+
+	hctx = HMAC_CTX_new();
+	if (!hctx)
 		return 2;
 
-	for (i=0; i < srclen/16; i++) {
-#ifndef BYTE_ORDER_1234
-		(*((uint64_t*) ctr_counter_le))++;
-#else	
-		(*((uint64_t*) ctr_counter_be))++;
-		*((uint64_t*) ctr_counter_le) = *((uint64_t*) ctr_counter_be);
-		betole64((uint64_t*)ctr_counter_le);
-#endif
-		AES_ecb_encrypt(ctr_counter_le, ctr_encrypted_counter, &aes_key, 1);
-		*((uint64_t*) pbuf) = *((uint64_t*) src) ^ *((uint64_t*) p);
-		pbuf+=sizeof(uint64_t);
-		src+=sizeof(uint64_t);
-		*((uint64_t*) pbuf) = *((uint64_t*) src) ^ *((uint64_t*) q);
-		pbuf+=sizeof(uint64_t);
-		src+=sizeof(uint64_t);
+	if (!HMAC_Init_ex(hctx, key, keylen, engine? ((MZAE_ENGINE*) engine)->sha1 : EVP_sha1(), 0))
+	{
+		HMAC_CTX_free(hctx);
+		return 1;
 	}
 
-	if ((i = srclen%16)) {
-#ifndef BYTE_ORDER_1234
-		(*((uint64_t*) ctr_counter_le))++;
-#else	
-		(*((uint64_t*) ctr_counter_be))++;
-		*((uint64_t*) ctr_counter_le) = *((uint64_t*) ctr_counter_be);
-		betole64((uint64_t*)ctr_counter_le);
+	*ctx = hctx;
+
+	return 0;
+#endif
+}
+
+
+
+int MZAE_hmac_sha1_update(void* ctx, char* src, unsigned int srclen)
+{
+#ifdef MZAE_FETCH
+	if (srclen && !EVP_MAC_update((EVP_MAC_CTX*) ctx, (unsigned char*) src, srclen))
+#else
+	if (srclen && !HMAC_Update((HMAC_CTX*) ctx, src, srclen))
 #endif
-		AES_ecb_encrypt(ctr_counter_le, ctr_encrypted_counter, &aes_key, 1);
-		while (i--)
-			*pbuf++ = *src++ ^ *p++;
-	}
+		return 1;
 
 	return 0;
 }
 
 
 
-int MZAE_hmac_sha1_80(char* key, uint32_t keylen, char* src, uint32_t srclen, char** hmac)
+int MZAE_hmac_sha1_final(void* ctx, char* hmac)
+{
+#ifdef MZAE_FETCH
+	size_t olen = 20;
+	int r = 0;
+
+	if (!EVP_MAC_final((EVP_MAC_CTX*) ctx, (unsigned char*) hmac, &olen, 20))
+		r = 1;
+
+	EVP_MAC_CTX_free((EVP_MAC_CTX*) ctx);
+#else
+	unsigned int olen = 20;
+	int r = 0;
+
+	if (!HMAC_Final((HMAC_CTX*) ctx, hmac, &olen))
+		r = 1;
+
+	HMAC_CTX_free((HMAC_CTX*) ctx);
+#endif
+
+	return r;
+}
+
+
+
+int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac)
 {
+	unsigned int olen = 20;
+
 	if (!keylen || !srclen)
 		return -1;
 
-	*hmac = HMAC(EVP_sha1(), key, keylen, src, srclen, 0, 0);
+	// allocated, as with the other modules (HMAC would return a static buffer)
+	*hmac = (char*) malloc(20);
+	if (! *hmac)
+		return 2;
+
+	if (!HMAC(EVP_sha1(), key, keylen, src, srclen, *hmac, &olen))
+	{
+		free(*hmac);
+		return 1;
+	}
 
 	return 0;
 }
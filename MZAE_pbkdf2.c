@@ -0,0 +1,381 @@
+/*
+ *  Copyright (C) 2016-2023  maxpat78 <https://github.com/maxpat78>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+	PBKDF2-HMAC-SHA1, shared by all the cryptographic backends.
+
+	The HMAC key (the password) is the same in every round, so the SHA-1
+	states after the ipad and opad blocks are computed once: each round then
+	costs two SHA-1 blocks, built directly as words with constant padding.
+
+	The output blocks of PBKDF2 are independent chains: up to 4 of them (66
+	bytes for AES-256 need 4) run together, one per 32-bit lane of the SSE2
+	registers. Without SSE2, the lanes are processed one after another.
+*/
+
+#include <mZipAES.h>
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MZAE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#define LANES	4
+
+#define K1	0x5A827999
+#define K2	0x6ED9EBA1
+#define K3	0x8F1BBCDC
+#define K4	0xCA62C1D6
+
+// Bits hashed by each round of HMAC: ipad or opad block, plus a digest
+#define ROUND_BITS	((64 + 20) * 8)
+
+typedef struct {
+	unsigned int h[5];
+	unsigned long long len;
+	unsigned char buf[64];
+	unsigned int buflen;
+} MZAE_SHA1_STATE;
+
+
+
+/*
+	Scalar SHA-1
+*/
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SR(f, k, i) \
+	t = ROL(a, 5) + (f) + e + k + w[(i)&15]; \
+	e = d; d = c; c = ROL(b, 30); b = a; a = t;
+
+#define SW(i) \
+	w[(i)&15] = ROL(w[((i)-3)&15] ^ w[((i)-8)&15] ^ w[((i)-14)&15] ^ w[(i)&15], 1);
+
+// Compresses a block given as 16 big endian words (w is overwritten)
+static void sha1_words(unsigned int* h, unsigned int* w)
+{
+	unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], t;
+	int i;
+
+	for (i=0; i < 16; i++) {
+		SR((b & c) | (~b & d), K1, i)
+	}
+	for (; i < 20; i++) {
+		SW(i) SR((b & c) | (~b & d), K1, i)
+	}
+	for (; i < 40; i++) {
+		SW(i) SR(b ^ c ^ d, K2, i)
+	}
+	for (; i < 60; i++) {
+		SW(i) SR((b & c) | (d & (b | c)), K3, i)
+	}
+	for (; i < 80; i++) {
+		SW(i) SR(b ^ c ^ d, K4, i)
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+
+
+static void sha1_block(unsigned int* h, const unsigned char* p)
+{
+	unsigned int w[16];
+	int i;
+
+	for (i=0; i < 16; i++, p+=4)
+		w[i] = (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	sha1_words(h, w);
+	memset(w, 0, sizeof(w));
+}
+
+
+
+static void sha1_init(MZAE_SHA1_STATE* s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xEFCDAB89;
+	s->h[2] = 0x98BADCFE;
+	s->h[3] = 0x10325476;
+	s->h[4] = 0xC3D2E1F0;
+	s->len = 0;
+	s->buflen = 0;
+}
+
+
+
+static void sha1_update(MZAE_SHA1_STATE* s, const unsigned char* src, unsigned int srclen)
+{
+	unsigned int n;
+
+	s->len += srclen;
+
+	while (srclen) {
+		n = 64 - s->buflen;
+		if (n > srclen)
+			n = srclen;
+		memcpy(s->buf + s->buflen, src, n);
+		s->buflen += n;
+		src += n;
+		srclen -= n;
+		if (s->buflen == 64) {
+			sha1_block(s->h, s->buf);
+			s->buflen = 0;
+		}
+	}
+}
+
+
+
+// Pads the message, leaving the digest as words in s->h
+static void sha1_final(MZAE_SHA1_STATE* s)
+{
+	unsigned long long bits = s->len * 8;
+	int i;
+
+	s->buf[s->buflen++] = 0x80;
+	if (s->buflen > 56) {
+		memset(s->buf + s->buflen, 0, 64 - s->buflen);
+		sha1_block(s->h, s->buf);
+		s->buflen = 0;
+	}
+	memset(s->buf + s->buflen, 0, 56 - s->buflen);
+	for (i=0; i < 8; i++)
+		s->buf[56+i] = (unsigned char) (bits >> (56 - 8*i));
+	sha1_block(s->h, s->buf);
+}
+
+
+
+/*
+	The remaining rounds of the chains: u holds the last HMAC of each lane
+	and t their running XOR, both as words (lane l at [k*LANES + l]). The
+	SIMD version always computes LANES chains, the unused ones being cheap.
+*/
+#ifdef MZAE_SSE2
+#define ROLV(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+#define R(f, k, i) \
+	t = _mm_add_epi32(_mm_add_epi32(ROLV(a, 5), f), _mm_add_epi32(_mm_add_epi32(e, k), w[(i)&15])); \
+	e = d; d = c; c = ROLV(b, 30); b = a; a = t;
+
+#define W(i) \
+	w[(i)&15] = ROLV(_mm_xor_si128(_mm_xor_si128(w[((i)-3)&15], w[((i)-8)&15]), _mm_xor_si128(w[((i)-14)&15], w[(i)&15])), 1);
+
+#define F1 _mm_or_si128(_mm_and_si128(b, c), _mm_andnot_si128(b, d))
+#define F2 _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define F3 _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)))
+
+// SHA-1 of 4 independent blocks, one per lane
+static void sha1_x4(__m128i* h, __m128i* w)
+{
+	__m128i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], t;
+	__m128i k1 = _mm_set1_epi32(K1), k2 = _mm_set1_epi32(K2), k3 = _mm_set1_epi32(K3), k4 = _mm_set1_epi32(K4);
+	int i;
+
+	for (i=0; i < 16; i++) {
+		R(F1, k1, i)
+	}
+	for (; i < 20; i++) {
+		W(i) R(F1, k1, i)
+	}
+	for (; i < 40; i++) {
+		W(i) R(F2, k2, i)
+	}
+	for (; i < 60; i++) {
+		W(i) R(F3, k3, i)
+	}
+	for (; i < 80; i++) {
+		W(i) R(F2, k4, i)
+	}
+
+	h[0] = _mm_add_epi32(h[0], a);
+	h[1] = _mm_add_epi32(h[1], b);
+	h[2] = _mm_add_epi32(h[2], c);
+	h[3] = _mm_add_epi32(h[3], d);
+	h[4] = _mm_add_epi32(h[4], e);
+}
+
+
+
+static void pbkdf2_rounds(unsigned int* ipad, unsigned int* opad, unsigned int* u, unsigned int* t, int rounds, int lanes)
+{
+	__m128i U[5], T[5], H[5], w[16];
+	int i, k;
+
+	(void) lanes;	// the unused lanes are computed anyway, and dropped
+	for (k=0; k < 5; k++) {
+		U[k] = _mm_loadu_si128((__m128i*) (u + k*LANES));
+		T[k] = _mm_loadu_si128((__m128i*) (t + k*LANES));
+	}
+
+	for (i=0; i < rounds; i++) {
+		// inner hash: ipad state, then the previous HMAC
+		for (k=0; k < 5; k++) {
+			H[k] = _mm_set1_epi32(ipad[k]);
+			w[k] = U[k];
+		}
+		w[5] = _mm_set1_epi32(0x80000000);
+		for (k=6; k < 15; k++)
+			w[k] = _mm_setzero_si128();
+		w[15] = _mm_set1_epi32(ROUND_BITS);
+		sha1_x4(H, w);
+
+		// outer hash: opad state, then the inner digest
+		for (k=0; k < 5; k++) {
+			w[k] = H[k];
+			U[k] = _mm_set1_epi32(opad[k]);
+		}
+		w[5] = _mm_set1_epi32(0x80000000);
+		for (k=6; k < 15; k++)
+			w[k] = _mm_setzero_si128();
+		w[15] = _mm_set1_epi32(ROUND_BITS);
+		sha1_x4(U, w);
+
+		for (k=0; k < 5; k++)
+			T[k] = _mm_xor_si128(T[k], U[k]);
+	}
+
+	for (k=0; k < 5; k++) {
+		_mm_storeu_si128((__m128i*) (t + k*LANES), T[k]);
+		U[k] = T[k] = H[k] = _mm_setzero_si128();
+	}
+}
+#else
+static void pbkdf2_rounds(unsigned int* ipad, unsigned int* opad, unsigned int* u, unsigned int* t, int rounds, int lanes)
+{
+	unsigned int h[5], w[16];
+	int i, k, l;
+
+	for (l=0; l < lanes; l++) {
+		for (i=0; i < rounds; i++) {
+			memcpy(h, ipad, 20);
+			for (k=0; k < 5; k++)
+				w[k] = u[k*LANES + l];
+			w[5] = 0x80000000;
+			memset(w+6, 0, 9*4);
+			w[15] = ROUND_BITS;
+			sha1_words(h, w);
+
+			memcpy(w, h, 20);
+			memcpy(h, opad, 20);
+			w[5] = 0x80000000;
+			memset(w+6, 0, 9*4);
+			w[15] = ROUND_BITS;
+			sha1_words(h, w);
+
+			for (k=0; k < 5; k++) {
+				u[k*LANES + l] = h[k];
+				t[k*LANES + l] ^= h[k];
+			}
+		}
+	}
+
+	memset(h, 0, sizeof(h));
+	memset(w, 0, sizeof(w));
+}
+#endif
+
+
+
+int MZAE_pbkdf2_sha1(char* password, unsigned int pwlen, char* salt, int saltlen, int iterations, char* dst, int dstlen)
+{
+	MZAE_SHA1_STATE is, os, s;
+	unsigned char pad[64], ibuf[4];
+	unsigned int u[5*LANES], t[5*LANES], block, l, k, lanes, n;
+
+	if (iterations < 1 || dstlen < 0 || saltlen < 0)
+		return 1;
+
+	// A password longer than a block is hashed first
+	memset(pad, 0, 64);
+	if (pwlen > 64) {
+		sha1_init(&s);
+		sha1_update(&s, (unsigned char*) password, pwlen);
+		sha1_final(&s);
+		for (k=0; k < 20; k++)
+			pad[k] = (unsigned char) (s.h[k/4] >> (24 - 8*(k%4)));
+	}
+	else
+		memcpy(pad, password, pwlen);
+
+	// ipad and opad states are computed once
+	for (k=0; k < 64; k++)
+		pad[k] ^= 0x36;
+	sha1_init(&is);
+	sha1_update(&is, pad, 64);
+	for (k=0; k < 64; k++)
+		pad[k] ^= 0x36 ^ 0x5C;
+	sha1_init(&os);
+	sha1_update(&os, pad, 64);
+
+	for (block=1; dstlen > 0; block+=LANES) {
+		lanes = (dstlen + 19) / 20;
+		if (lanes > LANES)
+			lanes = LANES;
+
+		memset(u, 0, sizeof(u));
+
+		// First round of each lane: HMAC of salt and block index
+		for (l=0; l < lanes; l++) {
+			ibuf[0] = (unsigned char) ((block+l) >> 24);
+			ibuf[1] = (unsigned char) ((block+l) >> 16);
+			ibuf[2] = (unsigned char) ((block+l) >> 8);
+			ibuf[3] = (unsigned char) (block+l);
+
+			s = is;
+			sha1_update(&s, (unsigned char*) salt, saltlen);
+			sha1_update(&s, ibuf, 4);
+			sha1_final(&s);
+			for (k=0; k < 20; k++)
+				pad[k] = (unsigned char) (s.h[k/4] >> (24 - 8*(k%4)));
+
+			s = os;
+			sha1_update(&s, pad, 20);
+			sha1_final(&s);
+			for (k=0; k < 5; k++)
+				u[k*LANES + l] = s.h[k];
+		}
+		memcpy(t, u, sizeof(u));
+
+		pbkdf2_rounds(is.h, os.h, u, t, iterations - 1, lanes);
+
+		for (l=0; l < lanes; l++) {
+			n = dstlen < 20? dstlen : 20;
+			for (k=0; k < n; k++)
+				dst[k] = (char) (t[(k/4)*LANES + l] >> (24 - 8*(k%4)));
+			dst += n;
+			dstlen -= n;
+		}
+	}
+
+	memset(&is, 0, sizeof(is));
+	memset(&os, 0, sizeof(os));
+	memset(&s, 0, sizeof(s));
+	memset(pad, 0, sizeof(pad));
+	memset(u, 0, sizeof(u));
+	memset(t, 0, sizeof(t));
+
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ *  Copyright (C) 2016-2023  maxpat78 <https://github.com/maxpat78>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+Provides a minimal pool of worker threads, on top of Win32 or POSIX threads.
+
+Tasks are run in submission order; a task group is just a counter of the
+tasks still pending, that the submitter can wait for.
+*/
+#include <mZipAES.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+	#include <process.h>
+	typedef CRITICAL_SECTION MZAE_MUTEX;
+	typedef CONDITION_VARIABLE MZAE_COND;
+	typedef HANDLE MZAE_THREAD;
+	#define mutex_init(m) InitializeCriticalSection(m)
+	#define mutex_free(m) DeleteCriticalSection(m)
+	#define mutex_lock(m) EnterCriticalSection(m)
+	#define mutex_unlock(m) LeaveCriticalSection(m)
+	#define cond_init(c) InitializeConditionVariable(c)
+	#define cond_free(c)
+	#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+	#define cond_signal(c) WakeConditionVariable(c)
+	#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+	#include <pthread.h>
+	typedef pthread_mutex_t MZAE_MUTEX;
+	typedef pthread_cond_t MZAE_COND;
+	typedef pthread_t MZAE_THREAD;
+	#define mutex_init(m) pthread_mutex_init(m, 0)
+	#define mutex_free(m) pthread_mutex_destroy(m)
+	#define mutex_lock(m) pthread_mutex_lock(m)
+	#define mutex_unlock(m) pthread_mutex_unlock(m)
+	#define cond_init(c) pthread_cond_init(c, 0)
+	#define cond_free(c) pthread_cond_destroy(c)
+	#define cond_wait(c, m) pthread_cond_wait(c, m)
+	#define cond_signal(c) pthread_cond_signal(c)
+	#define cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+typedef struct MZAE_TASK {
+	MZAE_TASKFN fn;
+	void* arg;
+	int* group;
+	struct MZAE_TASK* next;
+} MZAE_TASK;
+
+struct MZAE_POOL {
+	MZAE_MUTEX lock;
+	MZAE_COND work;		// signalled when a task is queued
+	MZAE_COND done;		// broadcast when a task completes
+	MZAE_TASK* head;
+	MZAE_TASK* tail;
+	int quit;
+	int threads;
+	MZAE_THREAD tid[MZAE_MAXTHREADS];
+};
+
+
+
+#ifdef _WIN32
+static unsigned __stdcall pool_worker(void* arg)
+#else
+static void* pool_worker(void* arg)
+#endif
+{
+	MZAE_POOL* pool = (MZAE_POOL*) arg;
+	MZAE_TASK* t;
+
+	mutex_lock(&pool->lock);
+	for (;;)
+	{
+		while (!pool->head && !pool->quit)
+			cond_wait(&pool->work, &pool->lock);
+		if (!pool->head)
+			break;
+
+		t = pool->head;
+		pool->head = t->next;
+		if (!pool->head)
+			pool->tail = 0;
+		mutex_unlock(&pool->lock);
+
+		t->fn(t->arg);
+
+		mutex_lock(&pool->lock);
+		if (t->group)
+			--*t->group;
+		free(t);
+		cond_broadcast(&pool->done);
+	}
+	mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+
+
+int MZAE_pool_create(MZAE_POOL** ppool, int threads)
+{
+	MZAE_POOL* pool;
+	int i;
+
+	if (threads < 1 || threads > MZAE_MAXTHREADS)
+		return 1;
+
+	pool = (MZAE_POOL*) calloc(1, sizeof(MZAE_POOL));
+	if (!pool)
+		return 2;
+
+	mutex_init(&pool->lock);
+	cond_init(&pool->work);
+	cond_init(&pool->done);
+
+	for (i=0; i < threads; i++)
+	{
+#ifdef _WIN32
+		pool->tid[i] = (HANDLE) _beginthreadex(0, 0, pool_worker, pool, 0, 0);
+		if (!pool->tid[i])
+			break;
+#else
+		if (pthread_create(&pool->tid[i], 0, pool_worker, pool))
+			break;
+#endif
+	}
+	pool->threads = i;
+
+	if (!i)
+	{
+		MZAE_pool_destroy(pool);
+		return 3;
+	}
+
+	*ppool = pool;
+
+	return 0;
+}
+
+
+
+int MZAE_pool_submit(MZAE_POOL* pool, MZAE_TASKFN fn, void* arg, int* group)
+{
+	MZAE_TASK* t;
+
+	// Without a pool, the task runs at once
+	if (!pool)
+	{
+		fn(arg);
+		return 0;
+	}
+
+	t = (MZAE_TASK*) malloc(sizeof(MZAE_TASK));
+	if (!t)
+		return 1;
+
+	t->fn = fn;
+	t->arg = arg;
+	t->group = group;
+	t->next = 0;
+
+	mutex_lock(&pool->lock);
+	if (group)
+		++*group;
+	if (pool->tail)
+		pool->tail->next = t;
+	else
+		pool->head = t;
+	pool->tail = t;
+	cond_signal(&pool->work);
+	mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+
+
+void MZAE_pool_wait(MZAE_POOL* pool, int* group)
+{
+	if (!pool)
+		return;
+
+	mutex_lock(&pool->lock);
+	while (*group)
+		cond_wait(&pool->done, &pool->lock);
+	mutex_unlock(&pool->lock);
+}
+
+
+
+int MZAE_pool_threads(MZAE_POOL* pool)
+{
+	return pool? pool->threads : 0;
+}
+
+
+
+void MZAE_pool_destroy(MZAE_POOL* pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	// Lets the workers drain the queue, then joins them
+	mutex_lock(&pool->lock);
+	pool->quit = 1;
+	cond_broadcast(&pool->work);
+	mutex_unlock(&pool->lock);
+
+	for (i=0; i < pool->threads; i++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(pool->tid[i], INFINITE);
+		CloseHandle(pool->tid[i]);
+#else
+		pthread_join(pool->tid[i], 0);
+#endif
+	}
+
+	cond_free(&pool->work);
+	cond_free(&pool->done);
+	mutex_free(&pool->lock);
+	free(pool);
+}
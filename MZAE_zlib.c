@@ -18,46 +18,192 @@
 
 /*
 Provides functions to calculate ZIP crc32 and to deflate and inflate an archive
-in a single pass.
+in a single pass or incrementally, chunk by chunk.
+
+The crc32 folds 64 bytes at a time with carry-less multiplications when the
+CPU has PCLMULQDQ (unless MZAE_PORTABLE is defined), else it is Zlib's one.
 
 Requires Zlib.
 */
 #include <mZipAES.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 
+#if !defined(MZAE_PORTABLE) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+	#define MZAE_X86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define MZAE_TARGET(x)
+	#else
+		#include <cpuid.h>
+		#define MZAE_TARGET(x) __attribute__((target(x)))
+	#endif
+#endif
+
+typedef struct {
+	z_stream zstream;
+	int done;
+	char out[MZAE_CHUNK];
+} MZAE_ZLIB_CTX;
+
+
+
+#ifdef MZAE_X86
+// Detects PCLMULQDQ (CPUID.1:ECX bit 1) once
+static int has_pclmul(void)
+{
+	static int pclmul = -1;
+	unsigned int r[4];
+
+	if (pclmul != -1)
+		return pclmul;
+
+#ifdef _MSC_VER
+	__cpuid((int*) r, 1);
+#else
+	__cpuid(1, r[0], r[1], r[2], r[3]);
+#endif
+	pclmul = (r[2] & 2) != 0;
+
+	return pclmul;
+}
+
+
+
+/*
+  Folds len bytes (at least 64, a multiple of 16) into the crc register (not
+  inverted), as in Intel's "Fast CRC Computation for Generic Polynomials
+  Using PCLMULQDQ": 4 registers fold 64 bytes per step, are folded into one,
+  then reduced to 32 bits with Barrett. Constants are x^n mod P, reflected.
+*/
+MZAE_TARGET("pclmul,sse2")
+static unsigned int crc_fold(unsigned int crc, const char* p, unsigned int len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1 = _mm_xor_si128(_mm_loadu_si128((__m128i*) p), _mm_cvtsi32_si128(crc));
+	x2 = _mm_loadu_si128((__m128i*) (p + 16));
+	x3 = _mm_loadu_si128((__m128i*) (p + 32));
+	x4 = _mm_loadu_si128((__m128i*) (p + 48));
+
+	for (p += 64, len -= 64; len >= 64; p += 64, len -= 64)
+	{
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		t4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((__m128i*) p));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128((__m128i*) (p + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128((__m128i*) (p + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128((__m128i*) (p + 48)));
+	}
+
+	// 4 registers into 1, then the remaining 16 byte blocks
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), x2);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), x3);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), x4);
+
+	for (; len >= 16; p += 16, len -= 16)
+	{
+		t1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), t1), _mm_loadu_si128((__m128i*) p));
+	}
+
+	// 128 bits to 64, then to 32 (adding 32 zero bits)
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(k3k4, x1, 0x01), _mm_srli_si128(x1, 8));
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), x2);
+
+	// Barrett reduction
+	x2 = x1;
+	x1 = _mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10), mask32);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, poly, 0x00), x2);
+
+	return (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
 
 
 unsigned long MZAE_crc(unsigned long crc, char* src, unsigned int srclen)
 {
+#ifdef MZAE_X86
+	unsigned int n = srclen & ~15;
+
+	if (n >= 64 && has_pclmul())
+	{
+		crc = ~crc_fold(~crc & 0xFFFFFFFF, src, n) & 0xFFFFFFFF;
+		src += n;
+		srclen -= n;
+	}
+#endif
 	return crc32(crc, src, srclen);
 }
 
 
 
+unsigned long MZAE_crc_combine(unsigned long crc1, unsigned long crc2, unsigned long len2)
+{
+	return crc32_combine(crc1, crc2, (z_off_t) len2);
+}
+
+
+
+unsigned long MZAE_deflate_bound(unsigned long srclen)
+{
+	return compressBound(srclen);
+}
+
+
+
 int MZAE_deflate(char* src, unsigned int srclen, char** dst, unsigned int* dstlen)
 {
 	z_stream zstream;
-	*dst = (char*) malloc(srclen+64);
-
-	if (! *dst)
-		return 1;
+	unsigned long bound;
 
 	memset(&zstream, 0, sizeof(zstream));
 	zstream.zalloc = Z_NULL;
 	zstream.zfree = Z_NULL;
 	zstream.opaque = Z_NULL;
 
-	if (deflateInit2(&zstream, 8, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+	if (deflateInit2(&zstream, MZAE_LEVEL, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
 		return 2;
 
+	// Incompressible data grow a little: room for the stored blocks
+	bound = deflateBound(&zstream, srclen);
+	*dst = (char*) malloc(bound);
+	if (! *dst)
+	{
+		deflateEnd(&zstream);
+		return 1;
+	}
+
 	zstream.next_in = src;
 	zstream.avail_in = srclen;
 	zstream.next_out = *dst;
-	zstream.avail_out = srclen+64;
+	zstream.avail_out = bound;
 
 	if (deflate(&zstream, Z_FINISH) != Z_STREAM_END)
+	{
+		deflateEnd(&zstream);
+		free(*dst);
+		*dst = 0;
 		return 3;
+	}
 
 	deflateEnd(&zstream);
 	
@@ -95,3 +241,172 @@ int MZAE_inflate(char* src, unsigned int srclen, char* dst, unsigned int dstlen)
 	
 	return 0;
 }
+
+
+
+int MZAE_deflate_block(int level, char* dict, unsigned int dictlen, char* src, unsigned int srclen, int last, char* dst, unsigned int* dstlen)
+{
+	z_stream zstream;
+	int r;
+
+	if (!dst)
+		return 0;
+
+	memset(&zstream, 0, sizeof(zstream));
+
+	if (deflateInit2(&zstream, level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 2;
+
+	if (dictlen && deflateSetDictionary(&zstream, dict, dictlen) != Z_OK)
+	{
+		deflateEnd(&zstream);
+		return 2;
+	}
+
+	zstream.next_in = src;
+	zstream.avail_in = srclen;
+	zstream.next_out = dst;
+	zstream.avail_out = *dstlen;
+
+	// A sync flush ends with an empty stored block, on a byte boundary
+	r = deflate(&zstream, last? Z_FINISH : Z_SYNC_FLUSH);
+	*dstlen = zstream.total_out;
+	deflateEnd(&zstream);
+
+	if (last? r != Z_STREAM_END : (r != Z_OK || zstream.avail_in || !zstream.avail_out))
+		return 3;
+
+	return 0;
+}
+
+
+
+int MZAE_deflate_init(void** ctx, int level)
+{
+	MZAE_ZLIB_CTX *z = (MZAE_ZLIB_CTX*) calloc(1, sizeof(MZAE_ZLIB_CTX));
+
+	if (!z)
+		return 1;
+
+	if (deflateInit2(&z->zstream, level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		free(z);
+		return 2;
+	}
+
+	*ctx = z;
+
+	return 0;
+}
+
+
+
+int MZAE_deflate_update(void* ctx, char* src, unsigned int srclen, int finish, MZAE_OUTFN out, void* opaque)
+{
+	MZAE_ZLIB_CTX *z = (MZAE_ZLIB_CTX*) ctx;
+	unsigned int n;
+	int r;
+
+	z->zstream.next_in = src;
+	z->zstream.avail_in = srclen;
+
+	do {
+		z->zstream.next_out = z->out;
+		z->zstream.avail_out = MZAE_CHUNK;
+
+		r = deflate(&z->zstream, finish? Z_FINISH : Z_NO_FLUSH);
+		if (r == Z_STREAM_ERROR)
+			return 3;
+
+		n = MZAE_CHUNK - z->zstream.avail_out;
+		if (n && out(opaque, z->out, n))
+			return 4;
+	} while (z->zstream.avail_out == 0 || (finish && r != Z_STREAM_END));
+
+	return 0;
+}
+
+
+
+void MZAE_deflate_end(void* ctx)
+{
+	if (!ctx)
+		return;
+	deflateEnd(&((MZAE_ZLIB_CTX*) ctx)->zstream);
+	free(ctx);
+}
+
+
+
+int MZAE_inflate_init(void** ctx)
+{
+	MZAE_ZLIB_CTX *z = (MZAE_ZLIB_CTX*) calloc(1, sizeof(MZAE_ZLIB_CTX));
+
+	if (!z)
+		return 1;
+
+	if (inflateInit2(&z->zstream, -15) != Z_OK)
+	{
+		free(z);
+		return 2;
+	}
+
+	*ctx = z;
+
+	return 0;
+}
+
+
+
+int MZAE_inflate_update(void* ctx, char* src, unsigned int srclen, MZAE_OUTFN out, void* opaque)
+{
+	MZAE_ZLIB_CTX *z = (MZAE_ZLIB_CTX*) ctx;
+	unsigned int n;
+	int r;
+
+	if (z->done)
+		return srclen? 3 : 0;
+
+	// the end of the input needs no work: inflate_end tells if the stream ended
+	if (!srclen)
+		return 0;
+
+	z->zstream.next_in = src;
+	z->zstream.avail_in = srclen;
+
+	do {
+		z->zstream.next_out = z->out;
+		z->zstream.avail_out = MZAE_CHUNK;
+
+		r = inflate(&z->zstream, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+			return 2;
+
+		n = MZAE_CHUNK - z->zstream.avail_out;
+		if (n && out(opaque, z->out, n))
+			return 4;
+
+		if (r == Z_STREAM_END) {
+			z->done = 1;
+			// No data can follow the end of the Deflate stream
+			return z->zstream.avail_in? 3 : 0;
+		}
+	} while (z->zstream.avail_out == 0);
+
+	return 0;
+}
+
+
+
+int MZAE_inflate_end(void* ctx)
+{
+	int r;
+
+	if (!ctx)
+		return 1;
+	r = ((MZAE_ZLIB_CTX*) ctx)->done? 0 : 1;
+	inflateEnd(&((MZAE_ZLIB_CTX*) ctx)->zstream);
+	free(ctx);
+
+	return r;
+}
@@ -16,17 +16,1565 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+// 64-bit file offsets on 32-bit systems too
+#define _FILE_OFFSET_BITS 64
+
 #include <mZipAES.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// io_uring is used through its system calls, without liburing
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Errors of crypt_file besides the MZAE_ERR_* ones
+#define ERR_OPEN_IN     -1
+#define ERR_OPEN_OUT    -2
+#define ERR_READ        -3
+#define ERR_WRITE       -4
+#define ERR_NOMAP       -5      // can't map the files: AIO is used
+
+// Chunks read ahead or written behind for each file, and their size
+#define AIO_DEPTH       8
+#define AIO_CHUNK       262144
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+// A file of a batch, and the outcome of its processing
+typedef struct {
+    char *in;
+    char *out;
+    long long size;
+    unsigned long long written;
+    int err;
+    char opt;
+    int threads;
+    int level;
+    int verbose;
+    int async;
+    char *password;
+    MZAE_STATS stats;
+    MZAE_INFO info;
+} JOB;
+
+typedef struct {
+    JOB *jobs;
+    int count;
+    int max;
+} JOBLIST;
+
+// A file mapped in memory
+typedef struct {
+    char *p;
+    unsigned long size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE map;
+#else
+    int fd;
+#endif
+} MAPPING;
+
+
+
+// Reads a chunk of an archive at the given offset of a file
+static int file_read(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+    FILE* f = (FILE*) opaque;
+
+    if (fseek64(f, offset, SEEK_SET) || fread(buf, 1, len, f) != len)
+        return 1;
+    return 0;
+}
+
+
+
+// Reads a chunk of an archive with positional reads, which need no seek
+static int pos_read(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+#ifdef _WIN32
+    OVERLAPPED ov;
+    DWORD n;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD) offset;
+    ov.OffsetHigh = (DWORD) (offset >> 32);
+    if (!ReadFile((HANDLE) opaque, buf, len, &n, &ov) || n != len)
+        return 1;
+#else
+    ssize_t n;
+
+    for (; len; buf += n, offset += n, len -= n) {
+        n = pread(*(int*) opaque, buf, len, (off_t) offset);
+        if (n <= 0)
+            return 1;
+    }
+#endif
+    return 0;
+}
+
+
+
+// Stores a chunk of the output at the given offset of a file, with positional writes
+static int pos_write(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+#ifdef _WIN32
+    OVERLAPPED ov;
+    DWORD n;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD) offset;
+    ov.OffsetHigh = (DWORD) (offset >> 32);
+    if (!WriteFile((HANDLE) opaque, buf, len, &n, &ov) || n != len)
+        return 1;
+#else
+    ssize_t n;
+
+    for (; len; buf += n, offset += n, len -= n) {
+        n = pwrite(*(int*) opaque, buf, len, (off_t) offset);
+        if (n <= 0)
+            return 1;
+    }
+#endif
+    return 0;
+}
+
+
+
+/*
+ * Read-ahead and write-behind of a file: AIO_DEPTH chunks of AIO_CHUNK bytes
+ * are in flight at once, so that the disk works while the chunk before is
+ * compressed and encrypted. On Linux the chunks go through an io_uring, else
+ * (or if the kernel refuses it) through worker threads doing positional
+ * reads and writes.
+ *
+ * The reader returns the chunks in order, from the start of the file or from
+ * its end; the writer gathers the output at consecutive offsets in a chunk,
+ * and queues it when full or when an offset breaks the sequence. A chunk
+ * over a range still in flight is queued after that transfer ends.
+ */
+typedef struct AIO AIO;
+
+typedef struct {
+    AIO *aio;
+    char *buf;
+    unsigned long long offset;
+    unsigned int len;
+    unsigned int done;          // bytes already transferred
+    int busy;
+    int err;
+    int group;                  // task of the worker threads
+#ifdef HAVE_IO_URING
+    struct iovec iov;
+#endif
+} AIOSLOT;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+} URING;
+#endif
+
+struct AIO {
+#ifdef _WIN32
+    HANDLE h;
+#else
+    int fd;
+#endif
+    int write;
+    int backwards;
+    int err;
+    unsigned long long size;
+    unsigned long long chunks;  // reader: chunks of the file, and the next one
+    unsigned long long cur;
+    int head;                   // writer: slot being filled
+    MZAE_POOL *pool;
+#ifdef HAVE_IO_URING
+    URING ring;
+    int uring;
+#endif
+    AIOSLOT slot[AIO_DEPTH];
+};
+
+#ifdef _WIN32
+#define AIO_FILE(a) ((void*) (a)->h)
+#else
+#define AIO_FILE(a) ((void*) &(a)->fd)
+#endif
+
+
+
+// Ends the transfer of a slot: a failed one spoils the whole file
+static void slot_done(AIO* a, AIOSLOT* sl)
+{
+    sl->busy = 0;
+    if (sl->err)
+        a->err = 1;
+    if (a->write)
+        sl->len = 0;
+}
+
+
+
+#ifdef HAVE_IO_URING
+// Sets up an io_uring without liburing; returns zero for success
+static int uring_init(URING* u, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return 1;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(0, u->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(0, u->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = (struct io_uring_sqe*) mmap(0, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->sq_ring != MAP_FAILED)
+            munmap(u->sq_ring, u->sq_size);
+        if (u->cq_ring != MAP_FAILED)
+            munmap(u->cq_ring, u->cq_size);
+        if (u->sqes != MAP_FAILED)
+            munmap(u->sqes, u->sqes_size);
+        close(u->fd);
+        return 1;
+    }
+
+    sq = (char*) u->sq_ring;
+    cq = (char*) u->cq_ring;
+    u->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->cq_head = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+
+
+static void uring_end(URING* u)
+{
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->cq_ring, u->cq_size);
+    munmap(u->sq_ring, u->sq_size);
+    close(u->fd);
+}
+
+
+
+// Queues the rest of the transfer of a slot on the ring
+static int uring_submit(AIO* a, AIOSLOT* sl)
+{
+    URING *u = &a->ring;
+    unsigned tail = *u->sq_tail, i = tail & *u->sq_mask;
+    struct io_uring_sqe *e = &u->sqes[i];
+
+    sl->iov.iov_base = sl->buf + sl->done;
+    sl->iov.iov_len = sl->len - sl->done;
+    memset(e, 0, sizeof(*e));
+    e->opcode = a->write? IORING_OP_WRITEV : IORING_OP_READV;
+    e->fd = a->fd;
+    e->addr = (unsigned long) &sl->iov;
+    e->len = 1;
+    e->off = sl->offset + sl->done;
+    e->user_data = (unsigned long) sl;
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, 0, 0) != 1;
+}
+
+
+
+// Collects completions until the slot is done: partial transfers go on
+static void uring_wait(AIO* a, AIOSLOT* sl)
+{
+    URING *u = &a->ring;
+    struct io_uring_cqe *c;
+    AIOSLOT *done;
+    unsigned head;
+    int res;
+
+    while (sl->busy) {
+        head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR) {
+                sl->err = 1;
+                slot_done(a, sl);
+            }
+            continue;
+        }
+        c = &u->cqes[head & *u->cq_mask];
+        done = (AIOSLOT*) (unsigned long) c->user_data;
+        res = c->res;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (res > 0)
+            done->done += res;
+        if (res > 0 && done->done < done->len && !uring_submit(a, done))
+            continue;
+        if (done->done < done->len)
+            done->err = 1;
+        slot_done(a, done);
+    }
+}
+#endif
+
+
+
+// Transfers a whole slot, on a worker thread
+static void slot_io(void* arg)
+{
+    AIOSLOT *sl = (AIOSLOT*) arg;
+
+    sl->err = (sl->aio->write? pos_write : pos_read)(AIO_FILE(sl->aio), sl->offset, sl->buf, sl->len);
+}
+
+
+
+// Waits for the transfer of a slot; returns nonzero if any failed
+static int aio_wait(AIO* a, AIOSLOT* sl)
+{
+#ifdef HAVE_IO_URING
+    if (a->uring)
+        uring_wait(a, sl);
+    else
+#endif
+    if (sl->busy) {
+        MZAE_pool_wait(a->pool, &sl->group);
+        slot_done(a, sl);
+    }
+    return a->err;
+}
+
+
+
+static void aio_submit(AIO* a, AIOSLOT* sl)
+{
+    AIOSLOT *o;
+    int i;
+
+    // A range written again (a header patched at the end) waits for the
+    // transfers in flight over it, which could otherwise land after it
+    for (i = 0; a->write && i < AIO_DEPTH; i++) {
+        o = &a->slot[i];
+        if (o->busy && o->offset < sl->offset + sl->len && sl->offset < o->offset + o->len)
+            aio_wait(a, o);
+    }
+
+    sl->done = 0;
+    sl->err = 0;
+    sl->busy = 1;
+#ifdef HAVE_IO_URING
+    if (a->uring) {
+        if (uring_submit(a, sl)) {
+            sl->err = 1;
+            slot_done(a, sl);
+        }
+        return;
+    }
+#endif
+    if (MZAE_pool_submit(a->pool, slot_io, sl, &sl->group))
+        slot_io(sl);
+}
+
+
+
+// Starts reading chunk k into a slot
+static void aio_read_chunk(AIO* a, unsigned long long k)
+{
+    AIOSLOT *sl = &a->slot[k % AIO_DEPTH];
+    unsigned long long end;
+
+    if (a->backwards) {
+        end = a->size - k * AIO_CHUNK;
+        sl->offset = end > AIO_CHUNK? end - AIO_CHUNK : 0;
+        sl->len = (unsigned int) (end - sl->offset);
+    }
+    else {
+        sl->offset = k * AIO_CHUNK;
+        sl->len = a->size - sl->offset < AIO_CHUNK? (unsigned int) (a->size - sl->offset) : AIO_CHUNK;
+    }
+    aio_submit(a, sl);
+}
+
+
+
+// Waits for the transfers in flight and closes the file; returns nonzero if any failed
+static int aio_close(AIO* a)
+{
+    int i;
+
+    for (i = 0; i < AIO_DEPTH; i++)
+        aio_wait(a, &a->slot[i]);
+    MZAE_pool_destroy(a->pool);
+#ifdef HAVE_IO_URING
+    if (a->uring)
+        uring_end(&a->ring);
+#endif
+    for (i = 0; i < AIO_DEPTH; i++)
+        free(a->slot[i].buf);
+#ifdef _WIN32
+    if (!CloseHandle(a->h))
+        a->err = 1;
+#else
+    if (close(a->fd))
+        a->err = 1;
+#endif
+    return a->err;
+}
+
+
+
+/*
+ * Opens a file for reading (forwards or backwards) or writing, with its
+ * buffers and its ring or worker threads. Returns zero, ERR_OPEN_IN,
+ * ERR_OPEN_OUT or ERR_READ.
+ */
+static int aio_open(AIO* a, char* name, int write, int backwards)
+{
+    int i, n;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+#else
+    struct stat st;
+#endif
+
+    memset(a, 0, sizeof(AIO));
+    a->write = write;
+    a->backwards = backwards;
+#ifdef _WIN32
+    a->h = write? CreateFileA(name, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0) :
+        CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (a->h == INVALID_HANDLE_VALUE)
+        return write? ERR_OPEN_OUT : ERR_OPEN_IN;
+    if (!write && !GetFileSizeEx(a->h, &size)) {
+        CloseHandle(a->h);
+        return ERR_READ;
+    }
+    a->size = write? 0 : size.QuadPart;
+#else
+    a->fd = write? open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666) : open(name, O_RDONLY);
+    if (a->fd < 0)
+        return write? ERR_OPEN_OUT : ERR_OPEN_IN;
+    if (!write && fstat(a->fd, &st)) {
+        close(a->fd);
+        return ERR_READ;
+    }
+    a->size = write? 0 : st.st_size;
+#endif
+
+    for (i = 0; i < AIO_DEPTH; i++) {
+        a->slot[i].aio = a;
+        a->slot[i].buf = (char*) malloc(AIO_CHUNK);
+        if (!a->slot[i].buf)
+            a->err = 1;
+    }
+
+#ifdef HAVE_IO_URING
+    a->uring = !uring_init(&a->ring, AIO_DEPTH);
+    if (!a->uring)
+#endif
+    if (MZAE_pool_create(&a->pool, AIO_DEPTH / 2))
+        a->pool = 0; // transfers run at once
+
+    if (a->err) {
+        aio_close(a);
+        return ERR_READ;
+    }
+
+    // The first chunks are read ahead at once
+    if (!write) {
+        a->chunks = (a->size + AIO_CHUNK - 1) / AIO_CHUNK;
+        n = a->chunks < AIO_DEPTH? (int) a->chunks : AIO_DEPTH;
+        for (i = 0; i < n; i++)
+            aio_read_chunk(a, i);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Returns the next chunk of a file being read, and its length: zero at the
+ * end, or on errors (a->err). The chunk stays valid until the next call.
+ */
+static unsigned int aio_next(AIO* a, char** buf)
+{
+    AIOSLOT *sl;
+
+    // The slot of the chunk returned last time reads ahead
+    if (a->cur && a->cur - 1 + AIO_DEPTH < a->chunks)
+        aio_read_chunk(a, a->cur - 1 + AIO_DEPTH);
+
+    if (a->err || a->cur == a->chunks)
+        return 0;
+    sl = &a->slot[a->cur % AIO_DEPTH];
+    if (aio_wait(a, sl))
+        return 0;
+    a->cur++;
+    *buf = sl->buf;
+    return sl->len;
+}
+
+
+
+// Sink of the streams: gathers the output, and queues it by chunks
+static int aio_write(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+    AIO *a = (AIO*) opaque;
+    AIOSLOT *sl;
+    unsigned int n;
+
+    while (len) {
+        sl = &a->slot[a->head];
+        // The slot is reused only when its previous chunk is written
+        if (aio_wait(a, sl))
+            break;
+        if (sl->len && (offset != sl->offset + sl->len || sl->len == AIO_CHUNK)) {
+            aio_submit(a, sl);
+            a->head = (a->head + 1) % AIO_DEPTH;
+            continue;
+        }
+        if (!sl->len)
+            sl->offset = offset;
+        n = AIO_CHUNK - sl->len < len? AIO_CHUNK - sl->len : len;
+        memcpy(sl->buf + sl->len, buf, n);
+        sl->len += n;
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    return a->err;
+}
+
+
+
+// Queues the last chunk of a file being written, then closes it
+static int aio_flush(AIO* a)
+{
+    if (!a->err && a->slot[a->head].len)
+        aio_submit(a, &a->slot[a->head]);
+    return aio_close(a);
+}
+
+
+
+// Stores a chunk of the output at the given offset of a mapped file
+static int map_write(void* opaque, unsigned long long offset, char* buf, unsigned int len)
+{
+    MAPPING* m = (MAPPING*) opaque;
+
+    if (offset > m->size || len > m->size - offset)
+        return 1;
+    memcpy(m->p + offset, buf, len);
+    return 0;
+}
+
+
+
+// Maps a whole file for reading, hinting the kernel about the access order
+static int map_input(MAPPING* m, char* name, int backwards)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    m->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+        backwards? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (m->file == INVALID_HANDLE_VALUE)
+        return ERR_OPEN_IN;
+    if (!GetFileSizeEx(m->file, &size)) {
+        CloseHandle(m->file);
+        return ERR_READ;
+    }
+    if (size.QuadPart <= 0 || size.QuadPart > (unsigned long) -1) {
+        CloseHandle(m->file);
+        return size.QuadPart? ERR_NOMAP : ERR_READ;
+    }
+    m->size = (unsigned long) size.QuadPart;
+    m->map = CreateFileMappingA(m->file, 0, PAGE_READONLY, 0, 0, 0);
+    m->p = m->map? (char*) MapViewOfFile(m->map, FILE_MAP_READ, 0, 0, 0) : 0;
+    if (!m->p) {
+        if (m->map)
+            CloseHandle(m->map);
+        CloseHandle(m->file);
+        return ERR_NOMAP;
+    }
+#else
+    struct stat st;
+
+    m->fd = open(name, O_RDONLY);
+    if (m->fd < 0)
+        return ERR_OPEN_IN;
+    if (fstat(m->fd, &st)) {
+        close(m->fd);
+        return ERR_READ;
+    }
+    if (st.st_size <= 0 || (unsigned long long) st.st_size > (unsigned long) -1) {
+        close(m->fd);
+        return st.st_size? ERR_NOMAP : ERR_READ;
+    }
+    m->size = (unsigned long) st.st_size;
+    m->p = (char*) mmap(0, m->size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if (m->p == (char*) MAP_FAILED) {
+        close(m->fd);
+        return ERR_NOMAP;
+    }
+    // A V2 document is encrypted reading from its end
+    madvise(m->p, m->size, backwards? MADV_WILLNEED : MADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+
+
+// Creates a file of the given size and maps it for writing
+static int map_output(MAPPING* m, char* name, unsigned long size)
+{
+    m->size = size;
+#ifdef _WIN32
+    m->file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (m->file == INVALID_HANDLE_VALUE)
+        return ERR_OPEN_OUT;
+    m->map = CreateFileMappingA(m->file, 0, PAGE_READWRITE, 0, size, 0);
+    m->p = m->map? (char*) MapViewOfFile(m->map, FILE_MAP_WRITE, 0, 0, 0) : 0;
+    if (!m->p) {
+        if (m->map)
+            CloseHandle(m->map);
+        CloseHandle(m->file);
+        DeleteFileA(name);
+        return ERR_NOMAP;
+    }
+#else
+    m->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m->fd < 0)
+        return ERR_OPEN_OUT;
+    if (ftruncate(m->fd, size)) {
+        close(m->fd);
+        remove(name);
+        return ERR_NOMAP;
+    }
+    m->p = (char*) mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (m->p == (char*) MAP_FAILED) {
+        close(m->fd);
+        remove(name);
+        return ERR_NOMAP;
+    }
+    madvise(m->p, size, MADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+
+
+// Unmaps a file, truncating it at size if it was written
+static int unmap(MAPPING* m, int output, unsigned long size)
+{
+    int err = 0;
+#ifdef _WIN32
+    LARGE_INTEGER pos;
+
+    UnmapViewOfFile(m->p);
+    CloseHandle(m->map);
+    if (output) {
+        pos.QuadPart = size;
+        if (!SetFilePointerEx(m->file, pos, 0, FILE_BEGIN) || !SetEndOfFile(m->file))
+            err = ERR_WRITE;
+    }
+    CloseHandle(m->file);
+#else
+    munmap(m->p, m->size);
+    if (output && ftruncate(m->fd, size))
+        err = ERR_WRITE;
+    if (close(m->fd))
+        err = ERR_WRITE;
+#endif
+    return err;
+}
+
+
+
+/*
+ * Same as crypt_file, on files mapped in memory: the input is passed to the
+ * streaming functions as a whole, and the output written in place. The
+ * output is pre-sized with MiniZipAEWriteBound or the length reported by
+ * MiniZipAERead, and truncated at the end.
+ */
+static int crypt_mapped(MZAE_CTX* ctx, char opt, char* password, char* in, char* out, int threads, int level, long long* insize, unsigned long long* written)
+{
+    char *p = 0;
+    int err, err2, flags = 0;
+    unsigned long size = 0;
+    MAPPING mi, mo;
+    MZAE_STREAM *s = 0;
+    MZAE_SINK sink;
+
+    if ((err = map_input(&mi, in, opt == 'E')))
+        return err;
+    *insize = mi.size;
+
+    if (opt == 'E')
+        size = MiniZipAEWriteBound(mi.size);
+    else if ((err = MiniZipAEReadCtx(ctx, mi.p, mi.size, &p, &size, password))) {
+        unmap(&mi, 0, 0);
+        return err;
+    }
+
+    if ((err = map_output(&mo, out, size))) {
+        unmap(&mi, 0, 0);
+        return err;
+    }
+
+    sink.opaque = &mo;
+    sink.write = map_write;
+
+    if (opt == 'E') {
+        err = MZAE_write_init_ex(ctx, &s, password, 0, &sink);
+        if (!err && threads)
+            err = MZAE_stream_setopt(s, MZAE_OPT_THREADS, threads);
+        if (!err && level != MZAE_LEVEL)
+            err = MZAE_stream_setopt(s, MZAE_OPT_LEVEL, level);
+        if (!err && mi.size >= MZAE_ZIP64_SIZE)
+            err = MZAE_stream_setopt(s, MZAE_OPT_ZIP64, 1);
+        if (!err)
+            err = MZAE_write_update(s, mi.p, mi.size);
+        if (s) {
+            err2 = MZAE_write_final(s, written);
+            if (!err)
+                err = err2;
+        }
+    }
+    else {
+        // The "R" comment at the end marks a reversed (V2) document
+        if (mi.p[mi.size-1] != 'R')
+            flags = MZAE_FLAG_V1;
+        err = MZAE_read_init_ex(ctx, &s, password, flags, &sink);
+        if (!err && threads)
+            err = MZAE_stream_setopt(s, MZAE_OPT_THREADS, threads);
+        if (!err)
+            err = MZAE_read_update(s, mi.p, mi.size);
+        if (s) {
+            err2 = MZAE_read_final(s, written);
+            if (!err)
+                err = err2;
+        }
+    }
+
+    unmap(&mi, 0, 0);
+    err2 = unmap(&mo, 1, err? 0 : (unsigned long) *written);
+    if (!err)
+        err = err2;
+
+    if (err)
+        remove(out);
+
+    return err;
+}
+
+
+
+/*
+ * Checks the password on the first bytes of an encrypted file, so that a
+ * wrong one is rejected before the file is read or mapped, and its output
+ * created.
+ */
+static int check_file(MZAE_CTX* ctx, char* password, char* in)
+{
+    MZAE_SOURCE source;
+    FILE *fi;
+    int err;
+
+    fi = fopen(in, "rb");
+    if (! fi)
+        return ERR_OPEN_IN;
+
+    fseek64(fi, 0, SEEK_END);
+    source.opaque = fi;
+    source.read = file_read;
+    source.size = ftell64(fi);
+    err = MZAE_check_password(&source, ctx, 0, password);
+
+    fclose(fi);
+
+    return err;
+}
+
+
+
+/*
+ * Same as crypt_file, with read-ahead and write-behind (AIO): the input is
+ * fed to the streaming functions chunk by chunk, as it arrives.
+ */
+static int crypt_async(MZAE_CTX* ctx, char opt, char* password, char* in, char* out, int threads, int level, long long* insize, unsigned long long* written)
+{
+    AIO ai, ao;
+    MZAE_STREAM *s = 0;
+    MZAE_SINK sink;
+    char *buf, last;
+    unsigned int n;
+    int err, flags = 0;
+
+    // A V2 document is fed from its end, since it is stored reversed
+    if ((err = aio_open(&ai, in, 0, opt == 'E')))
+        return err;
+    *insize = ai.size;
+
+    // The "R" comment at the end marks a reversed (V2) document
+    if (!ai.size || (opt == 'D' && pos_read(AIO_FILE(&ai), ai.size - 1, &last, 1))) {
+        aio_close(&ai);
+        return ERR_READ;
+    }
+    if (opt == 'D' && last != 'R')
+        flags = MZAE_FLAG_V1;
+
+    if ((err = aio_open(&ao, out, 1, 0))) {
+        aio_close(&ai);
+        return err;
+    }
+    sink.opaque = &ao;
+    sink.write = aio_write;
+
+    if (opt == 'E') {
+        err = MZAE_write_init_ex(ctx, &s, password, 0, &sink);
+        if (!err && threads)
+            err = MZAE_stream_setopt(s, MZAE_OPT_THREADS, threads);
+        if (!err && level != MZAE_LEVEL)
+            err = MZAE_stream_setopt(s, MZAE_OPT_LEVEL, level);
+        if (!err && ai.size >= MZAE_ZIP64_SIZE)
+            err = MZAE_stream_setopt(s, MZAE_OPT_ZIP64, 1);
+        while (!err && (n = aio_next(&ai, &buf)))
+            err = MZAE_write_update(s, buf, n);
+        if (!err && ai.err)
+            err = ERR_READ;
+        if (s) {
+            if (!err)
+                err = MZAE_write_final(s, written);
+            else
+                MZAE_write_final(s, 0);
+        }
+    }
+    else {
+        err = MZAE_read_init_ex(ctx, &s, password, flags, &sink);
+        if (!err && threads)
+            err = MZAE_stream_setopt(s, MZAE_OPT_THREADS, threads);
+        while (!err && (n = aio_next(&ai, &buf)))
+            err = MZAE_read_update(s, buf, n);
+        if (!err && ai.err)
+            err = ERR_READ;
+        if (s) {
+            if (!err)
+                err = MZAE_read_final(s, written);
+            else
+                MZAE_read_final(s, 0);
+        }
+    }
+
+    aio_close(&ai);
+    if (aio_flush(&ao) && !err)
+        err = ERR_WRITE;
+
+    if (err)
+        remove(out);
+
+    return err;
+}
+
+
+
+/*
+ * Encrypts (opt 'E') or decrypts (opt 'D') a file into another one, which is
+ * removed on failure, with the keys cache and crypto engine of ctx (if not
+ * NULL). The files are mapped in memory, unless async is set or they can't
+ * be. Returns zero, a MZAE_ERR_* code or an ERR_* one.
+ */
+static int crypt_file(MZAE_CTX* ctx, char opt, char* password, char* in, char* out, int threads, int level, int async, long long* insize, unsigned long long* written)
+{
+    int err;
+
+    // The keys derived here are cached in ctx for the decryption
+    if (opt == 'D' && (err = check_file(ctx, password, in)))
+        return err;
+
+    if (!async) {
+        err = crypt_mapped(ctx, opt, password, in, out, threads, level, insize, written);
+        if (err != ERR_NOMAP)
+            return err;
+    }
+
+    return crypt_async(ctx, opt, password, in, out, threads, level, insize, written);
+}
+
+
+
+static const char* crypt_errmsg(int err)
+{
+    switch (err) {
+        case ERR_OPEN_IN: return "Couldn't open input file!";
+        case ERR_OPEN_OUT: return "Couldn't open output file!";
+        case ERR_READ: return "Error while reading the input file!";
+        case ERR_WRITE: return "Error while writing to the output file!";
+    }
+    return MZAE_errmsg(err);
+}
+
+
+
+// Seconds from an arbitrary origin, to measure elapsed times
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double) c.QuadPart / f.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+
+static int cpu_count(void)
+{
+    int n;
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    n = si.dwNumberOfProcessors;
+#else
+    n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1)
+        n = 1;
+    return n < MZAE_MAXTHREADS? n : MZAE_MAXTHREADS;
+}
+
+
+
+static int has_zip_ext(char* name)
+{
+    size_t l = strlen(name);
+
+    return l > 4 && name[l-4] == '.' && toupper(name[l-3]) == 'Z' &&
+        toupper(name[l-2]) == 'I' && toupper(name[l-1]) == 'P';
+}
+
+
+
+/*
+ * Adds a file to the batch: encrypted files get a ".zip" extension, which is
+ * removed when decrypting (or ".txt" is appended, if missing).
+ */
+static int add_job(JOBLIST* list, char opt, char* name)
+{
+    JOB *j;
+    size_t l = strlen(name);
+
+    if (list->count == list->max) {
+        j = (JOB*) realloc(list->jobs, (list->max? list->max*2 : 64) * sizeof(JOB));
+        if (!j)
+            return 1;
+        list->jobs = j;
+        list->max = list->max? list->max*2 : 64;
+    }
+
+    j = &list->jobs[list->count];
+    memset(j, 0, sizeof(JOB));
+    j->in = (char*) malloc(l + 1);
+    j->out = (char*) malloc(l + 5);
+    if (!j->in || !j->out) {
+        free(j->in);
+        free(j->out);
+        return 1;
+    }
+    strcpy(j->in, name);
+    strcpy(j->out, name);
+    if (opt == 'E')
+        strcat(j->out, ".zip");
+    else if (has_zip_ext(name))
+        j->out[l-4] = 0;
+    else
+        strcat(j->out, ".txt");
+
+    list->count++;
+    return 0;
+}
+
+
+
+/*
+ * Adds a file, or all the files inside a directory tree: ZIP archives found
+ * in directories are skipped when encrypting, and other files when decrypting
+ * or listing.
+ */
+static int add_path(JOBLIST* list, char opt, char* path, int explicit)
+{
+    char *sub;
+    int r = 0;
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE h;
+    DWORD attr = GetFileAttributesA(path);
+
+    if (attr == INVALID_FILE_ATTRIBUTES)
+        return explicit? add_job(list, opt, path) : 0;
+
+    if (!(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+        if (!explicit && has_zip_ext(path) != (opt != 'E'))
+            return 0;
+        return add_job(list, opt, path);
+    }
+
+    sub = (char*) malloc(strlen(path) + MAX_PATH + 2);
+    if (!sub)
+        return 1;
+    sprintf(sub, "%s\\*", path);
+    h = FindFirstFileA(sub, &fd);
+    if (h != INVALID_HANDLE_VALUE) {
+        do {
+            if (!strcmp(fd.cFileName, ".") || !strcmp(fd.cFileName, ".."))
+                continue;
+            sprintf(sub, "%s\\%s", path, fd.cFileName);
+            r = add_path(list, opt, sub, 0);
+        } while (!r && FindNextFileA(h, &fd));
+        FindClose(h);
+    }
+    free(sub);
+#else
+    struct stat st;
+    DIR *d;
+    struct dirent *e;
+
+    if (stat(path, &st))
+        return explicit? add_job(list, opt, path) : 0;
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (!S_ISREG(st.st_mode) || (!explicit && has_zip_ext(path) != (opt != 'E')))
+            return 0;
+        return add_job(list, opt, path);
+    }
+
+    d = opendir(path);
+    if (!d)
+        return 0;
+    while (!r && (e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        sub = (char*) malloc(strlen(path) + strlen(e->d_name) + 2);
+        if (!sub) {
+            r = 1;
+            break;
+        }
+        sprintf(sub, "%s/%s", path, e->d_name);
+        r = add_path(list, opt, sub, 0);
+        free(sub);
+    }
+    closedir(d);
+#endif
+    return r;
+}
+
+
+
+// Biggest files first, so that the last ones to finish are short
+static int by_size(const void* a, const void* b)
+{
+    long long sa = ((JOB*) a)->size, sb = ((JOB*) b)->size;
+
+    return sa < sb? 1 : sa > sb? -1 : 0;
+}
+
+
+
+static void run_job(void* arg)
+{
+    JOB *j = (JOB*) arg;
+    MZAE_CTX *ctx = 0;
+
+    // A context for each file, which keeps the keys derived by the password
+    // check, and the statistics
+    if (!MZAE_ctx_init(&ctx, 0) && j->verbose)
+        MZAE_ctx_stats(ctx, &j->stats);
+    j->err = crypt_file(ctx, j->opt, j->password, j->in, j->out, j->threads, j->level, j->async, &j->size, &j->written);
+    MZAE_ctx_end(ctx);
+
+    // A single call, so that lines from different workers don't mix
+    if (j->err)
+        printf("FAILED %s: %s\n", j->in, crypt_errmsg(j->err));
+    else
+        printf("OK     %s -> %s (%llu bytes)\n", j->in, j->out, j->written);
+}
+
+
+
+// Sums the statistics of the files of a batch (the peak is the largest one)
+static void add_stats(MZAE_STATS* total, MZAE_STATS* st)
+{
+    int i;
+
+    for (i = 0; i < MZAE_STAGES; i++) {
+        total->ns[i] += st->ns[i];
+        total->bytes[i] += st->bytes[i];
+    }
+    total->allocs += st->allocs;
+    if (st->peak > total->peak)
+        total->peak = st->peak;
+}
+
+
+
+/*
+ * Prints the time spent in each stage, and the memory used by the streams.
+ */
+static void print_stats(MZAE_STATS* st)
+{
+    static const char* names[MZAE_STAGES] = { "PBKDF2", "AES-CTR", "HMAC-SHA1", "Deflate",
+        "Inflate", "CRC32", "Reversal", "Output" };
+    int i;
+
+    printf("\n%-10s %12s %14s %10s\n", "Stage", "ms", "bytes", "MB/s");
+    for (i = 0; i < MZAE_STAGES; i++)
+        if (st->ns[i] || st->bytes[i])
+            printf("%-10s %12.3f %14llu %10.1f\n", names[i], st->ns[i] / 1e6, st->bytes[i],
+                st->ns[i]? st->bytes[i] * 1e9 / st->ns[i] / 1048576 : 0.0);
+    printf("%lu allocations, %llu bytes at most\n", st->allocs, st->peak);
+}
+
+
+
+/*
+ * Processes many files with a pool of workers: each idle worker takes the
+ * next file of the queue, so that small files don't wait for big ones.
+ */
+static int run_batch(char opt, char* password, char** paths, int npaths, int workers, int threads, int level, int verbose, int async)
+{
+    MZAE_STATS total;
+    JOBLIST list = {0, 0, 0};
+    MZAE_POOL *pool = 0;
+    FILE *f;
+    double t;
+    long long bytes = 0;
+    int i, failed = 0;
+
+    for (i = 0; i < npaths; i++)
+        if (add_path(&list, opt, paths[i], 1)) {
+            puts("Out of memory!");
+            return 1;
+        }
+
+    if (!list.count) {
+        puts("No files to process!");
+        return 1;
+    }
+
+    for (i = 0; i < list.count; i++) {
+        f = fopen(list.jobs[i].in, "rb");
+        if (f) {
+            fseek64(f, 0, SEEK_END);
+            list.jobs[i].size = ftell64(f);
+            fclose(f);
+        }
+    }
+    qsort(list.jobs, list.count, sizeof(JOB), by_size);
+
+    if (workers > list.count)
+        workers = list.count;
+
+    printf("%s %d files with %d workers...\n", opt == 'E'? "Encrypting" : "Decrypting", list.count, workers);
+
+    t = now();
+    if (MZAE_pool_create(&pool, workers))
+        pool = 0; // runs the jobs one at a time
+    for (i = 0; i < list.count; i++) {
+        list.jobs[i].opt = opt;
+        list.jobs[i].password = password;
+        list.jobs[i].threads = threads;
+        list.jobs[i].level = level;
+        list.jobs[i].verbose = verbose;
+        list.jobs[i].async = async;
+        if (MZAE_pool_submit(pool, run_job, &list.jobs[i], 0))
+            run_job(&list.jobs[i]);
+    }
+    MZAE_pool_destroy(pool);
+    t = now() - t;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < list.count; i++) {
+        if (list.jobs[i].err)
+            failed++;
+        else
+            bytes += list.jobs[i].size;
+        add_stats(&total, &list.jobs[i].stats);
+        free(list.jobs[i].in);
+        free(list.jobs[i].out);
+    }
+    free(list.jobs);
+
+    printf("%d files processed, %d failed: %lld bytes in %.3f s (%.1f MB/s)\n",
+        list.count - failed, failed, bytes, t, t > 0? bytes / t / 1048576 : 0.0);
+    if (verbose)
+        print_stats(&total);
+
+    return failed? 1 : 0;
+}
+
+
+
+/*
+ * Reads the metadata of an encrypted file from its head and tail only, with
+ * positional reads.
+ */
+static int probe_file(char* name, MZAE_INFO* info)
+{
+    MZAE_SOURCE source;
+    int err;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    HANDLE h;
+
+    h = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+    if (h == INVALID_HANDLE_VALUE)
+        return ERR_OPEN_IN;
+    if (!GetFileSizeEx(h, &size)) {
+        CloseHandle(h);
+        return ERR_READ;
+    }
+    source.opaque = h;
+    source.size = size.QuadPart;
+#else
+    struct stat st;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return ERR_OPEN_IN;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return ERR_READ;
+    }
+    source.opaque = &fd;
+    source.size = st.st_size;
+#endif
+    source.read = pos_read;
+
+    err = MZAE_probe(&source, 0, 0, info);
+
+#ifdef _WIN32
+    CloseHandle(h);
+#else
+    close(fd);
+#endif
+    return err;
+}
+
+
+
+static void run_probe(void* arg)
+{
+    JOB *j = (JOB*) arg;
+
+    j->err = probe_file(j->in, &j->info);
+}
+
+
+
+/*
+ * Lists the metadata of many encrypted files, probed by a pool of workers,
+ * in the order of the command line and of the directories.
+ */
+static int run_list(char** paths, int npaths, int workers)
+{
+    JOBLIST list = {0, 0, 0};
+    MZAE_POOL *pool = 0;
+    MZAE_INFO *in;
+    unsigned long d;
+    int i, failed = 0;
+
+    for (i = 0; i < npaths; i++)
+        if (add_path(&list, 'L', paths[i], 1)) {
+            puts("Out of memory!");
+            return 1;
+        }
+
+    if (!list.count) {
+        puts("No files to list!");
+        return 1;
+    }
+
+    if (workers > list.count)
+        workers = list.count;
+    if (MZAE_pool_create(&pool, workers))
+        pool = 0; // probes the files one at a time
+    for (i = 0; i < list.count; i++)
+        if (MZAE_pool_submit(pool, run_probe, &list.jobs[i], 0))
+            run_probe(&list.jobs[i]);
+    MZAE_pool_destroy(pool);
+
+    printf("%14s %14s %-5s %-7s %-7s %-2s %-16s %7s  %s\n", "Size", "Compressed", "AE", "Key", "Method",
+        "", "Modified", "Entries", "Name");
+    for (i = 0; i < list.count; i++) {
+        in = &list.jobs[i].info;
+        d = in->dosTime >> 16;
+        if (list.jobs[i].err) {
+            printf("FAILED %s: %s\n", list.jobs[i].in, crypt_errmsg(list.jobs[i].err));
+            failed++;
+        }
+        else
+            printf("%14llu %14llu AE-%d  AES-%d %-7s %-2s %04lu-%02lu-%02lu %02lu:%02lu %7llu  %s\n",
+                in->uncompSize, in->compSize, in->ae, in->keyBits, in->method? "Deflate" : "Stored",
+                in->flags? "V1" : "V2", 1980 + (d >> 9), (d >> 5) & 15, d & 31,
+                (in->dosTime >> 11) & 31, (in->dosTime >> 5) & 63, in->entries, list.jobs[i].in);
+        free(list.jobs[i].in);
+        free(list.jobs[i].out);
+    }
+    free(list.jobs);
+
+    printf("%d files listed, %d failed\n", list.count - failed, failed);
+
+    return failed? 1 : 0;
+}
+
+
+
+// Turns a path into an entry name: relative, with '/' separators
+static char* entry_name(char* path)
+{
+    char *p;
+
+    if (isalpha(path[0]) && path[1] == ':')
+        path += 2;
+    for (p = path; *p; p++)
+        if (*p == '\\')
+            *p = '/';
+    for (;;) {
+        if (!strncmp(path, "./", 2))
+            path += 2;
+        else if (!strncmp(path, "../", 3))
+            path += 3;
+        else if (*path == '/')
+            path++;
+        else
+            return path;
+    }
+}
+
+
+
+/*
+ * Stores many files and directory trees in a single archive, one entry for
+ * each file, named after its path.
+ */
+static int zip_files(MZAE_CTX* ctx, char* password, char* archive, char** paths, int npaths, int threads, int level, unsigned long long* written)
+{
+    JOBLIST list = {0, 0, 0};
+    MZAE_ZIP *z = 0;
+    MZAE_STREAM *s;
+    MZAE_SINK sink;
+    AIO ai, ao;
+    char *buf;
+    unsigned int n;
+    int i, in, out = 0, err = 0;
+
+    for (i = 0; i < npaths; i++)
+        if (add_path(&list, 'E', paths[i], 1)) {
+            err = MZAE_ERR_NOMEM;
+            break;
+        }
+
+    // The archive is written behind across all the files
+    if (!err)
+        out = !(err = aio_open(&ao, archive, 1, 0));
+
+    sink.opaque = &ao;
+    sink.write = aio_write;
+    if (!err)
+        err = MZAE_zip_create(&z, ctx, &sink);
+
+    for (i = 0; !err && i < list.count; i++) {
+        s = 0;
+        in = !(err = aio_open(&ai, list.jobs[i].in, 0, 0));
+        if (!err)
+            err = MZAE_zip_add(z, entry_name(list.jobs[i].in), password, &s);
+        if (!err && threads)
+            err = MZAE_stream_setopt(s, MZAE_OPT_THREADS, threads);
+        if (!err && level != MZAE_LEVEL)
+            err = MZAE_stream_setopt(s, MZAE_OPT_LEVEL, level);
+        if (!err && ai.size >= MZAE_ZIP64_SIZE)
+            err = MZAE_stream_setopt(s, MZAE_OPT_ZIP64, 1);
+        while (!err && (n = aio_next(&ai, &buf)))
+            err = MZAE_write_update(s, buf, n);
+        if (!err && ai.err)
+            err = ERR_READ;
+        if (s) {
+            if (!err)
+                err = MZAE_write_final(s, &list.jobs[i].written);
+            else
+                MZAE_write_final(s, 0);
+        }
+        if (in)
+            aio_close(&ai);
+
+        if (err)
+            printf("FAILED %s: %s\n", list.jobs[i].in, crypt_errmsg(err));
+        else
+            printf("OK     %s (%llu bytes)\n", list.jobs[i].in, list.jobs[i].written);
+    }
+
+    if (z) {
+        if (!err)
+            err = MZAE_zip_close(z, written);
+        else
+            MZAE_zip_close(z, 0);
+    }
+
+    if (!err && !list.count)
+        err = ERR_OPEN_IN;
+
+    for (i = 0; i < list.count; i++) {
+        free(list.jobs[i].in);
+        free(list.jobs[i].out);
+    }
+    free(list.jobs);
+
+    if (out && aio_flush(&ao) && !err)
+        err = ERR_WRITE;
+    if (out && err)
+        remove(archive);
+
+    return err;
+}
+
+
+
+// Extracts a single entry of an archive, reading only its own data
+static int unzip_file(MZAE_CTX* ctx, char* password, char* archive, char* name, char* out, unsigned long long* written)
+{
+    MZAE_SOURCE source;
+    MZAE_SINK sink;
+    FILE *fi;
+    AIO ao;
+    int err;
+
+    fi = fopen(archive, "rb");
+    if (! fi)
+        return ERR_OPEN_IN;
+
+    fseek64(fi, 0, SEEK_END);
+    source.opaque = fi;
+    source.read = file_read;
+    source.size = ftell64(fi);
+
+    // A wrong password leaves no output behind
+    if ((err = MZAE_check_password(&source, ctx, name, password))) {
+        fclose(fi);
+        return err;
+    }
+
+    if ((err = aio_open(&ao, out, 1, 0))) {
+        fclose(fi);
+        return err;
+    }
+    sink.opaque = &ao;
+    sink.write = aio_write;
+
+    err = MZAE_zip_read(&source, ctx, name, password, &sink, written);
+
+    fclose(fi);
+    if (aio_flush(&ao) && !err)
+        err = ERR_WRITE;
+    if (err)
+        remove(out);
+
+    return err;
+}
+
+
+
+// Attaches the statistics to a context; returns zero if they are not built in
+static int start_stats(MZAE_CTX* ctx, MZAE_STATS* stats)
+{
+    int err;
+
+    memset(stats, 0, sizeof(MZAE_STATS));
+    if ((err = ctx? MZAE_ctx_stats(ctx, stats) : MZAE_ERR_NOMEM)) {
+        printf("/V ignored: %s\n", MZAE_errmsg(err));
+        return 0;
+    }
+    return 1;
+}
+
+
+
+// Tells if the library collects statistics, with a throwaway context
+static int check_stats(void)
+{
+    MZAE_CTX *ctx;
+    MZAE_STATS stats;
+    int ok;
+
+    if (MZAE_ctx_init(&ctx, 0))
+        return 1;
+    ok = start_stats(ctx, &stats);
+    MZAE_ctx_end(ctx);
+    return !ok;
+}
+
+
+
 int main(int argc, char** argv)
 {
-    char opt = 0, *buf=0, *dst;
-    int pm, found=1, err;
-    long size, reqsize;
-    FILE *fi, *fo;
+    char opt = 0;
+    int pm, found=1, err, threads = 0, workers = 0, level = MZAE_LEVEL, zip = 0, verbose = 0, async = 0;
+    long long size;
+    unsigned long long reqsize = 0;
+    MZAE_CTX *ctx = 0;
+    MZAE_STATS stats;
 
     for (pm=1; pm < argc; pm++)
     {
@@ -34,15 +1582,82 @@ int main(int argc, char** argv)
 
         if (argv[pm][1] == '?') {
             printf( "Decrypts or encrypts a text file into a compatible ZIP archive.\n\n" \
-            "CRYPTOCMD /D | /E password infile outfile\n\n" \
+            "CRYPTOCMD /D | /E [/A] [/T:n] [/C:n] [/V] password infile outfile\n" \
+            "CRYPTOCMD /D | /E /B[:n] [/A] [/T:n] [/C:n] [/V] password file|directory ...\n" \
+            "CRYPTOCMD /E /Z [/T:n] [/C:n] [/V] password archive file|directory ...\n" \
+            "CRYPTOCMD /D /Z [/V] password archive entry outfile\n" \
+            "CRYPTOCMD /L [/B:n] file|directory ...\n\n" \
             "  /D         decrypts\n" \
-            "  /E         encrypts\n" );
+            "  /E         encrypts\n" \
+            "  /L         lists size, key strength and date of encrypted files,\n" \
+            "             reading their headers only (with /B:n workers, default:\n" \
+            "             4 per CPU)\n" \
+            "  /C:n       compression level, from 1 (fastest) to 9 (smallest), or 0\n" \
+            "             to store the text uncompressed (default: %d)\n" \
+            "  /T:n       uses n threads to encrypt/decrypt and authenticate\n" \
+            "  /A         reads ahead and writes behind with asynchronous I/O (io_uring\n" \
+            "             on Linux, else worker threads), instead of mapping the files\n" \
+            "  /B:n       processes many files and directory trees with n workers\n" \
+            "             (default: one per CPU); encrypting, \".zip\" is appended\n" \
+            "             to each name, decrypting it is removed\n" \
+            "  /Z         encrypts many files and directory trees into a single\n" \
+            "             archive, or decrypts one of its entries\n" \
+            "  /V         prints the time spent in each stage and the memory used\n" \
+            "             (if the library was built with MZAE_PROFILE)\n", MZAE_LEVEL );
             return 1;
         }
 
+        if (toupper(argv[pm][1]) == 'T') {
+            found++;
+            threads = atoi(argv[pm] + (argv[pm][2] == ':'? 3 : 2));
+            if (threads < 0 || threads > MZAE_MAXTHREADS) {
+                printf("The number of threads must be between 0 and %d!\n", MZAE_MAXTHREADS);
+                return 1;
+            }
+            continue;
+        }
+
+        if (toupper(argv[pm][1]) == 'C') {
+            found++;
+            level = atoi(argv[pm] + (argv[pm][2] == ':'? 3 : 2));
+            if (level < 0 || level > 9) {
+                puts("The compression level must be between 0 and 9!");
+                return 1;
+            }
+            continue;
+        }
+
+        if (toupper(argv[pm][1]) == 'B') {
+            found++;
+            workers = argv[pm][2] == ':'? atoi(argv[pm] + 3) : cpu_count();
+            if (workers < 1 || workers > MZAE_MAXTHREADS) {
+                printf("The number of workers must be between 1 and %d!\n", MZAE_MAXTHREADS);
+                return 1;
+            }
+            continue;
+        }
+
+        if (toupper(argv[pm][1]) == 'Z') {
+            found++;
+            zip = 1;
+            continue;
+        }
+
+        if (toupper(argv[pm][1]) == 'V') {
+            found++;
+            verbose = 1;
+            continue;
+        }
+
+        if (toupper(argv[pm][1]) == 'A') {
+            found++;
+            async = 1;
+            continue;
+        }
+
         opt = toupper(argv[pm][1]);
 
-        if (opt == 'E' || opt == 'D') {
+        if (opt == 'E' || opt == 'D' || opt == 'L') {
             found++;
             continue;
         }
@@ -51,86 +1666,78 @@ int main(int argc, char** argv)
     argv+=found;
     argc-=found;
 
-    if (opt != 'D' && opt != 'E') {
-        puts("You must specify /D or /E to decrypt or encrypt!");
-        return 1;
-    }
-
-    if (argc < 3) {
-        puts("You must specify a password, a source and a destination file to decrypt or encrypt!");
-        return 1;
-    }
-
-    fi = fopen(argv[1], "rb");
-    if (! fi) {
-        puts("Couldn't open input file!");
+    if (opt != 'D' && opt != 'E' && opt != 'L') {
+        puts("You must specify /D or /E to decrypt or encrypt, or /L to list!");
         return 1;
     }
-    fo = fopen(argv[2], "wb");
-    if (! fo) {
-        puts("Couldn't open output file!");
-        fclose(fi);
-        return 1;
-    }
-
-    fseek(fi, 0, SEEK_END);
-    size = ftell(fi);
-    fseek(fi, 0, SEEK_SET);
-    buf = (char*) malloc(size);
 
-    if (!size || !buf || (fread(buf, 1, size, fi) != size)) {
-        puts("Error while reading the input file!");
-        fclose(fi);
-        fclose(fo);
-        return 1;
+    if (opt == 'L') {
+        if (argc < 1) {
+            puts("You must specify the files or directories to list!");
+            return 1;
+        }
+        // Probes mostly wait for the disk
+        if (!workers)
+            workers = cpu_count() * 4 < MZAE_MAXTHREADS? cpu_count() * 4 : MZAE_MAXTHREADS;
+        return run_list(argv, argc, workers);
     }
-    
-    fclose(fi);
 
-    if (opt == 'E') {
-        reqsize = 0;
-        err = MiniZipAE1Write(buf, size, &dst, &reqsize, argv[0]);
-        if (err != MZAE_ERR_SUCCESS) {
-            printf("Error while computating the buffer size: %s", MZAE_errmsg(err));
-            fclose(fo);
+    if (zip) {
+        if (workers) {
+            puts("/B and /Z can't be used together!");
             return 1;
         }
-        dst = (char*) malloc(reqsize);
-        err = MiniZipAE1Write(buf, size, &dst, &reqsize, argv[0]);
-        if (err != MZAE_ERR_SUCCESS) {
-            printf("Error while generating the encrypted file: %s", MZAE_errmsg(err));
-            fclose(fo);
+        if (argc < (opt == 'E'? 3 : 4)) {
+            puts(opt == 'E'? "You must specify a password, the archive and the files or directories to encrypt!" :
+                "You must specify a password, the archive, the entry to decrypt and a destination file!");
             return 1;
         }
-        printf("Encrypting... ");
+        printf(opt == 'E'? "Encrypting...\n" : "Decrypting... ");
+        // The crypto library is set up once for all the entries
+        if (MZAE_ctx_init(&ctx, 0))
+            ctx = 0;
+        if (verbose)
+            verbose = start_stats(ctx, &stats);
+        if (opt == 'E')
+            err = zip_files(ctx, argv[0], argv[1], argv + 2, argc - 2, threads, level, &reqsize);
+        else
+            err = unzip_file(ctx, argv[0], argv[1], argv[2], argv[3], &reqsize);
     }
-
-    if (opt == 'D') {
-        reqsize = 0;
-        err = MiniZipAE1Read(buf, size, &dst, &reqsize, argv[0]);
-        if (err != MZAE_ERR_SUCCESS) {
-            printf("Error while computating the buffer size: %s", MZAE_errmsg(err));
-            fclose(fo);
+    else if (workers) {
+        if (argc < 2) {
+            puts("You must specify a password and the files or directories to decrypt or encrypt!");
             return 1;
         }
-        dst = (char*) malloc(reqsize);
-        err = MiniZipAE1Read(buf, size, &dst, &reqsize, argv[0]);
-        if (err != MZAE_ERR_SUCCESS) {
-            printf("Error while extracting the encrypted file: %s", MZAE_errmsg(err));
-            fclose(fo);
+        if (verbose && check_stats())
+            verbose = 0;
+        return run_batch(opt, argv[0], argv + 1, argc - 1, workers, threads, level, verbose, async);
+    }
+    else {
+        if (argc < 3) {
+            puts("You must specify a password, a source and a destination file to decrypt or encrypt!");
             return 1;
         }
-        printf("Decrypting... ");
+        printf(opt == 'E'? "Encrypting... " : "Decrypting... ");
+        if (MZAE_ctx_init(&ctx, 0))
+            ctx = 0;
+        if (verbose)
+            verbose = start_stats(ctx, &stats);
+        err = crypt_file(ctx, opt, argv[0], argv[1], argv[2], threads, level, async, &size, &reqsize);
     }
 
-    if (fwrite(dst, 1, reqsize, fo) != reqsize) {
-        puts("Error while writing to the output file!");
-        fclose(fo);
+    MZAE_ctx_end(ctx);
+
+    if (err < 0) {
+        puts(crypt_errmsg(err));
+        return 1;
+    }
+    if (err != MZAE_ERR_SUCCESS) {
+        printf("Error while %s the encrypted file: %s", opt == 'E'? "generating" : "extracting", MZAE_errmsg(err));
         return 1;
     }
 
-    fclose(fo);
-
-    printf("done, %d bytes written.", reqsize);
+    printf("done, %llu bytes written.", reqsize);
+    if (verbose)
+        print_stats(&stats);
     return 0;
 }
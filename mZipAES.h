@@ -22,7 +22,8 @@
    A micro reader & writer for AES encrypted ZIP archives.
 
    Functions are provided to create in memory a deflated and AES-256 encrypted
-   ZIP archive from a single input, and to extract from such an archive.
+   ZIP archive from a single input, and to extract from such an archive;
+   archives of many entries can be written and read one entry at a time.
 
    Zlib is required to support Deflate algorithm.
    
@@ -52,6 +53,163 @@ extern "C" {
 #define MZAE_ERR_BADHMAC			11
 #define MZAE_ERR_BADCRC				12
 #define MZAE_ERR_NOPW				13
+#define MZAE_ERR_SINK				14
+#define MZAE_ERR_NOENTRY			15
+#define MZAE_ERR_SOURCE				16
+#define MZAE_ERR_COMPRESSED			17
+#define MZAE_ERR_TOOBIG				18
+#define MZAE_ERR_NOSTATS			19
+
+// Size of the chunks processed at once by the streaming functions
+#define MZAE_CHUNK				65536
+
+// Bytes encrypted and authenticated at once by MZAE_ctr_hmac_update, while in L1 cache
+#define MZAE_FUSED_BLOCK			8192
+
+// Bytes handed at once to the worker threads, and the maximum number of them
+#define MZAE_MT_JOB				1048576
+#define MZAE_MAXTHREADS				64
+
+// Text compressed at once by each worker (with the preceding 32K as dictionary)
+#define MZAE_DZ_BLOCK				262144
+
+// Derived keys kept by default in the cache of a context
+#define MZAE_KEYCACHE				16
+
+// Bytes of released blocks kept by default in the arena of a context
+#define MZAE_ARENA				16777216
+
+// Documents written with a ZIP64 local header from this size on, since they
+// could exceed 4 GiB once compressed (stored, at worst)
+#define MZAE_ZIP64_SIZE				0xFF000000UL
+
+// Default compression level (1 = fastest, 9 = best, 0 = stored)
+#define MZAE_LEVEL				8
+
+// Streaming flags
+#define MZAE_FLAG_V1				1	// text is not reversed (old V1 format)
+
+// Ranged reading flags
+#define MZAE_RANGE_DEFER			1	// the HMAC is verified by MZAE_range_verify
+#define MZAE_RANGE_BACKGROUND			2	// the HMAC is verified by a worker thread meanwhile
+
+// Streaming options
+#define MZAE_OPT_THREADS			1	// worker threads for AES-CTR and HMAC (0 = none)
+#define MZAE_OPT_LEVEL				2	// compression level (0 = stored)
+#define MZAE_OPT_ZIP64				3	// ZIP64 local header, for entries over 4 GiB
+
+// Stages measured in MZAE_STATS
+#define MZAE_STAGE_KDF				0	// keys derivation (PBKDF2)
+#define MZAE_STAGE_CTR				1	// AES-CTR
+#define MZAE_STAGE_HMAC				2	// HMAC-SHA1
+#define MZAE_STAGE_DEFLATE			3
+#define MZAE_STAGE_INFLATE			4
+#define MZAE_STAGE_CRC				5
+#define MZAE_STAGE_REV				6	// reversal of V2 text
+#define MZAE_STAGE_SINK				7	// output written by the sink
+#define MZAE_STAGES				8
+
+
+
+/*
+	Receives the output of the streaming functions.
+	
+	opaque		caller data passed back to write
+	write		stores len bytes from buf at the given absolute offset of the
+			destination (the ZIP archive or the extracted document) and
+			returns zero for success. Offsets are not always increasing: the
+			writer patches the local header at offset zero at the end, and
+			the reader fills a V2 document from its end backwards.
+*/
+typedef struct {
+	void* opaque;
+	int (*write)(void* opaque, unsigned long long offset, char* buf, unsigned int len);
+} MZAE_SINK;
+
+/*
+	Supplies an archive to the functions that read it at random offsets.
+
+	opaque		caller data passed back to read
+	read		fills buf with len bytes from the given absolute offset of
+			the archive and returns zero for success
+	size		length of the archive
+*/
+typedef struct {
+	void* opaque;
+	int (*read)(void* opaque, unsigned long long offset, char* buf, unsigned int len);
+	unsigned long long size;
+} MZAE_SOURCE;
+
+// An entry of an archive, as found in its central directory
+typedef struct {
+	unsigned long long offset;	// of its local header
+	unsigned long long compSize;	// salt, check word, encrypted data and HMAC
+	unsigned long long uncompSize;
+	int flags;			// zero (V2 document) or MZAE_FLAG_V1
+} MZAE_ENTRY;
+
+// Metadata of an entry, from its local header and the end record (see MZAE_probe)
+typedef struct {
+	unsigned long long compSize;	// encrypted data, without salt, check word and HMAC
+	unsigned long long uncompSize;
+	unsigned long long entries;	// entries of the archive
+	unsigned long crc;		// CRC-32 of the text (zero in AE-2)
+	unsigned long dosTime;		// last change: MS-DOS date (high word) and time
+	int ae;				// 1 (AE-1) or 2 (AE-2)
+	int keyBits;			// AES key strength: 128, 192 or 256
+	int method;			// 8 (Deflate) or 0 (stored)
+	int flags;			// zero (V2 document) or MZAE_FLAG_V1
+} MZAE_INFO;
+
+/*
+	Statistics of the streams of a context (see MZAE_ctx_stats). The time of
+	a stage doesn't include the stages it feeds (e.g. Deflate doesn't include
+	the encryption of its output). The work of the worker threads is summed,
+	so it can exceed the elapsed time.
+*/
+typedef struct {
+	unsigned long long ns[MZAE_STAGES];	// nanoseconds spent in each stage
+	unsigned long long bytes[MZAE_STAGES];	// bytes processed by each stage
+	unsigned long allocs;			// memory blocks allocated by the streams (not taken from the arena)
+	unsigned long long held;		// bytes they hold now
+	unsigned long long peak;		// highest value of held
+} MZAE_STATS;
+
+// Opaque state of a streaming write or read
+typedef struct MZAE_STREAM MZAE_STREAM;
+
+// Opaque state of a multi-entry archive being written
+typedef struct MZAE_ZIP MZAE_ZIP;
+
+// Opaque state of the ranged reading of an entry
+typedef struct MZAE_RANGE MZAE_RANGE;
+
+// Opaque context shared by the operations of a thread (derived keys cache)
+typedef struct MZAE_CTX MZAE_CTX;
+
+/*
+	Supplies the memory of a context and of its streams (see MZAE_ctx_init_ex).
+
+	opaque		caller data passed back to alloc and release
+	alloc		returns a block of size bytes, or NULL (malloc if NULL)
+	release		frees a block from alloc (free if NULL)
+	arena		bytes of released blocks kept by the context, and reused
+			by the next streams instead of allocating them again (zero
+			releases them at once)
+*/
+typedef struct {
+	void* opaque;
+	void* (*alloc)(void* opaque, unsigned long size);
+	void (*release)(void* opaque, void* p);
+	unsigned long arena;
+} MZAE_ALLOCATOR;
+
+// Receives a chunk of data produced by an incremental codec
+typedef int (*MZAE_OUTFN)(void* opaque, char* buf, unsigned int len);
+
+// Pool of worker threads, and the tasks it runs
+typedef struct MZAE_POOL MZAE_POOL;
+typedef void (*MZAE_TASKFN)(void* arg);
 
 
 
@@ -71,16 +229,27 @@ char* MZAE_errmsg(int code);
 	src		uncompressed data to archive
 	srcLen		length of src buffer
 	dst		pre allocated buffer receiving the resulting ZIP archive
-	dstLen		length of dst buffer
+	dstLen		length of dst buffer, receives the archive length
 	password	ASCII password used to encrypt
 
 	Returns zero for success.
-	If called with dstLen set to zero, fills it with the required number of bytes.
+	If called with dstLen set to zero, fills it with MiniZipAEWriteBound(srcLen)
+	without compressing anything: the archive is built in a single pass.
+	Data that look incompressible are stored (method 0), as well as data that
+	Deflate could not shrink (which are encrypted again).
 */
 int MiniZipAEWrite(char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password);
 
 
 
+/*
+	Returns the maximum length of the archive created by MiniZipAEWrite from
+	srcLen bytes, i.e. a buffer size that is always sufficient.
+*/
+unsigned long MiniZipAEWriteBound(unsigned long srcLen);
+
+
+
 /*
 	Extracts in memory the single file from a Deflated and AES encrypted ZIP
 	archive created with MiniZipAEWrite function (accepts any key strength).
@@ -98,15 +267,478 @@ int MiniZipAERead(char* src, unsigned long srcLen, char** dst, unsigned long *ds
 
 
 
+/*
+	Creates a context that caches the keys derived from each (password, salt)
+	pair, so that reading again a document, or one written with the same
+	context, skips the 1000 PBKDF2 rounds. When the cache is full, the least
+	recently used keys are wiped. The context also owns an engine of the
+	cryptographic library (MZAE_engine_init), set up once for all the
+	documents processed with it, and an arena of MZAE_ARENA bytes, where the
+	memory released by its streams waits for the next ones.
+
+	ctx		pointer receiving the context
+	entries		maximum number of cached keys (zero for MZAE_KEYCACHE)
+
+	A context must not be used by more threads at once.
+	Returns zero for success.
+*/
+int MZAE_ctx_init(MZAE_CTX** ctx, int entries);
+
+
+
+/*
+	Same as MZAE_ctx_init, taking all the memory of the context and of the
+	streams started with it (including those of MiniZipAEWriteCtx,
+	MiniZipAEReadCtx, the archive and the ranged functions) from allocator.
+	With allocator NULL, the memory comes from malloc and an arena of
+	MZAE_ARENA bytes is kept. The states of the cryptographic library and of
+	the Deflate module still use their own allocators.
+
+	ctx		pointer receiving the context
+	entries		maximum number of cached keys (zero for MZAE_KEYCACHE)
+	allocator	copied in the context, or NULL
+
+	Returns zero for success.
+*/
+int MZAE_ctx_init_ex(MZAE_CTX** ctx, int entries, MZAE_ALLOCATOR* allocator);
+
+
+
+/*
+	Wipes the cached keys and releases a context, with its arena.
+*/
+void MZAE_ctx_end(MZAE_CTX* ctx);
+
+
+
+/*
+	Makes the streams started from now on with a context (including those of
+	MiniZipAEWriteCtx, MiniZipAEReadCtx and the archive functions) add their
+	statistics to stats, until it is called again with NULL. The library
+	must be built with MZAE_PROFILE defined, else the statistics cost nothing
+	and MZAE_ERR_NOSTATS is returned.
+
+	ctx		context from MZAE_ctx_init
+	stats		zeroed by the caller, or NULL to stop
+
+	Returns zero for success.
+*/
+int MZAE_ctx_stats(MZAE_CTX* ctx, MZAE_STATS* stats);
+
+
+
+/*
+	Same as MiniZipAEWrite and MiniZipAERead, looking up and storing the
+	derived keys in the cache of ctx (if not NULL). A new random salt is
+	always generated by MiniZipAEWriteCtx.
+*/
+int MiniZipAEWriteCtx(MZAE_CTX* ctx, char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password);
+int MiniZipAEReadCtx(MZAE_CTX* ctx, char* src, unsigned long srcLen, char** dst, unsigned long *dstLen, char* password);
+
+
+
+/*
+	Same as MZAE_write_init and MZAE_read_init, with the key cache and the
+	engine of ctx (if not NULL).
+*/
+int MZAE_write_init_ex(MZAE_CTX* ctx, MZAE_STREAM** s, char* password, int flags, MZAE_SINK* sink);
+int MZAE_read_init_ex(MZAE_CTX* ctx, MZAE_STREAM** s, char* password, int flags, MZAE_SINK* sink);
+
+
+
+/*
+	Starts creating a Deflated and AES-256 encrypted ZIP archive, fed by
+	chunks of arbitrary size through MZAE_write_update, in bounded memory.
+	The unique archived file name defaults to "data".
+
+	s		pointer receiving the stream state
+	password	ASCII password used to encrypt
+	flags		zero (V2 document) or MZAE_FLAG_V1
+	sink		receives the archive bytes
+
+	With V2 documents (the default), the chunks must be supplied from the
+	end of the document towards its beginning, since the text is stored
+	reversed.
+
+	Returns zero for success.
+*/
+int MZAE_write_init(MZAE_STREAM** s, char* password, int flags, MZAE_SINK* sink);
+
+
+
+/*
+	Compresses, encrypts and authenticates the next chunk of the document.
+
+	s		stream state from MZAE_write_init
+	src		chunk of uncompressed data
+	srcLen		its length
+
+	Returns zero for success. After an error, MZAE_write_final must be called
+	anyway to release the stream.
+*/
+int MZAE_write_update(MZAE_STREAM* s, char* src, unsigned long srcLen);
+
+
+
+/*
+	Completes the archive, rewriting its local header with the final CRC and
+	sizes, and releases the stream.
+
+	s		stream state from MZAE_write_init
+	dstLen		if not NULL, receives the archive length
+
+	Returns zero for success, or the first error met by the stream.
+*/
+int MZAE_write_final(MZAE_STREAM* s, unsigned long long *dstLen);
+
+
+
+/*
+	Starts extracting the single file from a ZIP archive created with
+	MiniZipAEWrite or MZAE_write_init, fed by chunks of arbitrary size through
+	MZAE_read_update, in bounded memory.
+
+	s		pointer receiving the stream state
+	password	ASCII password required to decrypt
+	flags		zero (V2 document, ending with "R" comment) or MZAE_FLAG_V1
+	sink		receives the extracted document
+
+	Decrypted data reach the sink before the HMAC is verified at the end:
+	if MZAE_read_final fails, the output must be discarded.
+
+	Returns zero for success.
+*/
+int MZAE_read_init(MZAE_STREAM** s, char* password, int flags, MZAE_SINK* sink);
+
+
+
+/*
+	Authenticates, decrypts and inflates the next chunk of the archive.
+
+	s		stream state from MZAE_read_init
+	src		chunk of the archive
+	srcLen		its length
+
+	Returns zero for success. After an error, MZAE_read_final must be called
+	anyway to release the stream.
+*/
+int MZAE_read_update(MZAE_STREAM* s, char* src, unsigned long srcLen);
+
+
+
+/*
+	Verifies HMAC, CRC and length of the extracted document and releases the
+	stream.
+
+	s		stream state from MZAE_read_init
+	dstLen		if not NULL, receives the extracted document length
+
+	Returns zero for success, or the first error met by the stream.
+*/
+int MZAE_read_final(MZAE_STREAM* s, unsigned long long *dstLen);
+
+
+
+/*
+	Starts writing an archive of many entries, each one a Deflated and AES-256
+	encrypted file (not reversed, like MZAE_FLAG_V1), indexed by a central
+	directory.
+
+	z		pointer receiving the archive state
+	ctx		context caching the derived keys, or NULL
+	sink		receives the archive bytes
+
+	Returns zero for success.
+*/
+int MZAE_zip_create(MZAE_ZIP** z, MZAE_CTX* ctx, MZAE_SINK* sink);
+
+
+
+/*
+	Adds an entry to the archive, returning a stream that takes its contents
+	through MZAE_write_update and MZAE_write_final (which reports the entry
+	length). Only one entry at a time can be written.
+
+	z		archive state from MZAE_zip_create
+	name		name of the entry, with '/' separating the directories
+	password	ASCII password used to encrypt the entry
+	s		pointer receiving the stream state
+
+	Returns zero for success.
+*/
+int MZAE_zip_add(MZAE_ZIP* z, char* name, char* password, MZAE_STREAM** s);
+
+
+
+/*
+	Writes central directory and end record, and releases the archive state.
+
+	z		archive state from MZAE_zip_create
+	dstLen		if not NULL, receives the archive length
+
+	Returns zero for success, or the first error met by the entries.
+*/
+int MZAE_zip_close(MZAE_ZIP* z, unsigned long long *dstLen);
+
+
+
+/*
+	Looks for an entry in the central directory of an archive, reading only
+	its end record and central directory, by chunks.
+
+	source		supplies the archive
+	ctx		context whose allocator gives the buffers, or NULL
+	name		name of the entry
+	entry		receives position and sizes of the entry
+
+	Returns zero for success, or MZAE_ERR_NOENTRY if the entry is missing.
+*/
+int MZAE_zip_find(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, MZAE_ENTRY* entry);
+
+
+
+/*
+	Extracts a single entry from an archive: after MZAE_zip_find, reads only
+	the local header and the data of the entry.
+
+	source		supplies the archive
+	ctx		context caching the derived keys, or NULL
+	name		name of the entry
+	password	ASCII password required to decrypt
+	sink		receives the extracted file
+	dstLen		if not NULL, receives the extracted file length
+
+	As with MZAE_read_init, if it fails the output must be discarded.
+	Returns zero for success.
+*/
+int MZAE_zip_read(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, char* password, MZAE_SINK* sink, unsigned long long *dstLen);
+
+
+
+/*
+	Same as MiniZipAERead, extracting the entry called name from an archive
+	in memory with many entries.
+*/
+int MiniZipAEReadEntry(char* src, unsigned long srcLen, char* name, char** dst, unsigned long *dstLen, char* password);
+
+
+
+/*
+	Opens a stored (method 0) entry for reading any byte range of it: the
+	keys are derived once, and each range is decrypted alone by moving the
+	AES-CTR counter to its first block.
+
+	r		pointer receiving the ranged reading state
+	source		supplies the archive
+	ctx		context caching the derived keys, or NULL
+	name		name of the entry ("data" for a single document)
+	password	ASCII password required to decrypt
+	flags		zero verifies the HMAC of the whole entry before returning;
+			MZAE_RANGE_DEFER leaves it to MZAE_range_verify;
+			MZAE_RANGE_BACKGROUND starts it on a worker thread, which
+			reads the source while the caller does (so its read function
+			must allow concurrent calls)
+
+	Until the HMAC is verified, the ranges read are not authenticated.
+	Returns zero for success, or MZAE_ERR_COMPRESSED if the entry is deflated.
+*/
+int MZAE_range_open(MZAE_RANGE** r, MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, char* password, int flags);
+
+
+
+/*
+	Reads and decrypts len bytes of the entry, from offset of the extracted
+	file (V2 documents are reversed back).
+
+	r		state from MZAE_range_open
+	offset		offset of the range in the extracted file
+	dst		buffer receiving the range
+	len		length of the range
+
+	A state must not be used by more threads at once.
+	Returns zero for success.
+*/
+int MZAE_range_read(MZAE_RANGE* r, unsigned long long offset, char* dst, unsigned int len);
+
+
+
+/*
+	Verifies the HMAC of the whole entry (or waits for the background
+	verification to end). Later calls return the same result.
+
+	Returns zero if the entry is authentic.
+*/
+int MZAE_range_verify(MZAE_RANGE* r);
+
+
+
+/*
+	Returns the length of the extracted file.
+*/
+unsigned long long MZAE_range_size(MZAE_RANGE* r);
+
+
+
+/*
+	Waits for the background verification, if any, wipes the keys and
+	releases the state.
+*/
+void MZAE_range_close(MZAE_RANGE* r);
+
+
+
+/*
+	Checks a password against the verification value of an entry, reading
+	only its local header, salt and verification value (63 bytes for a
+	document from MiniZipAEWrite), plus the central directory if name is
+	given. Nothing is decrypted: a wrong password is rejected without
+	reading or mapping the whole archive. The derived keys are cached in ctx
+	(if not NULL), so that reading the entry afterwards with the same
+	context doesn't derive them again.
+
+	source		the archive
+	ctx		context from MZAE_ctx_init, or NULL
+	name		name of the entry, or NULL for the one at offset zero
+	password	password to check
+
+	Returns zero if the password matches, MZAE_ERR_BADVV if not. The value
+	has 16 bits only: about one wrong password in 65536 passes the check,
+	and is rejected by the HMAC when the entry is read.
+*/
+int MZAE_check_password(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, char* password);
+
+
+
+/*
+	Same as MZAE_check_password, on a document from MiniZipAEWrite in memory:
+	srcLen may be just the length of its first bytes.
+*/
+int MiniZipAECheck(char* src, unsigned long srcLen, char* password);
+
+
+
+/*
+	Reads the metadata of an entry without a password: the end record, from
+	the tail of the archive, and the local header of the entry, from its
+	head. The central directory is read only if name is given.
+
+	source		the archive
+	ctx		context whose allocator gives the buffers, or NULL
+	name		name of the entry, or NULL for the one at offset zero (e.g. a
+			document from MiniZipAEWrite)
+	info		receives the metadata
+
+	Returns zero for success.
+*/
+int MZAE_probe(MZAE_SOURCE* source, MZAE_CTX* ctx, char* name, MZAE_INFO* info);
+
+
+
+/*
+	Sets an option of a stream, before the data it applies to are fed.
+
+	s		stream state from MZAE_write_init or MZAE_read_init
+	option		MZAE_OPT_THREADS: value is the number of worker threads
+			(up to MZAE_MAXTHREADS) that encrypt, decrypt and authenticate
+			the data in blocks of MZAE_MT_JOB bytes, while the caller
+			thread compresses or decompresses the next (or previous) block;
+			when writing, the workers also compress blocks of
+			MZAE_DZ_BLOCK bytes in parallel, if the Deflate engine can;
+			zero (the default) does everything in the caller thread
+			MZAE_OPT_LEVEL: value is the compression level, from 1
+			(fastest) to 9 (smallest), or 0 to store the text without
+			compression (method 0); writer only, before any data is fed.
+			The writer also stores the text if the first chunk fed to it
+			looks incompressible (nearly random bytes)
+			MZAE_OPT_ZIP64: a non zero value gives the local header a
+			ZIP64 extra field, so that the entry can exceed 4 GiB;
+			writer only, before any data is fed. Without it, such an
+			entry fails with MZAE_ERR_TOOBIG (central directory and end
+			record switch to ZIP64 by themselves when needed)
+	value		value of the option
+
+	Returns zero for success.
+*/
+int MZAE_stream_setopt(MZAE_STREAM* s, int option, long value);
+
+
+
+/*
+	Starts a pool of worker threads.
+
+	pool		pointer receiving the pool
+	threads		number of threads (1 to MZAE_MAXTHREADS)
+
+	Returns zero for success.
+*/
+int MZAE_pool_create(MZAE_POOL** pool, int threads);
+
+
+/*
+	Queues a task for the first free worker. Tasks start in submission order.
+
+	pool		pool from MZAE_pool_create (if NULL, the task runs at once)
+	fn		task function
+	arg		passed to fn
+	group		if not NULL, a counter of the pending tasks of a group,
+			incremented now and decremented when the task ends
+
+	Returns zero for success.
+*/
+int MZAE_pool_submit(MZAE_POOL* pool, MZAE_TASKFN fn, void* arg, int* group);
+
+
+/*
+	Waits for all the tasks of a group to end.
+*/
+void MZAE_pool_wait(MZAE_POOL* pool, int* group);
+
+
+/*
+	Returns the number of threads of a pool.
+*/
+int MZAE_pool_threads(MZAE_POOL* pool);
+
+
+/*
+	Runs the tasks still queued, then stops the workers and frees the pool.
+*/
+void MZAE_pool_destroy(MZAE_POOL* pool);
+
+
+
+/*
+	Prepares the handles of the cryptographic library that can be shared by
+	many documents (random generator, cipher and MAC objects), so that the
+	*_ex functions don't set them up again on each call. MZAE_ctx_init creates
+	one for each context.
+	
+	engine		pointer receiving the engine
+
+	An engine must not be used by more threads at once, and must outlive the
+	states created with it.
+	Returns zero for success.
+*/
+int MZAE_engine_init(void** engine);
+
+
+/*
+	Releases an engine from MZAE_engine_init.
+*/
+void MZAE_engine_end(void* engine);
+
+
 /*
 	Generates a random salt for the keys derivation function.
 	
+	engine		engine from MZAE_engine_init, or NULL (_ex only)
 	salt		a pre allocated buffer receiving the salt
 	saltlen		length of the required salt (must be 8, 12 or 16)
 
 	Returns zero for success.
 */
 int MZAE_gen_salt(char* salt, int saltlen);
+int MZAE_gen_salt_ex(void* engine, char* salt, int saltlen);
 
 
 /*
@@ -125,6 +757,23 @@ int MZAE_gen_salt(char* salt, int saltlen);
 int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, char** hmac_key, char** vv);
 
 
+/*
+	Derives a key with PBKDF2-HMAC-SHA1 (RFC 2898), computing up to 4 output
+	blocks together with SIMD instructions where available.
+	
+	password	password to derive the key from
+	pwlen		its length in bytes
+	salt		the salt
+	saltlen		its length
+	iterations	number of rounds
+	dst			buffer receiving the key
+	dstlen		its length
+
+	Returns zero for success.
+*/
+int MZAE_pbkdf2_sha1(char* password, unsigned int pwlen, char* salt, int saltlen, int iterations, char* dst, int dstlen);
+
+
 /*
 	Encrypts data into a newly allocated buffer, using AES in CTR mode with a
 	little endian counter.
@@ -140,6 +789,67 @@ int MZAE_derive_keys(char* password, char* salt, int saltlen, char** aes_key, ch
 int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srclen, char** dst);
 
 
+/*
+	Encrypts (or decrypts) data in place, using AES in CTR mode with a little
+	endian counter, without allocating memory.
+	
+	key			the AES key computated with AE_derive_keys
+	keylen		its length in bytes
+	buf			points to the data to encrypt, replaced by the result
+	len			length of the data to encrypt
+
+	Returns zero for success.
+*/
+int MZAE_ctr_crypt_inplace(char* key, unsigned int keylen, char* buf, unsigned int len);
+
+
+/*
+	Prepares an incremental AES encryption in CTR mode with a little endian
+	counter.
+	
+	engine		engine from MZAE_engine_init, or NULL (_ex only)
+	key			the AES key computated with AE_derive_keys
+	keylen		its length in bytes
+	ctx			pointer receiving the encryption state
+
+	Returns zero for success.
+*/
+int MZAE_ctr_init(char* key, unsigned int keylen, void** ctx);
+int MZAE_ctr_init_ex(void* engine, char* key, unsigned int keylen, void** ctx);
+
+
+/*
+	Encrypts (or decrypts) the next chunk of data, continuing the counter
+	sequence where the previous call left it.
+	
+	ctx			encryption state from MZAE_ctr_init
+	src			points to the data to encrypt
+	srclen		length of the data to encrypt
+	dst			buffer receiving srclen encrypted bytes (may be src)
+
+	Returns zero for success.
+*/
+int MZAE_ctr_update(void* ctx, char* src, unsigned int srclen, char* dst);
+
+
+/*
+	Moves an encryption state at a given byte offset of the keystream, so that
+	separate states can process separate parts of the same data.
+	
+	ctx			encryption state from MZAE_ctr_init
+	offset		bytes of keystream to skip from its start
+
+	Returns zero for success.
+*/
+int MZAE_ctr_seek(void* ctx, unsigned long long offset);
+
+
+/*
+	Releases an encryption state from MZAE_ctr_init, wiping the key.
+*/
+void MZAE_ctr_end(void* ctx);
+
+
 /*
 	Computates the HMAC-SHA1 for a given buffer.
 	
@@ -154,6 +864,60 @@ int MZAE_ctr_crypt(char* key, unsigned int keylen, char* src, unsigned int srcle
 int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int srclen, char** hmac);
 
 
+/*
+	Prepares an incremental HMAC-SHA1 computation.
+	
+	engine		engine from MZAE_engine_init, or NULL (_ex only)
+	key			the HMAC key computated with AE_derive_keys
+	keylen		its length in bytes
+	ctx			pointer receiving the HMAC state
+
+	Returns zero for success.
+*/
+int MZAE_hmac_sha1_init(char* key, unsigned int keylen, void** ctx);
+int MZAE_hmac_sha1_init_ex(void* engine, char* key, unsigned int keylen, void** ctx);
+
+
+/*
+	Adds the next chunk of data to the HMAC.
+	
+	ctx			HMAC state from MZAE_hmac_sha1_init
+	src			points to the data
+	srclen		its length
+
+	Returns zero for success.
+*/
+int MZAE_hmac_sha1_update(void* ctx, char* src, unsigned int srclen);
+
+
+/*
+	Completes the HMAC and releases its state.
+	
+	ctx			HMAC state from MZAE_hmac_sha1_init
+	hmac		buffer receiving the 20-byte HMAC (the first 10 are stored)
+
+	Returns zero for success.
+*/
+int MZAE_hmac_sha1_final(void* ctx, char* hmac);
+
+
+/*
+	Encrypts then authenticates (or authenticates then decrypts) a chunk of
+	data, in blocks of MZAE_FUSED_BLOCK bytes, so that each byte is read from
+	memory once.
+	
+	ctr			encryption state from MZAE_ctr_init
+	hmac		HMAC state from MZAE_hmac_sha1_init
+	src			points to the data
+	srclen		its length
+	dst			buffer receiving srclen bytes (may be src)
+	decrypt		zero to encrypt src, non zero to decrypt it
+
+	Returns zero for success, or MZAE_ERR_AES or MZAE_ERR_HMAC.
+*/
+int MZAE_ctr_hmac_update(void* ctr, void* hmac, char* src, unsigned int srclen, char* dst, int decrypt);
+
+
 /*
 	Computates the ZIP crc32 (AE-1).
 	
@@ -166,6 +930,18 @@ int MZAE_hmac_sha1_80(char* key, unsigned int keylen, char* src, unsigned int sr
 unsigned long MZAE_crc(unsigned long crc, char* src, unsigned int srclen);
 
 
+/*
+	Combines the crc32 of two consecutive blocks.
+	
+	crc1		crc32 of the first block
+	crc2		crc32 of the second block
+	len2		length of the second block
+
+	Returns the crc32 of both blocks.
+*/
+unsigned long MZAE_crc_combine(unsigned long crc1, unsigned long crc2, unsigned long len2);
+
+
 /*
 	One pass deflate.
 	
@@ -180,6 +956,12 @@ unsigned long MZAE_crc(unsigned long crc, char* src, unsigned int srclen);
 int MZAE_deflate(char* src, unsigned int srclen, char** dst, unsigned int* dstlen);
 
 
+/*
+	Returns the maximum length of the Deflate stream from srclen bytes.
+*/
+unsigned long MZAE_deflate_bound(unsigned long srclen);
+
+
 /*
 	One pass inflate.
 	
@@ -193,6 +975,92 @@ int MZAE_deflate(char* src, unsigned int srclen, char** dst, unsigned int* dstle
 */
 int MZAE_inflate(char* src, unsigned int srclen, char* dst, unsigned int dstlen);
 
+
+/*
+	Compresses a block of a Deflate stream on its own, so that the blocks of
+	a stream can be compressed in parallel: each one but the last ends on a
+	byte boundary (sync flush), and the outputs are simply joined.
+	
+	level		compression level, from 1 (fastest) to 9 (smallest)
+	dict		the (up to) 32K bytes preceding the block, NULL for the first
+	dictlen		its length
+	src			uncompressed block
+	srclen		its length
+	last		non zero with the last block of the stream
+	dst			buffer receiving the compressed block, or NULL to ask if the
+				engine can compress blocks apart
+	dstlen		pointer to the dst size (at least MZAE_deflate_bound(srclen)
+				+ 64), receiving the compressed length
+
+	Returns zero for success.
+*/
+int MZAE_deflate_block(int level, char* dict, unsigned int dictlen, char* src, unsigned int srclen, int last, char* dst, unsigned int* dstlen);
+
+
+/*
+	Prepares an incremental deflate.
+	
+	ctx			pointer receiving the compressor state
+	level		compression level, from 1 (fastest) to 9 (smallest)
+
+	Returns zero for success.
+*/
+int MZAE_deflate_init(void** ctx, int level);
+
+
+/*
+	Compresses the next chunk of data.
+	
+	ctx			compressor state from MZAE_deflate_init
+	src			uncompressed data
+	srclen		its length
+	finish		non zero with the last chunk, to flush the stream
+	out			receives the compressed data, in chunks up to MZAE_CHUNK
+	opaque		passed to out
+
+	Returns zero for success.
+*/
+int MZAE_deflate_update(void* ctx, char* src, unsigned int srclen, int finish, MZAE_OUTFN out, void* opaque);
+
+
+/*
+	Releases a compressor state.
+*/
+void MZAE_deflate_end(void* ctx);
+
+
+/*
+	Prepares an incremental inflate.
+	
+	ctx			pointer receiving the decompressor state
+
+	Returns zero for success.
+*/
+int MZAE_inflate_init(void** ctx);
+
+
+/*
+	Decompresses the next chunk of data.
+	
+	ctx			decompressor state from MZAE_inflate_init
+	src			compressed data
+	srclen		its length, or zero after the last chunk: an engine
+				working on whole buffers decodes there
+	out			receives the uncompressed data, in chunks up to MZAE_CHUNK
+	opaque		passed to out
+
+	Returns zero for success.
+*/
+int MZAE_inflate_update(void* ctx, char* src, unsigned int srclen, MZAE_OUTFN out, void* opaque);
+
+
+/*
+	Releases a decompressor state.
+
+	Returns zero if the whole Deflate stream was decoded.
+*/
+int MZAE_inflate_end(void* ctx);
+
 # ifdef  __cplusplus
 }
 # endif
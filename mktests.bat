@@ -1,7 +1,16 @@
 @echo off 
-cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_openssl.c zdll.lib libcrypto.lib /link /libpath:\usr\lib /out:test1.exe 
-cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_botan.c zdll.lib botan.lib /link /libpath:\usr\lib /out:test2.exe 
-cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_gcrypt.c zdll.lib libgcrypt.lib /link /libpath:\usr\lib /out:test3.exe 
-cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_nss.c zdll.lib nss3.lib /link /libpath:\usr\lib /out:test4.exe 
+cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c zdll.lib libcrypto.lib /link /libpath:\usr\lib /out:test1.exe 
+cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_botan.c zdll.lib botan.lib /link /libpath:\usr\lib /out:test2.exe 
+cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_gcrypt.c zdll.lib libgcrypt.lib /link /libpath:\usr\lib /out:test3.exe 
+cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_nss.c zdll.lib nss3.lib /link /libpath:\usr\lib /out:test4.exe 
+cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_native.c zdll.lib bcrypt.lib /link /libpath:\usr\lib /out:test5.exe 
+cl -DMAIN -O2 -I. -I \usr\include MZAE_minizip.c MZAE_err.c MZAE_libdeflate.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c libdeflate.lib libcrypto.lib /link /libpath:\usr\lib /out:test6.exe 
 
-cl -MD -O2 -I. -I \usr\include cryptocmd.c MZAE_err.c MZAE_minizip.c MZAE_zlib.c MZAE_gcrypt.c zdll.lib libgcrypt.lib /link /libpath:\usr\lib
+cl -O2 -I. -I \usr\include -DBACKEND=openssl -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c zdll.lib libcrypto.lib /link /libpath:\usr\lib /out:bench1.exe 
+cl -O2 -I. -I \usr\include -DBACKEND=botan -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_botan.c zdll.lib botan.lib /link /libpath:\usr\lib /out:bench2.exe 
+cl -O2 -I. -I \usr\include -DBACKEND=gcrypt -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_gcrypt.c zdll.lib libgcrypt.lib /link /libpath:\usr\lib /out:bench3.exe 
+cl -O2 -I. -I \usr\include -DBACKEND=nss -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_nss.c zdll.lib nss3.lib /link /libpath:\usr\lib /out:bench4.exe 
+cl -O2 -I. -I \usr\include -DBACKEND=native -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_native.c zdll.lib bcrypt.lib /link /libpath:\usr\lib /out:bench5.exe 
+cl -O2 -I. -I \usr\include -DBACKEND=openssl -DCODEC=libdeflate mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_libdeflate.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c libdeflate.lib libcrypto.lib /link /libpath:\usr\lib /out:bench6.exe 
+
+cl -MD -O2 -I. -I \usr\include cryptocmd.c MZAE_err.c MZAE_minizip.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_gcrypt.c zdll.lib libgcrypt.lib /link /libpath:\usr\lib
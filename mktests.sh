@@ -1,6 +1,17 @@
-gcc -DMAIN -I. MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_openssl.c -lz -lcrypto -otest1.exe
+gcc -DMAIN -I. MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c -lz -lcrypto -lpthread -otest1.exe
 # Insecure AES/ECB is no longer supported in botan-2 library, and native CTR(AES-256,16) stream cipher is Big Endian only!
-#gcc -DMAIN -I. -I/mingw32/include/botan-2 MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_botan.c -lz -lbotan-2 -otest2.exe
-gcc -DMAIN -I. MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_gcrypt.c -lz -lgcrypt -otest3.exe
-gcc -DMAIN -I. -I/mingw32/include/nspr MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_nss.c -lz -lnss3 -otest4.exe
-gcc -I. cryptocmd.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_openssl.c -lz -lcrypto -lz -o cryptocmd.exe
+#gcc -DMAIN -I. -I/mingw32/include/botan-2 MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_botan.c -lz -lbotan-2 -otest2.exe
+gcc -DMAIN -I. MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_gcrypt.c -lz -lgcrypt -lpthread -otest3.exe
+gcc -DMAIN -I. -I/mingw32/include/nspr MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_nss.c -lz -lnss3 -lpthread -otest4.exe
+gcc -DMAIN -I. MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_native.c -lz -lpthread -otest5.exe
+# Deflate with libdeflate instead of Zlib
+gcc -DMAIN -I. MZAE_minizip.c MZAE_err.c MZAE_libdeflate.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c -ldeflate -lcrypto -lpthread -otest6.exe
+gcc -I. cryptocmd.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c -lz -lcrypto -lz -lpthread -o cryptocmd.exe
+# No third-party crypto library: can be linked statically
+gcc -O2 -static -I. cryptocmd.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_native.c -lz -lpthread -o cryptocmd-native.exe
+# Benchmarks of each stage, printing CSV lines (mzaebench /? for the options)
+gcc -O2 -I. -DBACKEND=openssl -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c -lz -lcrypto -lpthread -o bench1.exe
+gcc -O2 -I. -DBACKEND=gcrypt -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_gcrypt.c -lz -lgcrypt -lpthread -o bench3.exe
+gcc -O2 -I. -I/mingw32/include/nspr -DBACKEND=nss -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_nss.c -lz -lnss3 -lpthread -o bench4.exe
+gcc -O2 -I. -DBACKEND=native -DCODEC=zlib mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_zlib.c MZAE_thread.c MZAE_pbkdf2.c MZAE_native.c -lz -lpthread -o bench5.exe
+gcc -O2 -I. -DBACKEND=openssl -DCODEC=libdeflate mzaebench.c MZAE_minizip.c MZAE_err.c MZAE_libdeflate.c MZAE_thread.c MZAE_pbkdf2.c MZAE_openssl.c -ldeflate -lcrypto -lpthread -o bench6.exe
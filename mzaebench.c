@@ -0,0 +1,311 @@
+/*
+ *  Copyright (C) 2016, 2020  <maxpat78> <https://github.com/maxpat78>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Measures each stage of the library (keys derivation, AES-CTR, HMAC-SHA1,
+ * crc32, Deflate and Inflate) and whole MiniZipAEWrite/MiniZipAERead calls,
+ * on texts from 100 bytes up to 1 GiB, with the crypto and Deflate modules
+ * it is linked with. Results are printed as CSV lines, one for each stage
+ * and size:
+ *
+ *   crypto,codec,stage,bytes,runs,seconds,mb_s,usec
+ *
+ * where usec is the latency of a single run. BACKEND and CODEC name the
+ * modules in the output (e.g. -DBACKEND=openssl -DCODEC=zlib).
+ */
+#include <mZipAES.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#ifndef BACKEND
+#define BACKEND unknown
+#endif
+#ifndef CODEC
+#define CODEC unknown
+#endif
+#define STR(x)  #x
+#define XSTR(x) STR(x)
+
+#define MAXSIZE     (1UL << 30)
+#define MINTIME     0.5         // seconds spent on each stage and size
+
+static char password[] = "kazookazaa";
+static volatile unsigned long crc;     // keeps MZAE_crc calls from being optimized away
+
+// Buffers shared by the stages of a size
+typedef struct {
+    char *src;                  // the text
+    unsigned long len;
+    char *buf;                  // output of the stage
+    char *zip;                  // archive of the text
+    unsigned long ziplen;
+    char *def;                  // deflated text
+    unsigned int deflen;
+    char key[32];
+    char salt[16];
+} BENCH;
+
+typedef int (*STAGEFN)(BENCH* b);
+
+
+
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double) c.QuadPart / f.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+
+// Fills a buffer with pseudo random words, compressible like a real text:
+// a vocabulary of 2048 words, the first ones more frequent
+static void make_text(char* p, unsigned long len)
+{
+    static char words[2048][12];
+    unsigned long seed = 12345, r, n, j;
+    char *w;
+    int i;
+
+    for (i = 0; i < 2048; i++) {
+        seed = seed * 1103515245UL + 12345UL;
+        n = 2 + (seed >> 16) % 9;
+        for (j = 0; j < n; j++) {
+            seed = seed * 1103515245UL + 12345UL;
+            words[i][j] = 'a' + (seed >> 16) % 26;
+        }
+        words[i][j] = (seed >> 8) % 11? ' ' : '\n';
+        words[i][j+1] = 0;
+    }
+
+    while (len) {
+        seed = seed * 1103515245UL + 12345UL;
+        r = (seed >> 16) & 2047;
+        w = words[r * r / 2048];
+        for (n = 0; w[n] && n < len; n++)
+            *p++ = w[n];
+        len -= n;
+    }
+}
+
+
+
+static int stage_kdf(BENCH* b)
+{
+    char *aes_key, *hmac_key, *vv;
+
+    if (MZAE_derive_keys(password, b->salt, 16, &aes_key, &hmac_key, &vv))
+        return 1;
+    free(aes_key);
+    return 0;
+}
+
+
+
+static int stage_ctr(BENCH* b)
+{
+    char *dst;
+
+    if (MZAE_ctr_crypt(b->key, 32, b->src, b->len, &dst))
+        return 1;
+    free(dst);
+    return 0;
+}
+
+
+
+static int stage_hmac(BENCH* b)
+{
+    char *mac;
+
+    if (MZAE_hmac_sha1_80(b->key, 32, b->src, b->len, &mac))
+        return 1;
+    free(mac);
+    return 0;
+}
+
+
+
+static int stage_crc(BENCH* b)
+{
+    crc = MZAE_crc(0, b->src, b->len);
+    return 0;
+}
+
+
+
+static int stage_deflate(BENCH* b)
+{
+    char *dst;
+    unsigned int dstlen;
+
+    if (MZAE_deflate(b->src, b->len, &dst, &dstlen))
+        return 1;
+    free(dst);
+    return 0;
+}
+
+
+
+static int stage_inflate(BENCH* b)
+{
+    return MZAE_inflate(b->def, b->deflen, b->buf, b->len);
+}
+
+
+
+static int stage_write(BENCH* b)
+{
+    unsigned long len = MiniZipAEWriteBound(b->len);
+
+    return MiniZipAEWrite(b->src, b->len, &b->buf, &len, password);
+}
+
+
+
+static int stage_read(BENCH* b)
+{
+    unsigned long len = b->len;
+
+    return MiniZipAERead(b->zip, b->ziplen, &b->buf, &len, password);
+}
+
+
+
+// Runs a stage for at least MINTIME seconds, then prints its CSV line
+static void run_stage(char* name, STAGEFN fn, BENCH* b, double mintime)
+{
+    double t, start;
+    unsigned long runs = 0;
+
+    start = now();
+    do {
+        if (fn(b)) {
+            fprintf(stderr, "%s failed on %lu bytes\n", name, b->len);
+            return;
+        }
+        runs++;
+        t = now() - start;
+    } while (t < mintime);
+
+    printf("%s,%s,%s,%lu,%lu,%.6f,%.2f,%.3f\n", XSTR(BACKEND), XSTR(CODEC), name, b->len, runs, t,
+        t > 0? (double) b->len * runs / t / 1048576 : 0.0, t * 1e6 / runs);
+    fflush(stdout);
+}
+
+
+
+static void free_bench(BENCH* b)
+{
+    free(b->src);
+    free(b->buf);
+    free(b->zip);
+    free(b->def);
+    memset(b, 0, sizeof(BENCH));
+}
+
+
+
+// Prepares the text of a size, with its archive and Deflate stream
+static int setup(BENCH* b, unsigned long len)
+{
+    unsigned long bound = MiniZipAEWriteBound(len);
+
+    b->len = len;
+    b->src = (char*) malloc(len);
+    b->buf = (char*) malloc(bound);
+    b->zip = (char*) malloc(bound);
+    if (!b->src || !b->buf || !b->zip)
+        return 1;
+    make_text(b->src, len);
+
+    b->ziplen = bound;
+    if (MiniZipAEWrite(b->src, len, &b->zip, &b->ziplen, password))
+        return 1;
+
+    return MZAE_deflate(b->src, len, &b->def, &b->deflen);
+}
+
+
+
+int main(int argc, char** argv)
+{
+    BENCH b;
+    unsigned long len, maxsize = MAXSIZE;
+    double mintime = MINTIME;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '/' && toupper(argv[i][1]) == 'M')
+            maxsize = strtoul(argv[i] + (argv[i][2] == ':'? 3 : 2), 0, 0);
+        else if (argv[i][0] == '/' && toupper(argv[i][1]) == 'T')
+            mintime = atof(argv[i] + (argv[i][2] == ':'? 3 : 2));
+        else {
+            printf("Measures each stage of the library, printing CSV lines.\n\n" \
+            "MZAEBENCH [/M:bytes] [/T:seconds]\n\n" \
+            "  /M:bytes   largest text to process (default: %lu)\n" \
+            "  /T:s       seconds spent on each stage and size (default: %.1f)\n", MAXSIZE, MINTIME);
+            return 1;
+        }
+    }
+
+    printf("crypto,codec,stage,bytes,runs,seconds,mb_s,usec\n");
+
+    // The keys derivation doesn't depend on the text
+    memset(&b, 0, sizeof(BENCH));
+    memcpy(b.salt, "0123456789abcdef", 16);
+    run_stage("kdf", stage_kdf, &b, mintime);
+
+    // 100 bytes, then 1K, 16K, 256K, 4M, 64M and 1G
+    for (len = 100; len && len <= maxsize; len = len == 100? 1024 : len * 16) {
+        memset(&b, 0, sizeof(BENCH));
+        memset(b.key, 0x55, 32);
+        if (setup(&b, len)) {
+            fprintf(stderr, "Can't prepare %lu bytes of text!\n", len);
+            free_bench(&b);
+            break;
+        }
+        run_stage("ctr", stage_ctr, &b, mintime);
+        run_stage("hmac", stage_hmac, &b, mintime);
+        run_stage("crc", stage_crc, &b, mintime);
+        run_stage("deflate", stage_deflate, &b, mintime);
+        run_stage("inflate", stage_inflate, &b, mintime);
+        run_stage("write", stage_write, &b, mintime);
+        run_stage("read", stage_read, &b, mintime);
+        free_bench(&b);
+    }
+
+    return 0;
+}